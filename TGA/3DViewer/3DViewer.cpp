@@ -10,16 +10,31 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include <3DViewer/shader.h>
+#include <3DViewer/ambientocclusion.h>
 #include <3DViewer/camera.h>
 #include <3DViewer/model.h>
 #include <3DViewer/animation.h>
+#include <3DViewer/animationsystem.h>
+#include <3DViewer/flythrough.h>
+#include <3DViewer/frameuniforms.h>
+#include <3DViewer/headless.h>
+#include <3DViewer/modelloader.h>
+#include <3DViewer/modelmanager.h>
+#include <3DViewer/raytracer.h>
+#include <3DViewer/softwarerenderer.h>
+#include <3DViewer/staticbatch.h>
 
 #include <iostream>
-#include <Windows.h>
 #include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <string>
 #include <map>
+#ifdef _WIN32
+#include <Windows.h>
 #include <shobjidl.h> 
+#endif
 
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
@@ -32,13 +47,26 @@ void processInput(GLFWwindow* window);
 void loadModel(std::string& path);
 void loadScene(std::string& path);
 bool openFile();
-void renderLights(Shader& shader);
+void updateFrame();
 void renderModels(Shader& shader);
+void renderSoftware();
+void buildStaticBatches();
+void setupRenderer(Shader& shader);
+void releaseRenderer();
+int renderHeadless(int argc, char** argv);
+int benchmarkSoftware(int argc, char** argv);
+int benchmarkRayTracer(int argc, char** argv);
+int bakeAmbientOcclusion(int argc, char** argv);
+int benchmarkFlythrough(int argc, char** argv);
+Animation readCurve(const json& curve, float duration);
+std::string applyPose(const json& pose, size_t index);
 
 // object
 struct ObjectModel {
 	std::string name;
-	Model model;
+	ModelHandle model;
+	// file the model was loaded from, which the software renderer draws by
+	std::string path;
 	bool isAnimated;
 	float translateX;
 	float translateY;
@@ -51,11 +79,25 @@ struct ObjectModel {
 	float rotateZ;
 	bool animateScale;
 	float scale;
+	unsigned int lod = 0;
+	// keeps the model's geometry on the CPU (picking, physics, export)
+	bool cpuAccess = false;
+	// drawn from a static batch instead of its model
+	bool batched = false;
+	// its curve in animationSystem
+	int animationTrack = ANIMATION_NO_TRACK;
+	// skeletal clip of skinned models, and how far ahead of the clock it plays
+	unsigned int clip = 0;
+	float clipOffset = 0.0f;
+
+	bool isStatic() const { return !isAnimated && !animateRotationX && !animateRotationY && !animateRotationZ && !animateScale; }
 };
 
 // settings
 const unsigned int SCR_WIDTH = 1600;
 const unsigned int SCR_HEIGHT = 900;
+unsigned int viewportWidth = SCR_WIDTH;
+unsigned int viewportHeight = SCR_HEIGHT;
 
 // camera
 Camera camera(glm::vec3(0.0f, 0.0f, 5.0f));
@@ -76,10 +118,18 @@ std::string sFilePath;
 
 // models
 std::map<std::string, ObjectModel> models;
-std::map<std::string, Animation> animations;
+AnimationSystem animationSystem;
+float animationTime = 0.0f;
 std::string selectedModel;
 bool editing = false;
 bool wireframe = false;
+bool culling = true;
+bool lodLevels = true;
+CullingStats cullingStats;
+RenderQueue renderQueue;
+StaticBatcher staticBatcher;
+// baked for the static objects of the scene, see --bake-ao
+AmbientOcclusion ambientOcclusion;
 
 // lighting
 bool spotlight = true;
@@ -87,9 +137,37 @@ glm::vec3 lightDirection = { -0.2f, -1.0f, -0.3f };
 glm::vec3 lightAmbient = { 0.5f, 0.5f, 0.5f };
 glm::vec3 lightDiffuse = { 0.4f, 0.4f, 0.4f };
 glm::vec3 lightSpecular = { 0.5f, 0.5f, 0.5f };
-
-int main()
+FrameUniforms frame;
+
+// CPU rendering without any GL, only off the window: --headless takes it with
+// --renderer software, or --renderer raytrace to trace rays rather than rasterize, and
+// the software and ray tracing benchmarks and --bake-ao always use it. The window
+// always rasterizes with GL.
+bool softwareRendering = false;
+bool rayTracing = false;
+SoftwareModels softwareModels;
+SoftwareRenderer softwareRenderer;
+RayTracer rayTracer;
+
+int main(int argc, char** argv)
 {
+	// 3DViewer --bench-animation [tracks]: scalar against SIMD curve evaluation
+	if (argc > 1 && std::string(argv[1]) == "--bench-animation")
+	{
+		AnimationSystem::benchmark(argc > 2 ? std::stoul(argv[2]) : 100000);
+		return 0;
+	}
+	if (argc > 1 && std::string(argv[1]) == "--headless")
+		return renderHeadless(argc, argv);
+	if (argc > 1 && std::string(argv[1]) == "--bench-software")
+		return benchmarkSoftware(argc, argv);
+	if (argc > 1 && std::string(argv[1]) == "--bench-raytrace")
+		return benchmarkRayTracer(argc, argv);
+	if (argc > 1 && std::string(argv[1]) == "--bake-ao")
+		return bakeAmbientOcclusion(argc, argv);
+	if (argc > 1 && std::string(argv[1]) == "--bench-flythrough")
+		return benchmarkFlythrough(argc, argv);
+
 	glfwInit();
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
@@ -116,13 +194,8 @@ int main()
 		return -1;
 	}
 
-	stbi_set_flip_vertically_on_load(true);
-
-	glEnable(GL_DEPTH_TEST);
 	Shader shader("shader.vs", "shader.fs");
-	shader.use();
-	shader.setInt("material.diffuse", 0);
-	shader.setInt("material.specular", 1);
+	setupRenderer(shader);
 
 	//IMGUI
 	IMGUI_CHECKVERSION();
@@ -148,7 +221,9 @@ int main()
 		ImGui_ImplGlfw_NewFrame();
 		ImGui::NewFrame();
 
-		renderLights(shader);
+		updateFrame();
+		animationTime += deltaTime;
+		animationSystem.evaluate(animationTime);
 		renderModels(shader);
 
 		//IMGUI
@@ -167,6 +242,91 @@ int main()
 		ImGui::Text(std::to_string(camera.MovementSpeed).c_str());
 		ImGui::End();
 
+		ImGui::Begin("Mesh Cache");
+		ImGui::Text("Hits: %u", MeshCache::stats.hits.load());
+		ImGui::Text("Misses: %u (stale: %u)", MeshCache::stats.misses.load(), MeshCache::stats.stale.load());
+		ImGui::Text("Mapped: %zu KB", MeshCache::stats.bytesMapped.load() / 1024);
+		ImGui::Text("Hit time: %.1f ms", MeshCache::stats.hitMilliseconds());
+		ImGui::Text("Miss time: %.1f ms", MeshCache::stats.missMilliseconds());
+		ImGui::End();
+
+		ImGui::Begin("Culling");
+		ImGui::Checkbox("Frustum culling", &culling);
+		ImGui::Text("Meshes drawn: %u", cullingStats.meshesDrawn);
+		ImGui::Text("Meshes culled: %u", cullingStats.meshesCulled);
+		ImGui::End();
+
+		ImGui::Begin("Render Queue");
+		ImGui::Checkbox("Levels of detail", &lodLevels);
+		ImGui::Text("Draws: %u", renderQueue.draws);
+		ImGui::Text("Triangles: %zu", renderQueue.triangles);
+		ImGui::Text("Program binds: %u", renderQueue.state.stats.programBinds);
+		ImGui::Text("VAO binds: %u", renderQueue.state.stats.vertexArrayBinds);
+		ImGui::Text("Texture binds: %u", renderQueue.state.stats.textureBinds);
+		ImGui::Text("Sampler sets: %u", renderQueue.state.stats.samplerSets);
+		ImGui::Text("Skipped: %u", renderQueue.state.stats.skipped);
+		ImGui::Text("Static batches: %u (objects: %u, meshes: %u)", staticBatcher.stats.batches, staticBatcher.stats.objects, staticBatcher.stats.meshes);
+		ImGui::Text("Bone palettes: %u (%u matrices, shared: %u)", BonePalette::instance().stats.palettes, BonePalette::instance().stats.matrices, BonePalette::instance().stats.shared);
+		ImGui::End();
+
+		ImGui::Begin("Animation");
+		ImGui::Text("Tracks: %u (segments: %u)", animationSystem.stats.tracks, animationSystem.stats.segments);
+		ImGui::Text("Evaluation: %.1f us (jobs: %u)", animationSystem.stats.microseconds, animationSystem.stats.jobs);
+		ImGui::End();
+
+		ImGui::Begin("Geometry Arena");
+		ImGui::Text("Blocks: %u", GeometryArena::instance().stats.blocks);
+		ImGui::Text("Meshes: %u", GeometryArena::instance().stats.allocations);
+		ImGui::Text("Used: %zu KB of %zu KB", GeometryArena::instance().stats.bytesUsed / 1024, GeometryArena::instance().stats.bytesCapacity / 1024);
+		ImGui::Text("Compaction: %u moves, %zu KB", GeometryArena::instance().stats.moves, GeometryArena::instance().stats.bytesMoved / 1024);
+		ImGui::End();
+
+		ImGui::Begin("Mesh Optimizer");
+		ImGui::Text("Meshes optimized: %u", MeshOptimizer::stats.meshes.load());
+		ImGui::Text("Vertices: %zu -> %zu", MeshOptimizer::stats.verticesBefore.load(), MeshOptimizer::stats.verticesAfter.load());
+		ImGui::Text("ACMR: %.3f -> %.3f", MeshOptimizer::stats.acmrBefore(), MeshOptimizer::stats.acmrAfter());
+		ImGui::End();
+
+		ImGui::Begin("Vertex Format");
+		ImGui::Text("Stride: %zu bytes (unpacked: %zu)", VertexLayout::active().stride(), sizeof(Vertex));
+		ImGui::Text("Uploaded: %zu KB (unpacked: %zu KB)", VertexLayout::stats.bytesPacked / 1024, VertexLayout::stats.bytesUnpacked / 1024);
+		ImGui::End();
+
+		TextureCacheStats textureStats = TextureCache::instance().getStats();
+		ImGui::Begin("Texture Cache");
+		ImGui::Text("Textures: %u (references: %u)", textureStats.textures, textureStats.references);
+		ImGui::Text("Decoded: %u (skipped: %u)", textureStats.decodes, textureStats.decodesSkipped);
+		ImGui::Text("Resident: %zu KB", textureStats.bytesResident / 1024);
+		ImGui::Text("Saved: %zu KB", textureStats.bytesSaved / 1024);
+		ImGui::End();
+
+		std::vector<ResidentModel> residentModels = ModelManager::instance().resident();
+		std::vector<ResidentTexture> residentTextures = TextureCache::instance().resident();
+		size_t modelCpuBytes = 0, modelGpuBytes = 0, textureBytes = 0;
+		for (const ResidentModel& model : residentModels) {
+			modelCpuBytes += model.memory.cpuBytes;
+			modelGpuBytes += model.memory.gpuBytes;
+		}
+		for (const ResidentTexture& texture : residentTextures)
+			textureBytes += texture.bytes;
+		ImGui::Begin("Memory");
+		ImGui::Text("Buffers: %u created, %u reused", GLResources::instance().stats.buffersCreated, GLResources::instance().stats.buffersReused);
+		ImGui::Text("Textures: %u created, %u reused", GLResources::instance().stats.texturesCreated, GLResources::instance().stats.texturesReused);
+		ImGui::Text("Pending deletion: %u (deleted: %u)", GLResources::instance().stats.pending, GLResources::instance().stats.deleted);
+		ImGui::Text("Pooled: %zu KB", GLResources::instance().stats.pooledBytes / 1024);
+		ImGui::Text("Geometry CPU: %zu KB", modelCpuBytes / 1024);
+		ImGui::Text("Geometry GPU: %zu KB", modelGpuBytes / 1024);
+		ImGui::Text("Textures GPU: %zu KB", textureBytes / 1024);
+		if (ImGui::CollapsingHeader("Models")) {
+			for (const ResidentModel& model : residentModels)
+				ImGui::Text("%s (%u): CPU %zu KB GPU %zu KB", model.path.c_str(), model.references, model.memory.cpuBytes / 1024, model.memory.gpuBytes / 1024);
+		}
+		if (ImGui::CollapsingHeader("Textures")) {
+			for (const ResidentTexture& texture : residentTextures)
+				ImGui::Text("%s (%u): %zu KB", texture.name.c_str(), texture.references, texture.bytes / 1024);
+		}
+		ImGui::End();
+
 		ImGui::Begin("Objects");
 		for (std::map<std::string, ObjectModel>::iterator it = models.begin(); it != models.end(); ++it) {
 			if (ImGui::Button(it->first.c_str())) {
@@ -186,14 +346,23 @@ int main()
 			ObjectModel& model = models.at(selectedModel);
 
 			ImGui::Begin(selectedModel.c_str());
-			ImGui::SliderFloat("Translate X", &model.translateX, -100.0f, 100.0f);
-			ImGui::SliderFloat("Translate Y", &model.translateY, -100.0f, 100.0f);
-			ImGui::SliderFloat("Translate Z", &model.translateZ, -100.0f, 100.0f);
-			ImGui::SliderFloat("Rotate X", &model.rotateX, 0.0f, 360.0f);
-			ImGui::SliderFloat("Rotate Y", &model.rotateY, 0.0f, 360.0f);
-			ImGui::SliderFloat("Rotate Z", &model.rotateZ, 0.0f, 360.0f);
-			ImGui::SliderFloat("Scale", &model.scale, 0.001f, 10.0f);
+			bool edited = false;
+			edited |= ImGui::SliderFloat("Translate X", &model.translateX, -100.0f, 100.0f);
+			edited |= ImGui::SliderFloat("Translate Y", &model.translateY, -100.0f, 100.0f);
+			edited |= ImGui::SliderFloat("Translate Z", &model.translateZ, -100.0f, 100.0f);
+			edited |= ImGui::SliderFloat("Rotate X", &model.rotateX, 0.0f, 360.0f);
+			edited |= ImGui::SliderFloat("Rotate Y", &model.rotateY, 0.0f, 360.0f);
+			edited |= ImGui::SliderFloat("Rotate Z", &model.rotateZ, 0.0f, 360.0f);
+			edited |= ImGui::SliderFloat("Scale", &model.scale, 0.001f, 10.0f);
 			ImGui::End();
+
+			// a moved object leaves its static batch and draws on its own from now on
+			if (edited && model.batched) {
+				staticBatcher.remove(selectedModel);
+				model.batched = false;
+				for (const std::string& name : staticBatcher.takeOrphans())
+					models.at(name).batched = false;
+			}
 		}
 
 		ImGui::Render();
@@ -201,6 +370,8 @@ int main()
 
 		glfwSwapBuffers(window);
 		glfwPollEvents();
+		GeometryArena::instance().endFrame();
+		GLResources::instance().endFrame();
 	}
 
 	//Shutdown imgui
@@ -208,68 +379,633 @@ int main()
 	ImGui_ImplGlfw_Shutdown();
 	ImGui::DestroyContext();
 
+	releaseRenderer();
 	glfwTerminate();
 	return 0;
 }
 
-void renderLights(Shader& shader) {
+// program state shared by the window and headless modes; a context must be current
+void setupRenderer(Shader& shader) {
+	stbi_set_flip_vertically_on_load(true);
+
+	glEnable(GL_DEPTH_TEST);
 	shader.use();
-	shader.setVec3("viewPos", camera.Position);
+	shader.setInt("material.diffuse", 0);
+	shader.setInt("material.specular", 1);
 	shader.setFloat("material.shininess", 32.0f);
+	shader.setInt("bonePalette", BONE_PALETTE_TEXTURE_UNIT);
+	shader.setInt("ambientOcclusion", AMBIENT_OCCLUSION_TEXTURE_UNIT);
+	frame.create();
+	frame.attach(shader);
+	// meshes upload only the inputs shader.vs reads, with 16 bit positions
+	VertexLayout::active() = VertexLayout::fromProgram(shader.ID, true);
+	animationSystem.setWorkers(std::max(1u, std::thread::hardware_concurrency()) - 1);
+}
 
-	shader.setVec3("dirLight.direction", lightDirection);
-	shader.setVec3("dirLight.ambient", lightAmbient);
-	shader.setVec3("dirLight.diffuse", lightDiffuse);
-	shader.setVec3("dirLight.specular", lightSpecular);
+// GL objects go while the context is still alive
+void releaseRenderer() {
+	if (softwareRendering) {
+		models.clear();
+		softwareModels.clear();
+		return;
+	}
+	for (auto& x : models)
+		ModelManager::instance().release(x.second.model);
+	models.clear();
+	staticBatcher.clear();
+	ambientOcclusion.clear();
+	BonePalette::instance().clear();
+	GeometryArena::instance().clear();
+	GLResources::instance().clear();
+}
+
+// 3DViewer --headless <scene.json> <output directory> [poses.json] [--size 1600x900] [--format png|ppm]
+//                     [--renderer gl|software|raytrace] [--supersample 1]
+// renders the scene without a window, once per camera pose in poses.json or once from
+// the scene's camera, to <output directory>/<pose name or index>.<format>. A pose may
+// set "position", "yaw"/"pitch" or "front", "zoom", the animation "time" and a "name".
+// The software renderer and the ray tracer need no GL at all; the ray tracer takes an
+// n by n grid of samples per pixel.
+int renderHeadless(int argc, char** argv) {
+	std::vector<std::string> arguments;
+	std::string format = "png";
+	int width = SCR_WIDTH;
+	int height = SCR_HEIGHT;
+	int supersample = 1;
+	for (int i = 2; i < argc; i++) {
+		std::string argument = argv[i];
+		if (argument == "--size" && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else if (argument == "--format" && i + 1 < argc)
+			format = argv[++i];
+		else if (argument == "--renderer" && i + 1 < argc) {
+			std::string renderer = argv[++i];
+			rayTracing = renderer == "raytrace";
+			softwareRendering = rayTracing || renderer == "software";
+		}
+		else if (argument == "--supersample" && i + 1 < argc)
+			supersample = std::max(1, std::atoi(argv[++i]));
+		else
+			arguments.push_back(argument);
+	}
+	if (arguments.size() < 2 || width <= 0 || height <= 0) {
+		std::cout << "usage: 3DViewer --headless <scene.json> <output directory> [poses.json] [--size WxH] [--format png|ppm] [--renderer gl|software|raytrace] [--supersample N]" << std::endl;
+		return -1;
+	}
+
+	OffscreenContext context;
+	OffscreenTarget target;
+	std::unique_ptr<Shader> shader;
+	if (rayTracing) {
+		stbi_set_flip_vertically_on_load(true);
+		rayTracer.setWorkers(std::max(1u, std::thread::hardware_concurrency()) - 1);
+		rayTracer.setSupersampling(supersample);
+		if (!rayTracer.resize(width, height))
+			return -1;
+	}
+	else if (softwareRendering) {
+		stbi_set_flip_vertically_on_load(true);
+		softwareRenderer.setWorkers(std::max(1u, std::thread::hardware_concurrency()) - 1);
+		if (!softwareRenderer.resize(width, height))
+			return -1;
+	}
+	else {
+		if (!context.create())
+			return -1;
+		shader = std::make_unique<Shader>("shader.vs", "shader.fs");
+		setupRenderer(*shader);
+		if (!target.create(width, height))
+			return -1;
+	}
+	viewportWidth = width;
+	viewportHeight = height;
+
+	json poses = json::array();
+	if (arguments.size() > 2) {
+		std::ifstream data(arguments[2]);
+		poses = json::parse(data);
+	}
+	if (poses.empty())
+		poses.push_back(json::object());
+	loadScene(arguments[0]);
+	std::filesystem::create_directories(arguments[1]);
+
+	{
+		std::unique_ptr<FrameReadback> readback;
+		if (!softwareRendering)
+			readback = std::make_unique<FrameReadback>(width, height);
+		std::vector<std::future<bool>> writes;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < poses.size(); i++) {
+			std::string path = arguments[1] + "/" + applyPose(poses[i], i) + "." + format;
+			animationSystem.evaluate(animationTime);
+			updateFrame();
+
+			if (softwareRendering) {
+				renderSoftware();
+				// the next frame overwrites the target, the writer gets a copy
+				auto pixels = std::make_shared<std::vector<unsigned char>>(rayTracing ? rayTracer.pixels() : softwareRenderer.pixels());
+				writes.push_back(ThreadPool::shared().submit([path, width, height, pixels] { return WriteImage(path, width, height, *pixels); }));
+				continue;
+			}
+
+			target.bind();
+			glClearColor(0.05f, 0.05f, 0.05f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			renderModels(*shader);
+			readback->request(path);
+
+			GeometryArena::instance().endFrame();
+			GLResources::instance().endFrame();
+		}
+		unsigned int failed = 0;
+		for (std::future<bool>& write : writes)
+			failed += !write.get();
+		if (readback)
+			readback->finish();
+
+		double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "HEADLESS:: " << poses.size() << " frames of " << width << "x" << height << " in " << milliseconds << " ms, "
+			<< poses.size() * 1000.0 / std::max(milliseconds, 1e-3) << " fps" << std::endl;
+		if (readback)
+			readback->report();
+		else {
+			std::cout << "HEADLESS:: written: " << writes.size() - failed << " failed: " << failed << std::endl;
+			if (rayTracing)
+				rayTracer.report();
+			else
+				softwareRenderer.report();
+		}
+	}
+
+	if (!softwareRendering)
+		target.destroy();
+	releaseRenderer();
+	return 0;
+}
+
+// camera and animation clock of one entry of a poses file; returns the image name
+std::string applyPose(const json& pose, size_t index) {
+	if (pose.contains("position"))
+		camera.Position = glm::vec3(pose.at("position").at("x"), pose.at("position").at("y"), pose.at("position").at("z"));
+	if (pose.contains("yaw") || pose.contains("pitch")) {
+		camera.Yaw = pose.value("yaw", camera.Yaw);
+		camera.Pitch = pose.value("pitch", camera.Pitch);
+		camera.ProcessMouseMovement(0.0f, 0.0f);
+	}
+	else if (pose.contains("front"))
+		camera.Front = glm::normalize(glm::vec3(pose.at("front").at("x"), pose.at("front").at("y"), pose.at("front").at("z")));
+	camera.Zoom = pose.value("zoom", camera.Zoom);
+
+	float time = pose.value("time", animationTime);
+	deltaTime = time - animationTime;
+	animationTime = time;
+	return pose.value("name", std::to_string(index));
+}
+
+// 3DViewer --bench-software [scene.json] [frames] [--size 1600x900]
+// software renderer throughput on one thread and on every core, the scene's objects
+// moving on the animation clock at 60 frames a second
+int benchmarkSoftware(int argc, char** argv) {
+	std::string scenePath = "resources/scenes/scene.json";
+	int frames = 60;
+	int width = SCR_WIDTH;
+	int height = SCR_HEIGHT;
+	std::vector<std::string> arguments;
+	for (int i = 2; i < argc; i++) {
+		std::string argument = argv[i];
+		if (argument == "--size" && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else
+			arguments.push_back(argument);
+	}
+	if (arguments.size() > 0)
+		scenePath = arguments[0];
+	if (arguments.size() > 1)
+		frames = std::max(1, std::stoi(arguments[1]));
+
+	softwareRendering = true;
+	stbi_set_flip_vertically_on_load(true);
+	if (!softwareRenderer.resize(width, height))
+		return -1;
+	viewportWidth = width;
+	viewportHeight = height;
+	loadScene(scenePath);
+
+	unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned int> workerCounts = { 1u };
+	if (cores > 1)
+		workerCounts.push_back(cores);
+	for (unsigned int workers : workerCounts) {
+		softwareRenderer.setWorkers(workers - 1);
+		animationTime = 0.0f;
+		animationSystem.evaluate(animationTime);
+		updateFrame();
+		renderSoftware();
+
+		double milliseconds = 0.0;
+		size_t triangles = 0;
+		for (int f = 0; f < frames; f++) {
+			animationTime += 1.0f / 60.0f;
+			animationSystem.evaluate(animationTime);
+			updateFrame();
+			auto start = std::chrono::steady_clock::now();
+			renderSoftware();
+			milliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			triangles += softwareRenderer.stats.triangles;
+		}
+		double seconds = milliseconds / 1000.0;
+		std::cout << "SOFTWARE_BENCH:: " << workers << " workers, " << frames << " frames of " << width << "x" << height << ": "
+			<< milliseconds / frames << " ms/frame, " << double(width) * height * frames / seconds / 1e6 << " Mpixels/s, "
+			<< triangles / seconds / 1e6 << " Mtriangles/s" << std::endl;
+		softwareRenderer.report();
+	}
+
+	releaseRenderer();
+	return 0;
+}
+
+// 3DViewer --bench-raytrace [scene.json] [frames] [--size 1600x900] [--supersample 1]
+// ray tracer throughput from the scene's camera on one worker, then doubling up to
+// every core, with the speedup over one worker; the BVH build is timed apart
+int benchmarkRayTracer(int argc, char** argv) {
+	std::string scenePath = "resources/scenes/scene.json";
+	int frames = 3;
+	int width = SCR_WIDTH;
+	int height = SCR_HEIGHT;
+	int supersample = 1;
+	std::vector<std::string> arguments;
+	for (int i = 2; i < argc; i++) {
+		std::string argument = argv[i];
+		if (argument == "--size" && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else if (argument == "--supersample" && i + 1 < argc)
+			supersample = std::max(1, std::atoi(argv[++i]));
+		else
+			arguments.push_back(argument);
+	}
+	if (arguments.size() > 0)
+		scenePath = arguments[0];
+	if (arguments.size() > 1)
+		frames = std::max(1, std::stoi(arguments[1]));
+
+	softwareRendering = true;
+	rayTracing = true;
+	stbi_set_flip_vertically_on_load(true);
+	rayTracer.setSupersampling(supersample);
+	if (!rayTracer.resize(width, height))
+		return -1;
+	viewportWidth = width;
+	viewportHeight = height;
+	loadScene(scenePath);
+	animationSystem.evaluate(animationTime);
+	updateFrame();
+
+	unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned int> workerCounts;
+	for (unsigned int workers = 1; workers < cores; workers *= 2)
+		workerCounts.push_back(workers);
+	workerCounts.push_back(cores);
+	double single = 0.0;
+	for (unsigned int workers : workerCounts) {
+		rayTracer.setWorkers(workers - 1);
+		renderSoftware();
+
+		double rays = 0.0, traceMilliseconds = 0.0, buildMilliseconds = 0.0;
+		for (int f = 0; f < frames; f++) {
+			renderSoftware();
+			rays += double(rayTracer.stats.primaryRays + rayTracer.stats.shadowRays);
+			traceMilliseconds += rayTracer.stats.traceMilliseconds;
+			buildMilliseconds += rayTracer.stats.buildMilliseconds;
+		}
+		double raysPerSecond = rays * 1000.0 / std::max(traceMilliseconds, 1e-3);
+		if (workers == 1)
+			single = raysPerSecond;
+		double speedup = raysPerSecond / std::max(single, 1.0);
+		std::cout << "RAYTRACE_BENCH:: " << workers << " workers, " << frames << " frames of " << width << "x" << height << ": "
+			<< raysPerSecond / 1e6 << " Mrays/s, speedup " << speedup << " (" << 100.0 * speedup / workers << "% of linear), "
+			<< traceMilliseconds / frames << " ms trace, " << buildMilliseconds / frames << " ms build" << std::endl;
+	}
+	rayTracer.report();
+
+	releaseRenderer();
+	return 0;
+}
+
+void updateFrame() {
+	frame.data.view = camera.GetViewMatrix();
+	frame.data.projection = glm::perspective(glm::radians(camera.Zoom), (float)viewportWidth / (float)viewportHeight, 0.1f, 100.0f);
+	frame.data.viewPos = camera.Position;
+
+	frame.data.dirLight.direction = lightDirection;
+	frame.data.dirLight.ambient = lightAmbient;
+	frame.data.dirLight.diffuse = lightDiffuse;
+	frame.data.dirLight.specular = lightSpecular;
 
 	if (spotlight) {
-		shader.setVec3("spotLight.position", camera.Position);
-		shader.setVec3("spotLight.direction", camera.Front);
-		shader.setVec3("spotLight.ambient", 0.0f, 0.0f, 0.0f);
-		shader.setVec3("spotLight.diffuse", 1.0f, 1.0f, 1.0f);
-		shader.setVec3("spotLight.specular", 1.0f, 1.0f, 1.0f);
-		shader.setFloat("spotLight.constant", 1.0f);
-		shader.setFloat("spotLight.linear", 0.09f);
-		shader.setFloat("spotLight.quadratic", 0.032f);
-		shader.setFloat("spotLight.cutOff", glm::cos(glm::radians(12.5f)));
-		shader.setFloat("spotLight.outerCutOff", glm::cos(glm::radians(15.0f)));
+		frame.data.spotLight.position = camera.Position;
+		frame.data.spotLight.direction = camera.Front;
+		frame.data.spotLight.ambient = glm::vec3(0.0f, 0.0f, 0.0f);
+		frame.data.spotLight.diffuse = glm::vec3(1.0f, 1.0f, 1.0f);
+		frame.data.spotLight.specular = glm::vec3(1.0f, 1.0f, 1.0f);
+		frame.data.spotLight.constant = 1.0f;
+		frame.data.spotLight.linear = 0.09f;
+		frame.data.spotLight.quadratic = 0.032f;
+		frame.data.spotLight.cutOff = glm::cos(glm::radians(12.5f));
+		frame.data.spotLight.outerCutOff = glm::cos(glm::radians(15.0f));
 	}
+
+	if (!softwareRendering)
+		frame.upload();
+}
+
+glm::mat4 objectMatrix(const ObjectModel& object, float angle) {
+	glm::mat4 model = glm::mat4(1.0f);
+
+	model = glm::translate(model, glm::vec3(object.translateX, object.translateY, object.translateZ));
+
+	if (object.isAnimated)
+		model = glm::translate(model, animationSystem.position(object.animationTrack));
+
+	model = glm::rotate(model, (float)glm::radians(object.rotateX), glm::vec3(0.0f, 1.0f, 0.0f));
+	model = glm::rotate(model, (float)glm::radians(object.rotateY), glm::vec3(1.0f, 0.0f, 0.0f));
+	model = glm::rotate(model, (float)glm::radians(object.rotateZ), glm::vec3(0.0f, 0.0f, 1.0f));
+
+	if (object.animateRotationX) model = glm::rotate(model, angle, glm::vec3(0.0f, 1.0f, 0.0f));
+	if (object.animateRotationY) model = glm::rotate(model, angle, glm::vec3(1.0f, 0.0f, 0.0f));
+	if (object.animateRotationZ) model = glm::rotate(model, angle, glm::vec3(0.0f, 0.0f, 1.0f));
+
+	float scaleDelta = object.animateScale ? (sin(angle) * (object.scale / 2.f)) : 0.f;
+	model = glm::scale(model, glm::vec3(object.scale + scaleDelta, object.scale + scaleDelta, object.scale + scaleDelta));
+	return model;
 }
 
 void renderModels(Shader& shader) {
+	Frustum frustum = culling ? Frustum(frame.data.projection * frame.data.view) : Frustum();
+	cullingStats = CullingStats();
+	renderQueue.begin(camera.Position, 100.0f);
+	LodView lodView(camera.Position, glm::radians(camera.Zoom), (float)viewportHeight);
+
+	// objects sharing a model are drawn together, one instanced call per mesh and level
+	std::map<ModelHandle, std::vector<glm::mat4>> instances;
+	std::map<ModelHandle, std::vector<unsigned int>> lods;
+	std::map<ModelHandle, std::vector<SkinPose>> poses;
+
+	// the animation clock rather than the window's, so headless frames repeat exactly
+	float angle = animationTime;
 	for (auto& x : models) {
-		shader.use();
+		if (x.second.batched)
+			continue;
 
-		glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-		glm::mat4 view = camera.GetViewMatrix();
-		shader.setMat4("projection", projection);
-		shader.setMat4("view", view);
+		glm::mat4 model = objectMatrix(x.second, angle);
 
-		glm::mat4 model = glm::mat4(1.0f);
+		if (Model* resource = ModelManager::instance().get(x.second.model))
+			x.second.lod = lodLevels ? resource->selectLod(model, lodView, x.second.lod) : 0;
 
-		float angle = glfwGetTime();
+		instances[x.second.model].push_back(model);
+		lods[x.second.model].push_back(x.second.lod);
+		SkinPose pose;
+		pose.clip = x.second.clip;
+		pose.seconds = animationTime + x.second.clipOffset;
+		poses[x.second.model].push_back(pose);
+	}
 
-		model = glm::translate(model, glm::vec3(x.second.translateX, x.second.translateY, x.second.translateZ));
+	for (auto& x : instances) {
+		if (Model* resource = ModelManager::instance().get(x.first))
+			resource->Submit(renderQueue, shader, x.second, lods[x.first], frustum, cullingStats, poses[x.first]);
+	}
+	staticBatcher.Submit(renderQueue, shader, frustum, cullingStats);
+	BonePalette::instance().upload();
 
-		if (x.second.isAnimated) {
-			glm::vec3 points = animations[x.first].animate();
-			model = glm::translate(model, points);
-		}
+	// sorted by program, textures and VAO so shared state is bound once
+	renderQueue.submit();
+}
+
+// every object through the software renderer or the ray tracer, as renderModels draws them
+void renderSoftware() {
+	std::vector<SoftwareDraw> draws;
+	for (auto& x : models) {
+		SoftwareDraw draw;
+		draw.model = softwareModels.get(x.second.path);
+		if (!draw.model)
+			continue;
+		draw.transform = objectMatrix(x.second, animationTime);
+		draw.pose.clip = x.second.clip;
+		draw.pose.seconds = animationTime + x.second.clipOffset;
+		draws.push_back(draw);
+	}
+	if (rayTracing)
+		rayTracer.render(frame.data, draws, glm::vec3(0.05f, 0.05f, 0.05f));
+	else
+		softwareRenderer.render(frame.data, draws, glm::vec3(0.05f, 0.05f, 0.05f));
+}
+
+// 3DViewer --bake-ao <scene.json> [--samples 64] [--distance 2.0]
+// ambient occlusion of the scene's static objects on every core, into <scene>.ao;
+// only objects that changed since the last bake, and their neighbours, are baked
+int bakeAmbientOcclusion(int argc, char** argv) {
+	OcclusionSettings settings;
+	std::string scenePath;
+	for (int i = 2; i < argc; i++) {
+		std::string argument = argv[i];
+		if (argument == "--samples" && i + 1 < argc)
+			settings.samples = std::max(1, std::atoi(argv[++i]));
+		else if (argument == "--distance" && i + 1 < argc)
+			settings.distance = std::stof(argv[++i]);
+		else
+			scenePath = argument;
+	}
+	if (scenePath.empty()) {
+		std::cout << "usage: 3DViewer --bake-ao <scene.json> [--samples N] [--distance D]" << std::endl;
+		return -1;
+	}
+
+	// geometry on the CPU only, as the software renderer loads it
+	softwareRendering = true;
+	loadScene(scenePath);
+	std::vector<OcclusionSource> sources;
+	for (auto& x : models) {
+		if (!x.second.isStatic())
+			continue;
+		OcclusionSource source;
+		source.name = x.first;
+		source.path = x.second.path;
+		source.transform = objectMatrix(x.second, 0.0f);
+		sources.push_back(source);
+	}
 
-		model = glm::rotate(model, (float)glm::radians(x.second.rotateX), glm::vec3(0.0f, 1.0f, 0.0f));
-		model = glm::rotate(model, (float)glm::radians(x.second.rotateY), glm::vec3(1.0f, 0.0f, 0.0f));
-		model = glm::rotate(model, (float)glm::radians(x.second.rotateZ), glm::vec3(0.0f, 0.0f, 1.0f));
+	std::string bakePath = AmbientOcclusion::bakePath(scenePath);
+	ambientOcclusion.load(bakePath);
+	ambientOcclusion.setWorkers(std::max(1u, std::thread::hardware_concurrency()) - 1);
+	ambientOcclusion.bake(sources, softwareModels, settings);
+	ambientOcclusion.report();
+	bool saved = ambientOcclusion.save(bakePath);
+	if (saved)
+		std::cout << "AMBIENT_OCCLUSION:: written to " << bakePath << std::endl;
+
+	releaseRenderer();
+	return saved ? 0 : -1;
+}
 
-		if (x.second.animateRotationX) model = glm::rotate(model, angle, glm::vec3(0.0f, 1.0f, 0.0f));
-		if (x.second.animateRotationY) model = glm::rotate(model, angle, glm::vec3(1.0f, 0.0f, 0.0f));
-		if (x.second.animateRotationZ) model = glm::rotate(model, angle, glm::vec3(0.0f, 0.0f, 1.0f));
+// 3DViewer --bench-flythrough <scene.json> <path.json> [--size 1600x900] [--step 0.0166667]
+//                             [--frames N] [--warmup 30] [--output results.json|results.csv]
+// flies the camera along the path offscreen on a fixed simulated step, so every run
+// draws the same frames, and times each one on the CPU (update and submission) and on
+// the GPU (GL_TIME_ELAPSED). The path has a "curve" (0 Bezier, 1 CatmullRom, 2 Hermite,
+// as in scenes), "controlPoints", and optionally "duration", "constantSpeed", "zoom"
+// and a "target" curve to look at; without one the camera looks where it goes. By
+// default the frames cover the duration once; warmup frames are drawn but not counted.
+int benchmarkFlythrough(int argc, char** argv) {
+	std::vector<std::string> arguments;
+	int width = SCR_WIDTH;
+	int height = SCR_HEIGHT;
+	float step = FLYTHROUGH_STEP;
+	int frames = 0;
+	int warmup = 30;
+	std::string output;
+	for (int i = 2; i < argc; i++) {
+		std::string argument = argv[i];
+		if (argument == "--size" && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else if (argument == "--step" && i + 1 < argc)
+			step = std::stof(argv[++i]);
+		else if (argument == "--frames" && i + 1 < argc)
+			frames = std::atoi(argv[++i]);
+		else if (argument == "--warmup" && i + 1 < argc)
+			warmup = std::max(0, std::atoi(argv[++i]));
+		else if (argument == "--output" && i + 1 < argc)
+			output = argv[++i];
+		else
+			arguments.push_back(argument);
+	}
+	if (arguments.size() < 2 || width <= 0 || height <= 0 || step <= 0.0f) {
+		std::cout << "usage: 3DViewer --bench-flythrough <scene.json> <path.json> [--size WxH] [--step seconds] [--frames N] [--warmup N] [--output file.json|file.csv]" << std::endl;
+		return -1;
+	}
 
-		float scaleDelta = x.second.animateScale ? (sin(angle) * (x.second.scale / 2.f)) : 0.f;
-		model = glm::scale(model, glm::vec3(x.second.scale + scaleDelta, x.second.scale + scaleDelta, x.second.scale + scaleDelta));
+	std::ifstream pathData(arguments[1]);
+	if (!pathData) {
+		std::cout << "ERROR::FLYTHROUGH:: could not open camera path " << arguments[1] << std::endl;
+		return -1;
+	}
+	json pathFile = json::parse(pathData);
+	Animation route = readCurve(pathFile, pathFile.value("duration", 0.0f));
+	if (!route.isActive()) {
+		std::cout << "ERROR::FLYTHROUGH:: the camera path needs at least one curve segment" << std::endl;
+		return -1;
+	}
+	CameraPath path = pathFile.contains("target") ? CameraPath(route, readCurve(pathFile.at("target"), route.getDuration())) : CameraPath(route);
+	if (frames <= 0)
+		frames = static_cast<int>(std::ceil(path.getDuration() / step)) + 1;
 
-		shader.setMat4("model", model);
-		x.second.model.Draw(shader);
+	OffscreenContext context;
+	OffscreenTarget target;
+	if (!context.create())
+		return -1;
+	Shader shader("shader.vs", "shader.fs");
+	setupRenderer(shader);
+	if (!target.create(width, height))
+		return -1;
+	viewportWidth = width;
+	viewportHeight = height;
+	loadScene(arguments[0]);
+	camera.Zoom = pathFile.value("zoom", camera.Zoom);
+
+	FrameTimes cpuTimes;
+	FrameTimes gpuTimes;
+	{
+		GpuTimer gpuTimer;
+		glm::vec3 front = camera.Front;
+		auto start = std::chrono::steady_clock::now();
+		for (int f = -warmup; f < frames; f++) {
+			// warmup frames replay the start of the path
+			float seconds = std::max(f, 0) * step;
+			// may wait for an old query, which is no work of this frame
+			if (f >= 0)
+				gpuTimer.begin(f);
+			auto frameStart = std::chrono::steady_clock::now();
+
+			path.pose(seconds, camera.Position, front);
+			camera.Yaw = glm::degrees(atan2f(front.z, front.x));
+			camera.Pitch = glm::degrees(asinf(glm::clamp(front.y, -1.0f, 1.0f)));
+			camera.ProcessMouseMovement(0.0f, 0.0f);
+			deltaTime = f > 0 ? step : 0.0f;
+			animationTime = seconds;
+
+			animationSystem.evaluate(animationTime);
+			updateFrame();
+			target.bind();
+			glClearColor(0.05f, 0.05f, 0.05f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			renderModels(shader);
+			if (f >= 0)
+				gpuTimer.end();
+			GeometryArena::instance().endFrame();
+			GLResources::instance().endFrame();
+
+			if (f >= 0)
+				cpuTimes.add(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+		}
+		gpuTimer.finish();
+		double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		for (float time : gpuTimer.milliseconds())
+			gpuTimes.add(time);
+		gpuTimer.destroy();
+
+		std::cout << "FLYTHROUGH:: " << frames << " frames (+" << warmup << " warmup) of " << width << "x" << height << " every "
+			<< step << " s over " << path.getDuration() << " s of path in " << milliseconds << " ms, gpu query stalls: " << gpuTimer.stalls << std::endl;
+	}
+
+	json results;
+	results["scene"] = arguments[0];
+	results["path"] = arguments[1];
+	results["width"] = width;
+	results["height"] = height;
+	results["step"] = step;
+	results["warmup"] = warmup;
+	std::pair<const char*, FrameTimes*> measures[] = { { "cpu", &cpuTimes }, { "gpu", &gpuTimes } };
+	for (auto& measure : measures) {
+		FrameTimeSummary summary = measure.second->summary();
+		std::cout << "FLYTHROUGH:: " << measure.first << " ms min: " << summary.min << " avg: " << summary.avg << " p50: " << summary.p50
+			<< " p95: " << summary.p95 << " p99: " << summary.p99 << " max: " << summary.max << std::endl;
+		results[measure.first] = { { "frames", summary.frames }, { "min", summary.min }, { "avg", summary.avg }, { "p50", summary.p50 },
+			{ "p95", summary.p95 }, { "p99", summary.p99 }, { "max", summary.max }, { "frameTimes", measure.second->milliseconds } };
 	}
+
+	// CSV is one row per measure, JSON adds every frame time
+	bool written = true;
+	if (!output.empty()) {
+		std::ofstream out(output, std::ios::trunc);
+		if (std::filesystem::path(output).extension() == ".csv") {
+			out << "measure,frames,min,avg,p50,p95,p99,max\n";
+			for (auto& measure : measures) {
+				FrameTimeSummary summary = measure.second->summary();
+				out << measure.first << "," << summary.frames << "," << summary.min << "," << summary.avg << "," << summary.p50 << ","
+					<< summary.p95 << "," << summary.p99 << "," << summary.max << "\n";
+			}
+		}
+		else
+			out << results.dump(1) << "\n";
+		written = bool(out);
+		if (written)
+			std::cout << "FLYTHROUGH:: written to " << output << std::endl;
+		else
+			std::cout << "ERROR::FLYTHROUGH::WRITE_FAILED: " << output << std::endl;
+	}
+
+	target.destroy();
+	releaseRenderer();
+	return written ? 0 : -1;
+}
+
+// a curve as scenes and camera paths give it, played once over duration seconds
+Animation readCurve(const json& curve, float duration) {
+	std::vector<glm::vec3> controlPoints;
+	for (const json& point : curve.at("controlPoints"))
+		controlPoints.push_back(glm::vec3(point.at("x"), point.at("y"), point.at("z")));
+	Animation animation(Once, static_cast<Curves>(curve.value("curve", 0)), controlPoints, duration);
+	animation.setConstantSpeed(curve.value("constantSpeed", true));
+	return animation;
 }
 
 void processInput(GLFWwindow* window)
@@ -318,12 +1054,11 @@ void processInput(GLFWwindow* window)
 }
 
 void loadModel(std::string& path) {
-	Model model(path.c_str());
-
 	Animation animation = Animation();
 
 	ObjectModel obj;
-	obj.model = model;
+	obj.model = ModelManager::instance().load(path);
+	obj.path = path;
 	obj.isAnimated = false;
 	obj.translateX = 0.0f;
 	obj.translateY = 0.0f;
@@ -388,14 +1123,14 @@ void loadScene(std::string& path) {
 		scene.at("lighting").at("specular").at("z"));
 
 	//objects
-	models.clear();
-	models = std::map<std::string, ObjectModel>();
+	// the previous scene is released only after loading, so shared models stay resident
+	std::map<std::string, ObjectModel> previous;
+	previous.swap(models);
+	ModelLoader loader;
+	std::vector<std::pair<std::string, ObjectModel>> objects;
 	int os = scene.at("objects").size();
 	for (int i = 0; i < os; i++) {
-		 Model model(scene.at("objects").at(i).at("path"));
-
 		 ObjectModel obj;
-		 obj.model = model;
 		 obj.isAnimated = scene.at("objects").at(i).at("isAnimated");
 		 obj.translateX = scene.at("objects").at(i).at("translate").at("x");
 		 obj.translateY = scene.at("objects").at(i).at("translate").at("y");
@@ -408,19 +1143,60 @@ void loadScene(std::string& path) {
 		 obj.rotateZ = scene.at("objects").at(i).at("rotate").at("z");
 		 obj.animateScale = scene.at("objects").at(i).at("animateScale");
 		 obj.scale = scene.at("objects").at(i).at("scale");
+		 obj.cpuAccess = scene.at("objects").at(i).value("cpuAccess", false);
+		 obj.clip = scene.at("objects").at(i).value("clip", 0u);
+		 obj.clipOffset = scene.at("objects").at(i).value("clipOffset", 0.0f);
+		 obj.path = scene.at("objects").at(i).at("path");
 
 		 std::string name = scene.at("objects").at(i).at("name");
 
-		 models.insert(make_pair(name, obj));
+		 objects.push_back(make_pair(name, obj));
+		 if (!softwareRendering)
+			 loader.enqueue(i, obj.path, obj.cpuAccess);
+	}
+
+	if (softwareRendering) {
+		// geometry and images stay on the CPU, nothing is uploaded
+		std::vector<std::string> paths;
+		for (auto& object : objects)
+			paths.push_back(object.second.path);
+		softwareModels.load(paths);
+		models.insert(objects.begin(), objects.end());
+		softwareModels.report();
+	}
+	else {
+		size_t id;
+		ModelHandle handle;
+		while (loader.next(id, handle)) {
+			objects[id].second.model = handle;
+			if (!models.insert(objects[id]).second)
+				ModelManager::instance().release(handle);
+		}
+		for (auto& x : previous)
+			ModelManager::instance().release(x.second.model);
+		// program and texture set ids of the previous scene would outgrow their key bits
+		renderQueue.clear();
+		ambientOcclusion.load(AmbientOcclusion::bakePath(path));
+		buildStaticBatches();
+		loader.report();
+		ModelManager::instance().report();
+		TextureCache::instance().report();
+		GLResources::instance().report();
 	}
 
 	//animations
-	animations.clear();
-	animations = std::map<std::string, Animation>();
+	animationSystem.clear();
 	int as = scene.at("animations").size();
 	for (int j = 0; j < as; j++) {
 		bool loop = scene.at("animations").at(j).at("loop");
 		Curves curve = static_cast<Curves>(scene.at("animations").at(j).at("curve"));
+		// "loop" runs back and forth, without it the curve starts over; "mode" overrides
+		Playback playback = loop ? PingPong : Loop;
+		std::string mode = scene.at("animations").at(j).value("mode", "");
+		if (mode == "once") playback = Once;
+		else if (mode == "loop") playback = Loop;
+		else if (mode == "pingpong") playback = PingPong;
+		float duration = scene.at("animations").at(j).value("duration", 0.0f);
 		std::string prop = scene.at("animations").at(j).at("prop");
 
 		vector <glm::vec3> controlPoints;
@@ -434,16 +1210,47 @@ void loadScene(std::string& path) {
 			controlPoints.push_back(controlPoint);
 		}
 
-		Animation animation(loop, curve, controlPoints);
+		Animation animation(playback, curve, controlPoints, duration);
+		animation.setConstantSpeed(scene.at("animations").at(j).value("constantSpeed", true));
 
-		animations.insert(make_pair(prop, animation));
+		auto object = models.find(prop);
+		if (object != models.end() && object->second.isAnimated)
+			object->second.animationTrack = animationSystem.add(animation, animationTime);
 	}
+	animationSystem.report();
 
+	MeshCache::report();
+	MeshOptimizer::report();
+}
+
+// objects that never move are drawn from world space meshes, one per texture set
+void buildStaticBatches() {
+	std::vector<StaticObject> objects;
+	for (auto& x : models) {
+		x.second.batched = false;
+		if (!x.second.isStatic())
+			continue;
+		StaticObject object;
+		object.name = x.first;
+		object.model = x.second.model;
+		object.transform = objectMatrix(x.second, 0.0f);
+		if (const ObjectOcclusion* baked = ambientOcclusion.find(x.first, x.second.path, object.transform))
+			object.occlusion = baked->meshes;
+		objects.push_back(object);
+	}
+	staticBatcher.build(objects);
+	for (auto& x : models)
+		x.second.batched = staticBatcher.contains(x.first);
+	staticBatcher.report();
 }
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
 	glViewport(0, 0, width, height);
+	if (width > 0 && height > 0) {
+		viewportWidth = width;
+		viewportHeight = height;
+	}
 }
 
 void mouse_callback(GLFWwindow* window, double xposIn, double yposIn)
@@ -490,8 +1297,11 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 	}
 }
 
+// the file dialog is Windows only, so elsewhere the window cannot open a scene; only
+// --headless and the benchmarks take one, as an argument
 bool openFile()
 {
+#ifdef _WIN32
 	HRESULT f_SysHr = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
 	if (FAILED(f_SysHr))
 		return FALSE;
@@ -539,4 +1349,7 @@ bool openFile()
 	f_FileSystem->Release();
 	CoUninitialize();
 	return TRUE;
+#else
+	return false;
+#endif
 }
\ No newline at end of file
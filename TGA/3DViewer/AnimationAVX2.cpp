@@ -0,0 +1,55 @@
+// The eight wide evaluator of AnimationSystem, the only code built with /arch:AVX2
+// (-mavx2 elsewhere). AnimationSystem calls it once cpuid reports AVX2, so the rest
+// of the viewer keeps running on SSE2 CPUs.
+#include <3DViewer/animationtracks.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#if !defined(__AVX2__)
+#error "AnimationAVX2.cpp must be built with /arch:AVX2 or -mavx2"
+#endif
+
+#include <immintrin.h>
+
+size_t AnimationEvaluateAVX2(const AnimationTracks& tracks, float time, size_t first, size_t last)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 two = _mm256_set1_ps(2.0f);
+
+	for (; first + 8 <= last; first += 8)
+	{
+		size_t i = first;
+		__m256 u = _mm256_mul_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_set1_ps(time), _mm256_loadu_ps(&tracks.start[i])), zero), _mm256_loadu_ps(&tracks.invDuration[i]));
+		__m256 once = _mm256_min_ps(u, one);
+		__m256 loop = _mm256_sub_ps(u, _mm256_floor_ps(u));
+		__m256 pingPong = _mm256_sub_ps(u, _mm256_mul_ps(two, _mm256_floor_ps(_mm256_mul_ps(u, _mm256_set1_ps(0.5f)))));
+		pingPong = _mm256_blendv_ps(pingPong, _mm256_sub_ps(two, pingPong), _mm256_cmp_ps(pingPong, one, _CMP_GT_OQ));
+		__m256i playback = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&tracks.mode[i]));
+		u = _mm256_blendv_ps(pingPong, loop, _mm256_castsi256_ps(_mm256_cmpeq_epi32(playback, _mm256_set1_epi32(tracks.loop))));
+		u = _mm256_blendv_ps(u, once, _mm256_castsi256_ps(_mm256_cmpeq_epi32(playback, _mm256_set1_epi32(tracks.once))));
+
+		__m256 x = _mm256_mul_ps(u, _mm256_loadu_ps(&tracks.remapSize[i]));
+		__m256i k = _mm256_cvttps_epi32(_mm256_min_ps(x, _mm256_loadu_ps(&tracks.remapLast[i])));
+		__m256 f = _mm256_sub_ps(x, _mm256_cvtepi32_ps(k));
+		__m256i entry = _mm256_add_epi32(k, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&tracks.remapOffset[i])));
+		__m256 r0 = _mm256_i32gather_ps(tracks.remap, entry, 4);
+		__m256 r1 = _mm256_i32gather_ps(tracks.remap + 1, entry, 4);
+		__m256 s = _mm256_add_ps(r0, _mm256_mul_ps(f, _mm256_sub_ps(r1, r0)));
+
+		__m256i segment = _mm256_cvttps_epi32(_mm256_min_ps(s, _mm256_loadu_ps(&tracks.segmentLast[i])));
+		__m256 t = _mm256_sub_ps(s, _mm256_cvtepi32_ps(segment));
+		__m256i c = _mm256_add_epi32(segment, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&tracks.firstSegment[i])));
+
+		float* out[3] = { &tracks.px[i], &tracks.py[i], &tracks.pz[i] };
+		for (int axis = 0; axis < 3; axis++)
+		{
+			__m256 p = _mm256_i32gather_ps(tracks.coefficients[axis], c, 4);
+			p = _mm256_add_ps(_mm256_mul_ps(p, t), _mm256_i32gather_ps(tracks.coefficients[3 + axis], c, 4));
+			p = _mm256_add_ps(_mm256_mul_ps(p, t), _mm256_i32gather_ps(tracks.coefficients[6 + axis], c, 4));
+			p = _mm256_add_ps(_mm256_mul_ps(p, t), _mm256_i32gather_ps(tracks.coefficients[9 + axis], c, 4));
+			_mm256_storeu_ps(out[axis], p);
+		}
+	}
+	return first;
+}
+#endif
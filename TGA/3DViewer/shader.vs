@@ -2,20 +2,89 @@
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
+layout (location = 5) in ivec4 aBoneIds;
+layout (location = 6) in vec4 aWeights;
+layout (location = 7) in mat4 aInstanceModel;
+
+// positions may arrive quantized to the mesh bounds, see VertexLayout.h
+uniform vec3 positionOffset;
+uniform vec3 positionScale;
+
+// bone matrices of every skinned instance, four texels each, see Skeleton.h
+uniform bool skinned;
+uniform samplerBuffer bonePalette;
+
+// baked ambient occlusion of static batches, a texel per vertex, see StaticBatch.h
+uniform bool occluded;
+uniform int occlusionBase;
+uniform samplerBuffer ambientOcclusion;
 
 out vec3 FragPos;
 out vec3 Normal;
 out vec2 TexCoords;
+out float Occlusion;
+
+// per-frame block shared with shader.fs, see FrameUniforms.h
+struct DirLight {
+    vec3 direction;
+	
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+};
+
+struct SpotLight {
+    vec3 position;
+    vec3 direction;
+    float cutOff;
+    float outerCutOff;
+  
+    float constant;
+    float linear;
+    float quadratic;
+  
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;       
+};
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+layout (std140) uniform Frame {
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+    DirLight dirLight;
+    SpotLight spotLight;
+};
+
+mat4 boneMatrix(int index)
+{
+    return mat4(texelFetch(bonePalette, index * 4), texelFetch(bonePalette, index * 4 + 1),
+                texelFetch(bonePalette, index * 4 + 2), texelFetch(bonePalette, index * 4 + 3));
+}
 
 void main()
 {
-    FragPos = vec3(model * vec4(aPos, 1.0));
-    Normal = mat3(transpose(inverse(model))) * aNormal;  
+    // skinned instances keep the index of their palette in the unused bottom row
+    mat4 model = aInstanceModel;
+    int palette = int(model[0][3]);
+    model[0][3] = 0.0;
+
+    vec3 position = positionOffset + aPos * positionScale;
+    vec3 normal = aNormal;
+    if (skinned)
+    {
+        mat4 skin = aWeights.x * boneMatrix(palette + aBoneIds.x) + aWeights.y * boneMatrix(palette + aBoneIds.y)
+                  + aWeights.z * boneMatrix(palette + aBoneIds.z) + aWeights.w * boneMatrix(palette + aBoneIds.w);
+        // weights arrive as unorm8, their sum is only close to one
+        skin /= max(dot(aWeights, vec4(1.0)), 1e-4);
+        position = vec3(skin * vec4(position, 1.0));
+        normal = mat3(skin) * normal;
+    }
+
+    FragPos = vec3(model * vec4(position, 1.0));
+    Normal = mat3(transpose(inverse(model))) * normal;  
     TexCoords = aTexCoords;
+    Occlusion = occluded ? texelFetch(ambientOcclusion, occlusionBase + gl_VertexID).r : 1.0;
     
     gl_Position = projection * view * vec4(FragPos, 1.0);
 }
\ No newline at end of file
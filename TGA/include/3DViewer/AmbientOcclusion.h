@@ -0,0 +1,611 @@
+#ifndef AMBIENT_OCCLUSION_H
+#define AMBIENT_OCCLUSION_H
+
+#include <glm/glm.hpp>
+
+#include <3DViewer/frustum.h>
+#include <3DViewer/softwarerenderer.h>
+#include <3DViewer/threadpool.h>
+#include <3DViewer/trianglebvh.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+// bump whenever the layout of the bake file or the sampling below change
+#define AMBIENT_OCCLUSION_VERSION 1
+#define AMBIENT_OCCLUSION_SAMPLES 64
+#define AMBIENT_OCCLUSION_MAX_SAMPLES 4096
+// how far an occluder may be from the vertex it darkens, in world units
+#define AMBIENT_OCCLUSION_DISTANCE 2.0f
+// vertices a worker bakes per job
+#define AMBIENT_OCCLUSION_CHUNK 256
+// rays leave the surface this far along the normal, relative to the coordinates
+#define AMBIENT_OCCLUSION_EPSILON 1e-4f
+// relative difference under which a stored transform still matches the scene's; the
+// baking tool and the viewer may round the same matrix a few ULP apart
+#define AMBIENT_OCCLUSION_TRANSFORM_TOLERANCE 1e-5f
+
+struct OcclusionSettings {
+	unsigned int samples = AMBIENT_OCCLUSION_SAMPLES;
+	float distance = AMBIENT_OCCLUSION_DISTANCE;
+};
+
+// a static object as the scene places it
+struct OcclusionSource {
+	string name;
+	string path;
+	glm::mat4 transform = glm::mat4(1.0f);
+};
+
+// what was baked for one object: per mesh of its model, one byte per vertex of the
+// full detail level in Model::loadGeometry order, 255 for an open hemisphere
+struct ObjectOcclusion {
+	string path;
+	glm::mat4 transform = glm::mat4(1.0f);
+	// world space, where its occluders were looked for
+	Bounds bounds;
+	vector<vector<unsigned char>> meshes;
+};
+
+struct OcclusionStats {
+	unsigned int workers = 1;
+	unsigned int objects = 0;
+	unsigned int baked = 0;
+	unsigned int reused = 0;
+	// baked again only because something near them changed
+	unsigned int neighbours = 0;
+	size_t vertices = 0;
+	size_t rays = 0;
+	BvhStats bvh;
+	float bakeMilliseconds = 0.0f;
+
+	double raysPerSecond() const { return bakeMilliseconds > 0.0f ? rays * 1000.0 / bakeMilliseconds : 0.0; }
+};
+
+// Ambient occlusion of the static objects of a scene, baked on the CPU into a byte
+// per vertex and kept next to the scene as <scene>.ao. bake() builds a TriangleBVH
+// over every static object in world space and, on every worker, casts cosine weighted
+// rays over the hemisphere of each vertex normal, up to settings.distance: the byte is
+// the share of them that escaped. Samples follow a Hammersley set rotated per vertex
+// by a hash of the object name and the vertex, so a bake never depends on the workers.
+//
+// Baking is incremental against what was loaded: an object is baked again when it is
+// new, its model or transform changed, or its model no longer has the same vertices,
+// and so is every object within settings.distance of where a changed or removed
+// object was or now is, since its occluders moved. Different settings bake all.
+//
+// file layout (native endianness, every block 8 byte aligned):
+//   OcclusionHeader, then per object: OcclusionRecord, name, model path, and per mesh
+//   its vertex count (uint32_t) followed by that many bytes
+class AmbientOcclusion
+{
+public:
+	OcclusionStats stats;
+	OcclusionSettings settings;
+	map<string, ObjectOcclusion> objects;
+
+	// <scene>.ao beside <scene>.json
+	static string bakePath(string const& scenePath)
+	{
+		return filesystem::path(scenePath).replace_extension(".ao").string();
+	}
+
+	// threads besides the calling one
+	void setWorkers(unsigned int count)
+	{
+		pool.reset();
+		if (count > 0)
+			pool = make_unique<ThreadPool>(count);
+	}
+
+	unsigned int workerCount() const
+	{
+		return pool ? pool->size() + 1 : 1;
+	}
+
+	// the bake of the object if it still matches how the scene places it
+	const ObjectOcclusion* find(string const& name, string const& path, const glm::mat4& transform) const
+	{
+		auto object = objects.find(name);
+		if (object == objects.end() || object->second.path != path || !sameTransform(object->second.transform, transform))
+			return nullptr;
+		return &object->second;
+	}
+
+	static bool sameTransform(const glm::mat4& a, const glm::mat4& b)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			for (int r = 0; r < 4; r++)
+			{
+				float scale = std::max(1.0f, std::max(fabsf(a[c][r]), fabsf(b[c][r])));
+				if (fabsf(a[c][r] - b[c][r]) > AMBIENT_OCCLUSION_TRANSFORM_TOLERANCE * scale)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	void clear()
+	{
+		objects.clear();
+		settings = OcclusionSettings();
+	}
+
+	// a missing file is an empty bake; anything unreadable is reported and dropped
+	bool load(string const& path)
+	{
+		clear();
+		ifstream in(path, ios::binary);
+		if (!in)
+			return false;
+		vector<unsigned char> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+		if (!parse(bytes))
+		{
+			cout << "ERROR::AMBIENT_OCCLUSION:: ignoring unreadable bake " << path << endl;
+			clear();
+			return false;
+		}
+		return true;
+	}
+
+	// written aside and renamed, so a reader never sees half a file
+	bool save(string const& path) const
+	{
+		string temporary = path + ".tmp";
+		{
+			ofstream out(temporary, ios::binary | ios::trunc);
+			if (!out)
+			{
+				cout << "ERROR::AMBIENT_OCCLUSION::WRITE_FAILED: " << temporary << endl;
+				return false;
+			}
+
+			OcclusionHeader header;
+			memcpy(header.magic, "AOBK", 4);
+			header.version = AMBIENT_OCCLUSION_VERSION;
+			header.samples = settings.samples;
+			header.distance = settings.distance;
+			header.objectCount = static_cast<uint32_t>(objects.size());
+			write(out, &header, sizeof(header));
+
+			for (const auto& object : objects)
+			{
+				OcclusionRecord record;
+				record.nameLength = static_cast<uint32_t>(object.first.size());
+				record.pathLength = static_cast<uint32_t>(object.second.path.size());
+				record.meshCount = static_cast<uint32_t>(object.second.meshes.size());
+				record.transform = object.second.transform;
+				record.bounds = object.second.bounds;
+				write(out, &record, sizeof(record));
+				write(out, object.first.data(), object.first.size());
+				write(out, object.second.path.data(), object.second.path.size());
+				for (const vector<unsigned char>& mesh : object.second.meshes)
+				{
+					uint32_t count = static_cast<uint32_t>(mesh.size());
+					write(out, &count, sizeof(count));
+					write(out, mesh.data(), mesh.size());
+				}
+			}
+
+			if (!out)
+			{
+				cout << "ERROR::AMBIENT_OCCLUSION::WRITE_FAILED: " << temporary << endl;
+				return false;
+			}
+		}
+
+		std::error_code error;
+		filesystem::rename(temporary, path, error);
+		if (error)
+		{
+			cout << "ERROR::AMBIENT_OCCLUSION::WRITE_FAILED: " << path << endl;
+			filesystem::remove(temporary, error);
+			return false;
+		}
+		return true;
+	}
+
+	// brings the bake up to date with the sources, whose models must be in models;
+	// objects with skinned meshes are left out
+	void bake(const vector<OcclusionSource>& sources, const SoftwareModels& models, const OcclusionSettings& requested)
+	{
+		auto start = chrono::steady_clock::now();
+		stats = OcclusionStats();
+		stats.workers = workerCount();
+
+		OcclusionSettings wanted = requested;
+		wanted.samples = std::min(std::max(wanted.samples, 1u), unsigned(AMBIENT_OCCLUSION_MAX_SAMPLES));
+		wanted.distance = std::max(wanted.distance, 1e-3f);
+		if (wanted.samples != settings.samples || wanted.distance != settings.distance)
+			objects.clear();
+		settings = wanted;
+
+		prepare(sources, models);
+		stats.objects = static_cast<unsigned int>(items.size());
+		if (items.empty() || !markDirty())
+		{
+			stats.reused = stats.objects;
+			items.clear();
+			corners.clear();
+			stats.bakeMilliseconds = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+			return;
+		}
+
+		bvh.build(corners, pool.get());
+		stats.bvh = bvh.stats;
+
+		// jobs of up to AMBIENT_OCCLUSION_CHUNK vertices of one mesh of a dirty object
+		vector<Job> jobs;
+		for (uint32_t i = 0; i < items.size(); i++)
+		{
+			Item& item = items[i];
+			if (!item.dirty)
+			{
+				stats.reused++;
+				continue;
+			}
+			stats.baked++;
+			stats.neighbours += item.neighbour ? 1 : 0;
+			item.occlusion.meshes.resize(item.meshes.size());
+			for (uint32_t m = 0; m < item.meshes.size(); m++)
+			{
+				uint32_t count = static_cast<uint32_t>(item.meshes[m].count);
+				item.occlusion.meshes[m].assign(count, 255);
+				stats.vertices += count;
+				for (uint32_t first = 0; first < count; first += AMBIENT_OCCLUSION_CHUNK)
+					jobs.push_back(Job{ i, m, first, std::min(first + AMBIENT_OCCLUSION_CHUNK, count) });
+			}
+		}
+
+		atomic<size_t> next{ 0 };
+		atomic<size_t> rays{ 0 };
+		parallel([&] {
+			size_t cast = 0;
+			for (size_t j = next++; j < jobs.size(); j = next++)
+				cast += bakeJob(jobs[j]);
+			rays += cast;
+		});
+		stats.rays = rays;
+
+		for (Item& item : items)
+		{
+			if (item.dirty)
+				objects[item.name] = std::move(item.occlusion);
+		}
+		items.clear();
+		corners.clear();
+		bvh.clear();
+		stats.bakeMilliseconds = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+	}
+
+	void report() const
+	{
+		cout << "AMBIENT_OCCLUSION:: objects: " << stats.objects << " baked: " << stats.baked << " (neighbours: " << stats.neighbours
+			<< ") reused: " << stats.reused << " samples: " << settings.samples << " distance: " << settings.distance << endl;
+		cout << "AMBIENT_OCCLUSION:: workers: " << stats.workers << " vertices: " << stats.vertices << " rays: " << stats.rays
+			<< " triangles: " << stats.bvh.triangles << " bvh: " << stats.bvh.buildMilliseconds << " ms, baked in "
+			<< stats.bakeMilliseconds << " ms, " << stats.raysPerSecond() / 1e6 << " Mrays/s" << endl;
+	}
+
+private:
+	struct OcclusionHeader {
+		char magic[4];
+		uint32_t version;
+		uint32_t samples;
+		float distance;
+		uint32_t objectCount;
+		uint32_t padding = 0;
+	};
+
+	struct OcclusionRecord {
+		uint32_t nameLength;
+		uint32_t pathLength;
+		uint32_t meshCount;
+		uint32_t padding = 0;
+		glm::mat4 transform;
+		Bounds bounds;
+	};
+
+	// where a mesh's vertices start in positions and normals
+	struct ItemMesh {
+		size_t first = 0;
+		size_t count = 0;
+	};
+
+	// a source with its model placed in the world
+	struct Item {
+		string name;
+		uint32_t seed = 0;
+		vector<ItemMesh> meshes;
+		ObjectOcclusion occlusion;
+		bool dirty = false;
+		bool neighbour = false;
+	};
+
+	struct Job {
+		uint32_t item;
+		uint32_t mesh;
+		uint32_t first;
+		uint32_t last;
+	};
+
+	unique_ptr<ThreadPool> pool;
+	vector<Item> items;
+	vector<glm::vec3> positions;
+	vector<glm::vec3> normals;
+	// three per triangle of every item, what the hierarchy is built from
+	vector<glm::vec3> corners;
+	TriangleBVH bvh;
+
+	void parallel(const function<void()>& job)
+	{
+		vector<future<void>> done;
+		for (unsigned int w = 0; pool && w < pool->size(); w++)
+			done.push_back(pool->submit([&job] { job(); }));
+		job();
+		for (future<void>& d : done)
+			d.get();
+	}
+
+	// every source in world space, skipping what cannot be baked
+	void prepare(const vector<OcclusionSource>& sources, const SoftwareModels& models)
+	{
+		items.clear();
+		positions.clear();
+		normals.clear();
+		corners.clear();
+		for (const OcclusionSource& source : sources)
+		{
+			const SoftwareModel* model = models.get(source.path);
+			if (!model || model->meshes.empty())
+				continue;
+			bool skinned = false;
+			for (const SoftwareMesh& mesh : model->meshes)
+				skinned = skinned || mesh.skinned;
+			if (skinned)
+				continue;
+
+			Item item;
+			item.name = source.name;
+			item.seed = hash32(source.name.data(), source.name.size());
+			item.occlusion.path = source.path;
+			item.occlusion.transform = source.transform;
+
+			glm::mat3 linear(source.transform);
+			glm::mat3 normalMatrix = glm::transpose(glm::inverse(linear));
+			bool first = true;
+			for (const SoftwareMesh& mesh : model->meshes)
+			{
+				ItemMesh range;
+				range.first = positions.size();
+				range.count = mesh.vertices.size();
+				item.meshes.push_back(range);
+				for (const Vertex& vertex : mesh.vertices)
+				{
+					glm::vec3 position = glm::vec3(source.transform * glm::vec4(vertex.Position, 1.0f));
+					positions.push_back(position);
+					normals.push_back(normalMatrix * vertex.Normal);
+					if (first)
+						item.occlusion.bounds.min = item.occlusion.bounds.max = position;
+					first = false;
+					item.occlusion.bounds.min = glm::min(item.occlusion.bounds.min, position);
+					item.occlusion.bounds.max = glm::max(item.occlusion.bounds.max, position);
+				}
+				for (unsigned int index : mesh.indices)
+					corners.push_back(positions[range.first + index]);
+			}
+			Bounds& bounds = item.occlusion.bounds;
+			bounds.center = 0.5f * (bounds.min + bounds.max);
+			bounds.radius = glm::length(bounds.max - bounds.center);
+			items.push_back(std::move(item));
+		}
+	}
+
+	// what must be baked, and drops the bakes of objects no longer in the scene;
+	// false when everything is up to date
+	bool markDirty()
+	{
+		// where occluders appeared, moved or went away
+		vector<Bounds> changed;
+		map<string, bool> present;
+		for (Item& item : items)
+		{
+			present[item.name] = true;
+			auto stored = objects.find(item.name);
+			item.dirty = stored == objects.end() || stored->second.path != item.occlusion.path
+				|| !sameTransform(stored->second.transform, item.occlusion.transform) || stored->second.meshes.size() != item.meshes.size();
+			for (size_t m = 0; !item.dirty && m < item.meshes.size(); m++)
+				item.dirty = stored->second.meshes[m].size() != item.meshes[m].count;
+			if (!item.dirty)
+				continue;
+			changed.push_back(item.occlusion.bounds);
+			if (stored != objects.end())
+				changed.push_back(stored->second.bounds);
+		}
+		for (auto object = objects.begin(); object != objects.end();)
+		{
+			if (present.count(object->first))
+			{
+				object++;
+				continue;
+			}
+			changed.push_back(object->second.bounds);
+			object = objects.erase(object);
+		}
+
+		bool any = false;
+		for (Item& item : items)
+		{
+			for (size_t c = 0; !item.dirty && c < changed.size(); c++)
+				item.neighbour = item.dirty = reaches(item.occlusion.bounds, changed[c]);
+			any = any || item.dirty;
+		}
+		return any;
+	}
+
+	// whether anything in b is within settings.distance of a
+	bool reaches(const Bounds& a, const Bounds& b) const
+	{
+		glm::vec3 reach(settings.distance);
+		return glm::all(glm::lessThanEqual(a.min - reach, b.max)) && glm::all(glm::lessThanEqual(b.min, a.max + reach));
+	}
+
+	// bakes the vertices of one job, returning the rays cast
+	size_t bakeJob(const Job& job)
+	{
+		Item& item = items[job.item];
+		const ItemMesh& mesh = item.meshes[job.mesh];
+		vector<unsigned char>& occlusion = item.occlusion.meshes[job.mesh];
+		size_t cast = 0;
+		for (uint32_t v = job.first; v < job.last; v++)
+		{
+			glm::vec3 position = positions[mesh.first + v];
+			glm::vec3 normal = normals[mesh.first + v];
+			float length = glm::length(normal);
+			if (!(length > 0.0f))
+				continue;
+			normal /= length;
+
+			// orthonormal basis around the normal (Duff et al. 2017)
+			float sign = normal.z >= 0.0f ? 1.0f : -1.0f;
+			float a = -1.0f / (sign + normal.z);
+			float b = normal.x * normal.y * a;
+			glm::vec3 tangent(1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+			glm::vec3 bitangent(b, sign + normal.y * normal.y * a, -normal.y);
+
+			uint32_t rotation = hash32(&v, sizeof(v), item.seed ^ (job.mesh * 0x9E3779B9u));
+			rotation ^= rotation >> 16;
+			rotation *= 0x7FEB352Du;
+			rotation ^= rotation >> 15;
+			float shiftU = (rotation & 0xFFFFu) / 65536.0f;
+			float shiftV = (rotation >> 16) / 65536.0f;
+
+			glm::vec3 a3 = glm::abs(position);
+			glm::vec3 origin = position + normal * (AMBIENT_OCCLUSION_EPSILON * std::max(1.0f, std::max(a3.x, std::max(a3.y, a3.z))));
+			unsigned int open = 0;
+			for (unsigned int s = 0; s < settings.samples; s++)
+			{
+				float u = fract((s + 0.5f) / settings.samples + shiftU);
+				float w = fract(radicalInverse(s) + shiftV);
+				float radius = sqrtf(u);
+				float phi = 6.28318531f * w;
+				glm::vec3 direction = tangent * (radius * cosf(phi)) + bitangent * (radius * sinf(phi)) + normal * sqrtf(std::max(0.0f, 1.0f - u));
+				if (!bvh.occluded(BvhRay(origin, direction, 0.0f, settings.distance)))
+					open++;
+			}
+			cast += settings.samples;
+			occlusion[v] = static_cast<unsigned char>((open * 255 + settings.samples / 2) / settings.samples);
+		}
+		return cast;
+	}
+
+	static float fract(float x)
+	{
+		return x - floorf(x);
+	}
+
+	// van der Corput sequence in base 2
+	static float radicalInverse(uint32_t bits)
+	{
+		bits = (bits << 16) | (bits >> 16);
+		bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+		bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+		bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+		bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+		return bits * 2.3283064365386963e-10f;
+	}
+
+	// FNV-1a
+	static uint32_t hash32(const void* data, size_t size, uint32_t hash = 2166136261u)
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= bytes[i];
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+
+	static size_t align(size_t offset)
+	{
+		return (offset + 7) & ~size_t(7);
+	}
+
+	static void write(ofstream& out, const void* data, size_t size)
+	{
+		static const char zeros[8] = {};
+		out.write(static_cast<const char*>(data), size);
+		out.write(zeros, align(size) - size);
+	}
+
+	bool parse(const vector<unsigned char>& bytes)
+	{
+		size_t size = bytes.size();
+		size_t offset = 0;
+		auto take = [&](size_t length) -> const unsigned char* {
+			if (length > size - offset)
+				return nullptr;
+			const unsigned char* block = bytes.data() + offset;
+			offset = std::min(align(offset + length), size);
+			return block;
+		};
+
+		OcclusionHeader header;
+		const unsigned char* block = take(sizeof(header));
+		if (!block)
+			return false;
+		memcpy(&header, block, sizeof(header));
+		if (memcmp(header.magic, "AOBK", 4) != 0 || header.version != AMBIENT_OCCLUSION_VERSION)
+			return false;
+		settings.samples = header.samples;
+		settings.distance = header.distance;
+
+		for (uint32_t o = 0; o < header.objectCount; o++)
+		{
+			OcclusionRecord record;
+			if (!(block = take(sizeof(record))))
+				return false;
+			memcpy(&record, block, sizeof(record));
+			const char* name = reinterpret_cast<const char*>(take(record.nameLength));
+			const char* path = reinterpret_cast<const char*>(take(record.pathLength));
+			if (!name || !path)
+				return false;
+
+			ObjectOcclusion object;
+			object.path = string(path, record.pathLength);
+			object.transform = record.transform;
+			object.bounds = record.bounds;
+			for (uint32_t m = 0; m < record.meshCount; m++)
+			{
+				uint32_t count;
+				if (!(block = take(sizeof(count))))
+					return false;
+				memcpy(&count, block, sizeof(count));
+				if (!(block = take(count)) && count > 0)
+					return false;
+				object.meshes.push_back(vector<unsigned char>(block, block + count));
+			}
+			objects[string(name, record.nameLength)] = std::move(object);
+		}
+		return true;
+	}
+};
+
+#endif
@@ -2,64 +2,286 @@
 #define ANIMATION_H
 
 #include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 using namespace std;
 
-int n = 1;
+// seconds per curve segment when the scene gives no duration
+#define ANIMATION_SEGMENT_SECONDS 1.7f
+// arc length table entries per segment, and the error allowed when integrating one
+#define ANIMATION_ARC_SAMPLES 16
+#define ANIMATION_ARC_TOLERANCE 1e-6f
+#define ANIMATION_NEWTON_STEPS 3
 
 enum Curves { Bezier, CatmullRom, Hermite };
 
+// what happens after the last segment: stop there, start over, or run back
+enum Playback { Once, Loop, PingPong };
+
+// A piecewise cubic over the control points, evaluated at a time rather than per
+// frame. Each segment keeps only its polynomial coefficients, so a point costs one
+// Horner evaluation, ((a t + b) t + c) t + d, and memory grows with the control
+// points only. The clock and the direction are per animation.
+//
+// With constant speed (the default) time maps to distance along the curve rather
+// than to t. A table of cumulative arc length, integrated once with adaptive
+// Gauss-Legendre quadrature, is binary searched for the distance and t is refined
+// by Newton steps on the length integral, O(log n) per point.
 class Animation
 {
 public:
 	Animation() {
 		this->active = false;
-		this->loop = false;
+		this->playback = Loop;
 		this->curve = Bezier;
-		this->frame = 0;
+		this->duration = 0.0f;
 	}
 
 	Animation(bool loop, Curves curve, vector <glm::vec3> controlPoints)
+		: Animation(loop ? PingPong : Loop, curve, controlPoints)
+	{
+	}
+
+	// duration of the whole curve in seconds, or per ANIMATION_SEGMENT_SECONDS if zero
+	Animation(Playback playback, Curves curve, vector <glm::vec3> controlPoints, float duration = 0.0f)
 	{
-		this->active = true;
-		this->loop = loop;
+		this->playback = playback;
 		this->curve = curve;
 		this->controlPoints = controlPoints;
-		this->frame = 0;
 		computeCurve();
+		computeArcLengths();
+		this->active = !segments.empty();
+		this->duration = duration > 0.0f ? duration : ANIMATION_SEGMENT_SECONDS * segments.size();
+	}
+
+	// advances this animation's clock and returns the point for the new time
+	glm::vec3 animate(float deltaTime)
+	{
+		elapsed += deltaTime;
+		// keep the clock within one period, so float precision does not run out
+		float period = playback == PingPong ? 2.0f * duration : duration;
+		if (playback != Once && period > 0.0f && elapsed >= period)
+			elapsed = fmod(elapsed, period);
+		return evaluate(elapsed);
 	}
 
-	glm::vec3 animate()
+	// the point at a time since the animation started
+	glm::vec3 evaluate(float seconds) const
 	{
 		if (!active) return glm::vec3{ 0.0,0.0,0.0 };
 
-		glm::vec3 points = curvePoints[frame];
-		if (loop) {
-			this->frame = (frame + n) % curvePoints.size();
-			if (frame == curvePoints.size()-1) {
-				n = -1;
-			}
-			if (frame == 0) {
-				n = 1;
-			}
-		}
-		else {
-			this->frame = (frame + 1) % curvePoints.size();
+		float u = duration > 0.0f ? std::max(seconds, 0.0f) / duration : 0.0f;
+		switch (playback)
+		{
+		case Once:
+			u = std::min(u, 1.0f);
+			break;
+		case Loop:
+			u = u - floor(u);
+			break;
+		case PingPong:
+			u = fmod(u, 2.0f);
+			if (u > 1.0f)
+				u = 2.0f - u;
+			break;
 		}
 
-		return points;
+		if (constantSpeed && totalLength > 0.0f)
+			return evaluateDistance(u * totalLength);
+
+		// the end of one segment is the start of the next, the last one keeps t = 1
+		float position = u * segments.size();
+		size_t segment = std::min(static_cast<size_t>(position), segments.size() - 1);
+		return point(segments[segment], position - segment);
+	}
+
+	// the point at a distance along the curve from its first control point
+	glm::vec3 evaluateDistance(float distance) const
+	{
+		if (!active) return glm::vec3{ 0.0,0.0,0.0 };
+
+		size_t segment;
+		float t;
+		parameterAt(distance, segment, t);
+		return point(segments[segment], t);
+	}
+
+	float length() const
+	{
+		return totalLength;
+	}
+
+	void setConstantSpeed(bool constantSpeed)
+	{
+		this->constantSpeed = constantSpeed;
+	}
+
+	void restart()
+	{
+		elapsed = 0.0f;
+	}
+
+	// +1 while running forward, -1 on the way back of a ping-pong, 0 once finished
+	int direction() const
+	{
+		if (!active || duration <= 0.0f)
+			return 0;
+		if (playback == Once)
+			return elapsed < duration ? 1 : 0;
+		if (playback == PingPong)
+			return fmod(elapsed / duration, 2.0f) > 1.0f ? -1 : 1;
+		return 1;
+	}
+
+	float getDuration() const
+	{
+		return duration;
+	}
+
+	bool isActive() const
+	{
+		return active;
+	}
+
+	Playback getPlayback() const
+	{
+		return playback;
+	}
+
+	bool isConstantSpeed() const
+	{
+		return constantSpeed && totalLength > 0.0f;
+	}
+
+	size_t segmentCount() const
+	{
+		return segments.size();
+	}
+
+	// the coefficients of t^3, t^2, t and 1 of one segment
+	void coefficients(size_t segment, glm::vec3& a, glm::vec3& b, glm::vec3& c, glm::vec3& d) const
+	{
+		a = segments[segment].a;
+		b = segments[segment].b;
+		c = segments[segment].c;
+		d = segments[segment].d;
+	}
+
+	// segment index plus t at a distance along the curve
+	float parameterAtDistance(float distance) const
+	{
+		size_t segment;
+		float t;
+		parameterAt(distance, segment, t);
+		return segment + t;
 	}
 
 private:
+	// p(t) = a t^3 + b t^2 + c t + d
+	struct Segment {
+		glm::vec3 a, b, c, d;
+	};
+
 	bool active;
-	bool loop;
+	Playback playback;
 	Curves curve;
+	float duration;
+	float elapsed = 0.0f;
+	bool constantSpeed = true;
 	vector <glm::vec3> controlPoints;
-	vector <glm::vec3> curvePoints;
-	int frame;
+	vector <Segment> segments;
+	// cumulative length at t = k / ANIMATION_ARC_SAMPLES of each segment in turn
+	vector <float> arcLengths;
+	float totalLength = 0.0f;
+
+	static glm::vec3 point(const Segment& s, float t)
+	{
+		return ((s.a * t + s.b) * t + s.c) * t + s.d;
+	}
+
+	static float speed(const Segment& s, float t)
+	{
+		return glm::length((3.0f * s.a * t + 2.0f * s.b) * t + s.c);
+	}
+
+	// five point Gauss-Legendre of the speed over [t0, t1]
+	static float gaussLegendre(const Segment& s, float t0, float t1)
+	{
+		static const float nodes[5] = { 0.0f, -0.5384693101f, 0.5384693101f, -0.9061798459f, 0.9061798459f };
+		static const float weights[5] = { 0.5688888889f, 0.4786286705f, 0.4786286705f, 0.2369268851f, 0.2369268851f };
+		float half = 0.5f * (t1 - t0);
+		float middle = 0.5f * (t0 + t1);
+		float sum = 0.0f;
+		for (int i = 0; i < 5; i++)
+			sum += weights[i] * speed(s, middle + half * nodes[i]);
+		return sum * half;
+	}
+
+	// splits the span until both halves agree with the whole
+	static float adaptiveLength(const Segment& s, float t0, float t1, float whole, float tolerance, int depth)
+	{
+		float middle = 0.5f * (t0 + t1);
+		float left = gaussLegendre(s, t0, middle);
+		float right = gaussLegendre(s, middle, t1);
+		if (depth == 0 || fabs(left + right - whole) <= tolerance)
+			return left + right;
+		return adaptiveLength(s, t0, middle, left, tolerance * 0.5f, depth - 1)
+			+ adaptiveLength(s, middle, t1, right, tolerance * 0.5f, depth - 1);
+	}
+
+	void computeArcLengths() {
+		arcLengths.assign(1, 0.0f);
+		double total = 0.0;
+		for (const Segment& s : segments)
+		{
+			for (int k = 0; k < ANIMATION_ARC_SAMPLES; k++)
+			{
+				float t0 = float(k) / ANIMATION_ARC_SAMPLES;
+				float t1 = float(k + 1) / ANIMATION_ARC_SAMPLES;
+				total += adaptiveLength(s, t0, t1, gaussLegendre(s, t0, t1), ANIMATION_ARC_TOLERANCE, 8);
+				arcLengths.push_back(float(total));
+			}
+		}
+		totalLength = float(total);
+	}
+
+	// segment and t at a distance along the curve: the table entry below it, then
+	// Newton on length(t) - distance, whose derivative is the speed
+	void parameterAt(float distance, size_t& segment, float& t) const
+	{
+		if (totalLength <= 0.0f)
+		{
+			segment = 0;
+			t = 0.0f;
+			return;
+		}
+		distance = std::min(std::max(distance, 0.0f), totalLength);
+		size_t entry = upper_bound(arcLengths.begin(), arcLengths.end(), distance) - arcLengths.begin();
+		entry = std::min(std::max<size_t>(entry, 1), arcLengths.size() - 1) - 1;
+
+		segment = entry / ANIMATION_ARC_SAMPLES;
+		float t0 = float(entry % ANIMATION_ARC_SAMPLES) / ANIMATION_ARC_SAMPLES;
+		float t1 = t0 + 1.0f / ANIMATION_ARC_SAMPLES;
+		float start = arcLengths[entry];
+		float span = arcLengths[entry + 1] - start;
+		float target = distance - start;
+
+		const Segment& s = segments[segment];
+		t = span > 0.0f ? t0 + (t1 - t0) * target / span : t0;
+		for (int i = 0; i < ANIMATION_NEWTON_STEPS; i++)
+		{
+			float v = speed(s, t);
+			if (v <= 0.0f)
+				break;
+			t = std::min(std::max(t - (gaussLegendre(s, t0, t) - target) / v, t0), t1);
+		}
+	}
 
 	void computeCurve() {
+		segments.clear();
 		switch (this->curve)
 		{
 		case Bezier:
@@ -76,94 +298,51 @@ private:
 		}
 	}
 
-	void computeBezier() {
-		float step = 1.0 / 100.0;
-
-		float t = 0;
+	// the columns of G * M are the coefficients of t^3, t^2, t and 1
+	void addSegment(const glm::mat4x3& G, const glm::mat4& M, float scale = 1.0f) {
+		glm::mat4x3 C = G * M * scale;
+		segments.push_back(Segment{ C[0], C[1], C[2], C[3] });
+	}
 
+	void computeBezier() {
 		int nControlPoints = controlPoints.size();
 
 		for (int i = 0; i < nControlPoints - 3; i += 3)
 		{
+			glm::vec3 P0 = controlPoints[i];
+			glm::vec3 P1 = controlPoints[i + 1];
+			glm::vec3 P2 = controlPoints[i + 2];
+			glm::vec3 P3 = controlPoints[i + 3];
 
-			for (t; t <= 1.0; t += step)
-			{
-				glm::vec3 p;
-
-				glm::vec4 T(t * t * t, t * t, t, 1);
-
-				glm::vec3 P0 = controlPoints[i];
-				glm::vec3 P1 = controlPoints[i + 1];
-				glm::vec3 P2 = controlPoints[i + 2];
-				glm::vec3 P3 = controlPoints[i + 3];
-
-				glm::mat4x3 G(P0, P1, P2, P3);
-
-				p = G * bezierM * T;  //---------
-
-				curvePoints.push_back(p);
-			}
+			addSegment(glm::mat4x3(P0, P1, P2, P3), bezierM);
 		}
 	}
 
 	void computeCatmullRom() {
-		float step = 1.0 / 100.0;
-
-		float t = 0;
-
 		int nControlPoints = controlPoints.size();
 
 		for (int i = 0; i < nControlPoints - 3; i += 3)
 		{
+			glm::vec3 P0 = controlPoints[i];
+			glm::vec3 P1 = controlPoints[i + 1];
+			glm::vec3 P2 = controlPoints[i + 2];
+			glm::vec3 P3 = controlPoints[i + 3];
 
-			for (float t = 0.0; t <= 1.0; t += step)
-			{
-				glm::vec3 p;
-
-				glm::vec4 T(t * t * t, t * t, t, 1);
-
-				glm::vec3 P0 = controlPoints[i];
-				glm::vec3 P1 = controlPoints[i + 1];
-				glm::vec3 P2 = controlPoints[i + 2];
-				glm::vec3 P3 = controlPoints[i + 3];
-
-				glm::mat4x3 G(P0, P1, P2, P3);
-
-				p = G * catmullRomM * T;  //---------
-				p = p * glm::vec3(0.5, 0.5, 0.5);
-
-				curvePoints.push_back(p);
-			}
+			addSegment(glm::mat4x3(P0, P1, P2, P3), catmullRomM, 0.5f);
 		}
 	}
 
 	void computeHermite() {
-		float step = 1.0 / 100.0;
-
-		float t = 0;
-
 		int nControlPoints = controlPoints.size();
 
 		for (int i = 0; i < nControlPoints - 3; i += 3)
 		{
+			glm::vec3 P0 = controlPoints[i];
+			glm::vec3 P1 = controlPoints[i + 3];
+			glm::vec3 T0 = controlPoints[i + 1] - P0;
+			glm::vec3 T1 = controlPoints[i + 2] - P1;
 
-			for (float t = 0.0; t <= 1.0; t += step)
-			{
-				glm::vec3 p;
-
-				glm::vec4 T(t * t * t, t * t, t, 1);
-
-				glm::vec3 P0 = controlPoints[i];
-				glm::vec3 P1 = controlPoints[i + 3];
-				glm::vec3 T0 = controlPoints[i + 1] - P0;
-				glm::vec3 T1 = controlPoints[i + 2] - P1;
-
-				glm::mat4x3 G(P0, P1, T0, T1);
-
-				p = G * hermiteM * T;  //---------
-
-				curvePoints.push_back(p);
-			}
+			addSegment(glm::mat4x3(P0, P1, T0, T1), hermiteM);
 		}
 	}
 
@@ -192,4 +371,4 @@ private:
 	);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,466 @@
+#ifndef ANIMATION_SYSTEM_H
+#define ANIMATION_SYSTEM_H
+
+#include <glm/glm.hpp>
+
+// the AVX2 evaluator is built for x86 only, and taken when cpuid reports AVX2
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#define ANIMATION_AVX2
+#endif
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define ANIMATION_SSE
+#endif
+
+#include <3DViewer/animation.h>
+#include <3DViewer/animationtracks.h>
+#include <3DViewer/threadpool.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+using namespace std;
+
+// remap table entries per segment of a constant speed track
+#define ANIMATION_REMAP_SAMPLES 32
+// fewest tracks worth handing to a worker thread
+#define ANIMATION_PARALLEL_TRACKS 8192
+#define ANIMATION_NO_TRACK -1
+
+struct AnimationStats {
+	unsigned int tracks = 0;
+	unsigned int segments = 0;
+	size_t remapEntries = 0;
+	unsigned int jobs = 0;
+	float microseconds = 0.0f;
+};
+
+// Every animated object's curve as one track, evaluated for a time in a single pass
+// instead of one Animation per object per draw. Tracks are kept as structure of
+// arrays, and so are the cubic coefficients of all their segments, so that four
+// (SSE2) or eight (AVX2) tracks run through the same instructions at once: playback
+// folding, a lookup in the track's remap table from the unit interval to its global
+// curve parameter, a gather of the segment's coefficients and a Horner evaluation.
+// The eight wide path with hardware gathers lives in AnimationAVX2.cpp, the one file
+// built with /arch:AVX2, and is chosen at startup when the CPU has AVX2; the rest of
+// the build stays at SSE2, which every other CPU takes.
+//
+// The remap table of a parametric track is the straight line to its segment count;
+// a constant speed track samples Animation::parameterAtDistance ANIMATION_REMAP_SAMPLES
+// times per segment and interpolates in between. Positions are read back per track.
+class AnimationSystem
+{
+public:
+	AnimationStats stats;
+	// the eight wide evaluator, where the CPU has it; the benchmark turns it off to
+	// time SSE2 as well
+	bool avx2 = hasAvx2();
+
+	// a track following the animation from startTime on the clock passed to evaluate
+	int add(const Animation& animation, float startTime = 0.0f)
+	{
+		if (!animation.isActive() || animation.getDuration() <= 0.0f)
+			return ANIMATION_NO_TRACK;
+
+		size_t count = animation.segmentCount();
+		int first = static_cast<int>(coefficients[0].size());
+		for (size_t s = 0; s < count; s++)
+		{
+			glm::vec3 c[4];
+			animation.coefficients(s, c[0], c[1], c[2], c[3]);
+			for (int k = 0; k < 12; k++)
+				coefficients[k].push_back(c[k / 3][k % 3]);
+		}
+
+		int offset = static_cast<int>(remap.size());
+		int entries = 1;
+		if (animation.isConstantSpeed())
+		{
+			entries = static_cast<int>(count) * ANIMATION_REMAP_SAMPLES;
+			for (int k = 0; k <= entries; k++)
+				remap.push_back(animation.parameterAtDistance(animation.length() * k / entries));
+		}
+		else
+		{
+			remap.push_back(0.0f);
+			remap.push_back(float(count));
+		}
+
+		start.push_back(startTime);
+		invDuration.push_back(1.0f / animation.getDuration());
+		mode.push_back(animation.getPlayback());
+		remapOffset.push_back(offset);
+		remapSize.push_back(float(entries));
+		remapLast.push_back(float(entries - 1));
+		firstSegment.push_back(first);
+		segmentLast.push_back(float(count - 1));
+		px.push_back(0.0f);
+		py.push_back(0.0f);
+		pz.push_back(0.0f);
+
+		stats.tracks = static_cast<unsigned int>(start.size());
+		stats.segments = static_cast<unsigned int>(coefficients[0].size());
+		stats.remapEntries = remap.size();
+		return static_cast<int>(start.size() - 1);
+	}
+
+	size_t trackCount() const
+	{
+		return start.size();
+	}
+
+	// worker threads of its own, the shared pool may be busy importing models; 0
+	// evaluates on the calling thread only
+	void setWorkers(unsigned int count)
+	{
+		workers.reset();
+		if (count > 0)
+			workers = make_unique<ThreadPool>(count);
+	}
+
+	// positions of every track at time, split over the workers when there are enough
+	void evaluate(float time)
+	{
+		auto begin = chrono::steady_clock::now();
+		size_t count = trackCount();
+		size_t jobs = workers ? std::min<size_t>(workers->size() + 1, count / ANIMATION_PARALLEL_TRACKS) : 1;
+		if (jobs <= 1)
+		{
+			evaluateRange(time, 0, count);
+			jobs = 1;
+		}
+		else
+		{
+			// whole groups of eight, so no two jobs write the same SIMD lanes
+			size_t chunk = ((count + jobs - 1) / jobs + 7) & ~size_t(7);
+			vector<future<void>> done;
+			for (size_t first = chunk; first < count; first += chunk)
+			{
+				size_t last = std::min(first + chunk, count);
+				done.push_back(workers->submit([this, time, first, last] { evaluateRange(time, first, last); }));
+			}
+			evaluateRange(time, 0, std::min(chunk, count));
+			for (future<void>& job : done)
+				job.wait();
+			jobs = done.size() + 1;
+		}
+		stats.jobs = static_cast<unsigned int>(jobs);
+		stats.microseconds = chrono::duration<float, micro>(chrono::steady_clock::now() - begin).count();
+	}
+
+	// the same pass one track at a time, as a reference
+	void evaluateScalar(float time)
+	{
+		evaluateTracks(time, 0, trackCount());
+	}
+
+	glm::vec3 position(int track) const
+	{
+		if (track < 0 || size_t(track) >= px.size())
+			return glm::vec3(0.0f);
+		return glm::vec3(px[track], py[track], pz[track]);
+	}
+
+	void clear()
+	{
+		for (vector<float>& c : coefficients)
+			c.clear();
+		remap.clear();
+		start.clear();
+		invDuration.clear();
+		mode.clear();
+		remapOffset.clear();
+		remapSize.clear();
+		remapLast.clear();
+		firstSegment.clear();
+		segmentLast.clear();
+		px.clear();
+		py.clear();
+		pz.clear();
+		stats = AnimationStats();
+	}
+
+	void report() const
+	{
+		cout << "ANIMATION:: tracks: " << stats.tracks << " segments: " << stats.segments
+			<< " remap: " << stats.remapEntries << " jobs: " << stats.jobs
+			<< " last pass: " << stats.microseconds << " us" << endl;
+	}
+
+	// AVX2 in the CPU, with the ymm registers saved by the OS; checked once
+	static bool hasAvx2()
+	{
+#if defined(ANIMATION_AVX2)
+		static bool available = detectAvx2();
+		return available;
+#else
+		return false;
+#endif
+	}
+
+	// times the scalar and SIMD passes over random tracks and checks they agree
+	static void benchmark(size_t tracks = 100000, int frames = 200)
+	{
+		mt19937 random(1);
+		uniform_real_distribution<float> coordinate(-50.0f, 50.0f);
+		uniform_real_distribution<float> seconds(2.0f, 10.0f);
+		AnimationSystem system;
+		for (size_t i = 0; i < tracks; i++)
+		{
+			vector<glm::vec3> controlPoints(4 + 3 * (i % 4));
+			for (glm::vec3& point : controlPoints)
+				point = glm::vec3(coordinate(random), coordinate(random), coordinate(random));
+			Animation animation(static_cast<Playback>(i % 3), static_cast<Curves>(i / 3 % 3), controlPoints, seconds(random));
+			animation.setConstantSpeed(i % 2 == 0);
+			system.add(animation, -coordinate(random));
+		}
+
+		auto time = [frames](int f) { return 10.0f * f / frames; };
+		double scalar = 0.0, simd = 0.0, threaded = 0.0;
+		for (int f = 0; f < frames; f++)
+		{
+			auto begin = chrono::steady_clock::now();
+			system.evaluateScalar(time(f));
+			scalar += chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+		}
+		vector<float> x = system.px, y = system.py, z = system.pz;
+
+		for (int f = 0; f < frames; f++)
+		{
+			system.evaluate(time(f));
+			simd += system.stats.microseconds / 1000.0;
+		}
+		float error = 0.0f;
+		for (size_t i = 0; i < tracks; i++)
+			error = std::max(error, std::max(fabs(x[i] - system.px[i]), std::max(fabs(y[i] - system.py[i]), fabs(z[i] - system.pz[i]))));
+
+		unsigned int workers = std::max(1u, thread::hardware_concurrency()) - 1;
+		system.setWorkers(workers);
+		for (int f = 0; f < frames; f++)
+		{
+			system.evaluate(time(f));
+			threaded += system.stats.microseconds / 1000.0;
+		}
+
+		// the same pass on SSE2, where the CPU took AVX2
+		double sse = 0.0;
+		if (system.avx2)
+		{
+			system.setWorkers(0);
+			system.avx2 = false;
+			for (int f = 0; f < frames; f++)
+			{
+				system.evaluate(time(f));
+				sse += system.stats.microseconds / 1000.0;
+			}
+			system.avx2 = true;
+		}
+
+#if defined(ANIMATION_SSE)
+		const char* path = system.avx2 ? "avx2" : "sse2";
+#else
+		const char* path = system.avx2 ? "avx2" : "scalar";
+#endif
+		cout << "ANIMATION_BENCH:: tracks: " << tracks << " segments: " << system.stats.segments << " frames: " << frames
+			<< " path: " << path << endl;
+		cout << "ANIMATION_BENCH:: scalar: " << scalar / frames << " ms/frame " << scalar * 1e6 / (double(frames) * tracks) << " ns/track" << endl;
+		cout << "ANIMATION_BENCH:: simd: " << simd / frames << " ms/frame " << simd * 1e6 / (double(frames) * tracks) << " ns/track, "
+			<< scalar / simd << "x" << endl;
+		if (sse > 0.0)
+			cout << "ANIMATION_BENCH:: sse2: " << sse / frames << " ms/frame " << sse * 1e6 / (double(frames) * tracks) << " ns/track, "
+				<< scalar / sse << "x" << endl;
+		cout << "ANIMATION_BENCH:: simd with " << workers << " workers: " << threaded / frames << " ms/frame, "
+			<< scalar / threaded << "x" << endl;
+		cout << "ANIMATION_BENCH:: max difference from scalar: " << error << endl;
+	}
+
+private:
+	// a.x a.y a.z b.x b.y b.z c.x c.y c.z d.x d.y d.z of every segment, by segment
+	vector<float> coefficients[12];
+	// global curve parameter at evenly spaced points of the unit interval, by track
+	vector<float> remap;
+
+	// per track
+	vector<float> start;
+	vector<float> invDuration;
+	vector<int> mode;
+	vector<int> remapOffset;
+	vector<float> remapSize;
+	vector<float> remapLast;
+	vector<int> firstSegment;
+	vector<float> segmentLast;
+	vector<float> px, py, pz;
+
+	unique_ptr<ThreadPool> workers;
+
+	void evaluateRange(float time, size_t first, size_t last)
+	{
+#if defined(ANIMATION_AVX2)
+		if (avx2)
+			first = AnimationEvaluateAVX2(arrays(), time, first, last);
+#endif
+#if defined(ANIMATION_SSE)
+		for (; first + 4 <= last; first += 4)
+			evaluateFour(time, first);
+#endif
+		evaluateTracks(time, first, last);
+	}
+
+	AnimationTracks arrays()
+	{
+		AnimationTracks tracks;
+		tracks.start = start.data();
+		tracks.invDuration = invDuration.data();
+		tracks.mode = mode.data();
+		tracks.remapOffset = remapOffset.data();
+		tracks.remapSize = remapSize.data();
+		tracks.remapLast = remapLast.data();
+		tracks.firstSegment = firstSegment.data();
+		tracks.segmentLast = segmentLast.data();
+		tracks.remap = remap.data();
+		for (int k = 0; k < 12; k++)
+			tracks.coefficients[k] = coefficients[k].data();
+		tracks.px = px.data();
+		tracks.py = py.data();
+		tracks.pz = pz.data();
+		tracks.once = Once;
+		tracks.loop = Loop;
+		return tracks;
+	}
+
+#if defined(ANIMATION_AVX2)
+	static void cpuid(unsigned int leaf, unsigned int info[4])
+	{
+#if defined(_MSC_VER)
+		__cpuidex(reinterpret_cast<int*>(info), leaf, 0);
+#else
+		__cpuid_count(leaf, 0, info[0], info[1], info[2], info[3]);
+#endif
+	}
+
+	static bool detectAvx2()
+	{
+		unsigned int info[4];
+		cpuid(0, info);
+		if (info[0] < 7)
+			return false;
+		// OSXSAVE and AVX, then whether the OS saves the xmm and ymm state
+		cpuid(1, info);
+		if ((info[2] & (1u << 27)) == 0 || (info[2] & (1u << 28)) == 0)
+			return false;
+#if defined(_MSC_VER)
+		unsigned long long xcr0 = _xgetbv(0);
+#else
+		unsigned int eax, edx;
+		__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		unsigned long long xcr0 = eax;
+#endif
+		if ((xcr0 & 6) != 6)
+			return false;
+		cpuid(7, info);
+		return (info[1] & (1u << 5)) != 0;
+	}
+#endif
+
+	// values are never negative, so truncation is floor
+	void evaluateTracks(float time, size_t first, size_t last)
+	{
+		for (size_t i = first; i < last; i++)
+		{
+			float u = std::max(time - start[i], 0.0f) * invDuration[i];
+			if (mode[i] == Once)
+				u = std::min(u, 1.0f);
+			else if (mode[i] == Loop)
+				u = u - float(int(u));
+			else
+			{
+				u = u - 2.0f * float(int(u * 0.5f));
+				if (u > 1.0f)
+					u = 2.0f - u;
+			}
+
+			float x = u * remapSize[i];
+			int k = int(std::min(x, remapLast[i]));
+			float f = x - float(k);
+			const float* r = &remap[remapOffset[i] + k];
+			float s = r[0] + f * (r[1] - r[0]);
+
+			int segment = int(std::min(s, segmentLast[i]));
+			float t = s - float(segment);
+			size_t c = firstSegment[i] + segment;
+			px[i] = ((coefficients[0][c] * t + coefficients[3][c]) * t + coefficients[6][c]) * t + coefficients[9][c];
+			py[i] = ((coefficients[1][c] * t + coefficients[4][c]) * t + coefficients[7][c]) * t + coefficients[10][c];
+			pz[i] = ((coefficients[2][c] * t + coefficients[5][c]) * t + coefficients[8][c]) * t + coefficients[11][c];
+		}
+	}
+
+#if defined(ANIMATION_SSE)
+	static __m128 select(__m128 mask, __m128 a, __m128 b)
+	{
+		return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+	}
+
+	// SSE2 has neither floor nor gathers: truncation of values that are never
+	// negative, and four loads per gather through the indices stored to memory
+	static __m128 truncate(__m128 v)
+	{
+		return _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+	}
+
+	static __m128 gather(const float* base, const int* index)
+	{
+		return _mm_set_ps(base[index[3]], base[index[2]], base[index[1]], base[index[0]]);
+	}
+
+	void evaluateFour(float time, size_t i)
+	{
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 two = _mm_set1_ps(2.0f);
+
+		__m128 u = _mm_mul_ps(_mm_max_ps(_mm_sub_ps(_mm_set1_ps(time), _mm_loadu_ps(&start[i])), zero), _mm_loadu_ps(&invDuration[i]));
+		__m128 once = _mm_min_ps(u, one);
+		__m128 loop = _mm_sub_ps(u, truncate(u));
+		__m128 pingPong = _mm_sub_ps(u, _mm_mul_ps(two, truncate(_mm_mul_ps(u, _mm_set1_ps(0.5f)))));
+		pingPong = select(_mm_cmpgt_ps(pingPong, one), _mm_sub_ps(two, pingPong), pingPong);
+		__m128i playback = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mode[i]));
+		u = select(_mm_castsi128_ps(_mm_cmpeq_epi32(playback, _mm_set1_epi32(Loop))), loop, pingPong);
+		u = select(_mm_castsi128_ps(_mm_cmpeq_epi32(playback, _mm_set1_epi32(Once))), once, u);
+
+		__m128 x = _mm_mul_ps(u, _mm_loadu_ps(&remapSize[i]));
+		__m128i k = _mm_cvttps_epi32(_mm_min_ps(x, _mm_loadu_ps(&remapLast[i])));
+		__m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(k));
+		alignas(16) int index[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(index), _mm_add_epi32(k, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&remapOffset[i]))));
+		__m128 r0 = gather(remap.data(), index);
+		__m128 r1 = gather(remap.data() + 1, index);
+		__m128 s = _mm_add_ps(r0, _mm_mul_ps(f, _mm_sub_ps(r1, r0)));
+
+		__m128i segment = _mm_cvttps_epi32(_mm_min_ps(s, _mm_loadu_ps(&segmentLast[i])));
+		__m128 t = _mm_sub_ps(s, _mm_cvtepi32_ps(segment));
+		_mm_store_si128(reinterpret_cast<__m128i*>(index), _mm_add_epi32(segment, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&firstSegment[i]))));
+
+		float* out[3] = { &px[i], &py[i], &pz[i] };
+		for (int axis = 0; axis < 3; axis++)
+		{
+			__m128 p = gather(coefficients[axis].data(), index);
+			p = _mm_add_ps(_mm_mul_ps(p, t), gather(coefficients[3 + axis].data(), index));
+			p = _mm_add_ps(_mm_mul_ps(p, t), gather(coefficients[6 + axis].data(), index));
+			p = _mm_add_ps(_mm_mul_ps(p, t), gather(coefficients[9 + axis].data(), index));
+			_mm_storeu_ps(out[axis], p);
+		}
+	}
+#endif
+};
+
+#endif
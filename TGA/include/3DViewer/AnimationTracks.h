@@ -0,0 +1,33 @@
+#ifndef ANIMATION_TRACKS_H
+#define ANIMATION_TRACKS_H
+
+#include <cstddef>
+
+// The arrays of an AnimationSystem as plain pointers, for the evaluator built for
+// another instruction set in a translation unit of its own. It must not see glm or
+// the standard containers: the linker keeps one copy of an inline function for the
+// whole program, and that could be the one compiled with AVX2.
+struct AnimationTracks {
+	const float* start;
+	const float* invDuration;
+	const int* mode;
+	const int* remapOffset;
+	const float* remapSize;
+	const float* remapLast;
+	const int* firstSegment;
+	const float* segmentLast;
+	const float* remap;
+	const float* coefficients[12];
+	float* px;
+	float* py;
+	float* pz;
+	// Playback values of mode
+	int once;
+	int loop;
+};
+
+// AnimationAVX2.cpp: evaluates tracks eight at a time from first with hardware
+// gathers and returns the first one left for the caller; AVX2 CPUs only
+size_t AnimationEvaluateAVX2(const AnimationTracks& tracks, float time, size_t first, size_t last);
+
+#endif
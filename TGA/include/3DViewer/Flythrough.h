@@ -0,0 +1,202 @@
+#ifndef FLYTHROUGH_H
+#define FLYTHROUGH_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include <3DViewer/animation.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// timer queries in flight, so reading one never waits for the frame just submitted
+#define FLYTHROUGH_QUERIES 4
+// simulated seconds per frame unless the benchmark is given another step
+#define FLYTHROUGH_STEP (1.0f / 60.0f)
+
+// Where the camera is at a time: its position on one curve and what it looks at on
+// another, or along the position curve when there is no target. Both are Animations
+// played once over the same duration, so a time always gives the same pose.
+class CameraPath
+{
+public:
+	CameraPath() {}
+
+	CameraPath(const Animation& position) : position(position)
+	{
+	}
+
+	// target should be played over the duration of position
+	CameraPath(const Animation& position, const Animation& target) : position(position), target(target), looksAtTarget(true)
+	{
+	}
+
+	float getDuration() const
+	{
+		return position.getDuration();
+	}
+
+	// front is kept as it was where the direction is undefined, e.g. at a stop
+	void pose(float seconds, glm::vec3& eye, glm::vec3& front) const
+	{
+		eye = position.evaluate(seconds);
+		glm::vec3 toward = looksAtTarget ? target.evaluate(seconds) - eye
+			: position.evaluate(seconds + FLYTHROUGH_STEP) - position.evaluate(seconds - FLYTHROUGH_STEP);
+		float length = glm::length(toward);
+		if (length > 1e-6f)
+			front = toward / length;
+	}
+
+private:
+	Animation position;
+	Animation target;
+	bool looksAtTarget = false;
+};
+
+struct FrameTimeSummary {
+	size_t frames = 0;
+	float min = 0.0f;
+	float avg = 0.0f;
+	float p50 = 0.0f;
+	float p95 = 0.0f;
+	float p99 = 0.0f;
+	float max = 0.0f;
+};
+
+// Milliseconds per frame of one measure, summarized with nearest rank percentiles.
+class FrameTimes
+{
+public:
+	vector<float> milliseconds;
+
+	void add(float value)
+	{
+		milliseconds.push_back(value);
+	}
+
+	FrameTimeSummary summary() const
+	{
+		FrameTimeSummary summary;
+		summary.frames = milliseconds.size();
+		if (milliseconds.empty())
+			return summary;
+
+		vector<float> sorted = milliseconds;
+		sort(sorted.begin(), sorted.end());
+		double total = 0.0;
+		for (float value : sorted)
+			total += value;
+		summary.min = sorted.front();
+		summary.max = sorted.back();
+		summary.avg = static_cast<float>(total / sorted.size());
+		summary.p50 = percentile(sorted, 50.0f);
+		summary.p95 = percentile(sorted, 95.0f);
+		summary.p99 = percentile(sorted, 99.0f);
+		return summary;
+	}
+
+private:
+	static float percentile(const vector<float>& sorted, float p)
+	{
+		size_t rank = static_cast<size_t>(ceil(p / 100.0f * sorted.size()));
+		return sorted[std::min(std::max(rank, size_t(1)), sorted.size()) - 1];
+	}
+};
+
+// GPU time of each frame through GL_TIME_ELAPSED queries, kept FLYTHROUGH_QUERIES
+// deep: a result is only asked for when its query comes round again, by which time
+// the frame has usually finished, and finish() waits for the rest. Only one frame can
+// be timed at a time, as GL allows a single elapsed time query.
+class GpuTimer
+{
+public:
+	// frames whose result was not there when their query was needed again
+	unsigned int stalls = 0;
+
+	~GpuTimer()
+	{
+		destroy();
+	}
+
+	void begin(size_t frame)
+	{
+		if (!queries[0])
+			glGenQueries(FLYTHROUGH_QUERIES, queries);
+		Slot& slot = slots[next];
+		if (slot.pending)
+		{
+			GLuint available = 0;
+			glGetQueryObjectuiv(queries[next], GL_QUERY_RESULT_AVAILABLE, &available);
+			stalls += available ? 0 : 1;
+			land(next);
+		}
+		slot.frame = frame;
+		slot.pending = true;
+		glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+	}
+
+	void end()
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		next = (next + 1) % FLYTHROUGH_QUERIES;
+	}
+
+	// waits for every query still in flight
+	void finish()
+	{
+		for (size_t i = 0; i < FLYTHROUGH_QUERIES; i++)
+		{
+			size_t q = (next + i) % FLYTHROUGH_QUERIES;
+			if (slots[q].pending)
+				land(q);
+		}
+	}
+
+	// milliseconds by the frame numbers given to begin(), -1 where none landed
+	const vector<float>& milliseconds() const
+	{
+		return results;
+	}
+
+	// while the context is still current
+	void destroy()
+	{
+		if (queries[0])
+			glDeleteQueries(FLYTHROUGH_QUERIES, queries);
+		for (size_t i = 0; i < FLYTHROUGH_QUERIES; i++)
+		{
+			queries[i] = 0;
+			slots[i] = Slot();
+		}
+		next = 0;
+	}
+
+private:
+	struct Slot {
+		size_t frame = 0;
+		bool pending = false;
+	};
+
+	GLuint queries[FLYTHROUGH_QUERIES] = {};
+	Slot slots[FLYTHROUGH_QUERIES];
+	size_t next = 0;
+	vector<float> results;
+
+	void land(size_t q)
+	{
+		GLuint64 nanoseconds = 0;
+		glGetQueryObjectui64v(queries[q], GL_QUERY_RESULT, &nanoseconds);
+		if (results.size() <= slots[q].frame)
+			results.resize(slots[q].frame + 1, -1.0f);
+		results[slots[q].frame] = static_cast<float>(nanoseconds / 1e6);
+		slots[q].pending = false;
+	}
+};
+
+#endif
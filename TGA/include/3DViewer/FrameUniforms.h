@@ -0,0 +1,91 @@
+#ifndef FRAME_UNIFORMS_H
+#define FRAME_UNIFORMS_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <3DViewer/shader.h>
+
+#include <cstddef>
+
+#define FRAME_UNIFORM_BINDING 0
+
+// std140 mirrors of the structs in the Frame block of shader.vs/shader.fs; every
+// vec3 starts on a 16 byte boundary, floats may fill the gap behind it
+struct DirLightBlock {
+	glm::vec3 direction;
+	float padding0;
+	glm::vec3 ambient;
+	float padding1;
+	glm::vec3 diffuse;
+	float padding2;
+	glm::vec3 specular;
+	float padding3;
+};
+
+struct SpotLightBlock {
+	glm::vec3 position;
+	float padding0;
+	glm::vec3 direction;
+	float cutOff;
+	float outerCutOff;
+	float constant;
+	float linear;
+	float quadratic;
+	glm::vec3 ambient;
+	float padding1;
+	glm::vec3 diffuse;
+	float padding2;
+	glm::vec3 specular;
+	float padding3;
+};
+
+struct FrameBlock {
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::vec3 viewPos;
+	float padding0;
+	DirLightBlock dirLight;
+	SpotLightBlock spotLight;
+};
+
+static_assert(sizeof(DirLightBlock) == 64, "DirLight does not match std140");
+static_assert(sizeof(SpotLightBlock) == 96, "SpotLight does not match std140");
+static_assert(offsetof(FrameBlock, viewPos) == 128, "Frame.viewPos does not match std140");
+static_assert(offsetof(FrameBlock, dirLight) == 144, "Frame.dirLight does not match std140");
+static_assert(offsetof(FrameBlock, spotLight) == 208, "Frame.spotLight does not match std140");
+
+// Camera and lighting state shared by every program through one uniform buffer,
+// written once per frame instead of per program and per object.
+class FrameUniforms
+{
+public:
+	FrameBlock data = {};
+
+	void create()
+	{
+		glGenBuffers(1, &UBO);
+		glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameBlock), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORM_BINDING, UBO);
+	}
+
+	// points the program's Frame block at the shared buffer
+	void attach(const Shader& shader) const
+	{
+		shader.bindUniformBlock("Frame", FRAME_UNIFORM_BINDING);
+	}
+
+	void upload() const
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameBlock), &data);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+private:
+	unsigned int UBO = 0;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <glm/glm.hpp>
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define FRUSTUM_SSE
+#endif
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+using namespace std;
+
+// object space bounds of a mesh, computed once at import
+struct Bounds {
+	glm::vec3 min = glm::vec3(0.0f);
+	glm::vec3 max = glm::vec3(0.0f);
+	glm::vec3 center = glm::vec3(0.0f);
+	float radius = 0.0f;
+};
+
+// bounds enclosing both a and b
+inline Bounds MergeBounds(const Bounds& a, const Bounds& b)
+{
+	Bounds bounds;
+	bounds.min = glm::min(a.min, b.min);
+	bounds.max = glm::max(a.max, b.max);
+	bounds.center = (bounds.min + bounds.max) * 0.5f;
+	bounds.radius = std::max(glm::length(a.center - bounds.center) + a.radius, glm::length(b.center - bounds.center) + b.radius);
+	return bounds;
+}
+
+// world space sphere (xyz center, w radius) of bounds placed by a model matrix
+inline glm::vec4 TransformSphere(const Bounds& bounds, const glm::mat4& model)
+{
+	glm::vec3 center = glm::vec3(model * glm::vec4(bounds.center, 1.0f));
+	float scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+	return glm::vec4(center, bounds.radius * scale);
+}
+
+struct CullingStats {
+	unsigned int meshesDrawn = 0;
+	unsigned int meshesCulled = 0;
+};
+
+enum FrustumResult : unsigned char {
+	FRUSTUM_OUTSIDE = 0,
+	FRUSTUM_INTERSECTS = 1,
+	FRUSTUM_INSIDE = 2
+};
+
+// The six clip planes of a view-projection matrix, normals pointing inwards. Spheres
+// are tested four at a time against planes kept as SoA; boxes are only tested for
+// spheres straddling a plane. A default constructed Frustum contains everything.
+class Frustum
+{
+public:
+	Frustum()
+	{
+		for (int i = 0; i < 6; i++)
+			setPlane(i, glm::vec4(0.0f, 0.0f, 0.0f, FLT_MAX));
+	}
+
+	Frustum(const glm::mat4& viewProjection)
+	{
+		glm::vec4 row0 = glm::vec4(viewProjection[0][0], viewProjection[1][0], viewProjection[2][0], viewProjection[3][0]);
+		glm::vec4 row1 = glm::vec4(viewProjection[0][1], viewProjection[1][1], viewProjection[2][1], viewProjection[3][1]);
+		glm::vec4 row2 = glm::vec4(viewProjection[0][2], viewProjection[1][2], viewProjection[2][2], viewProjection[3][2]);
+		glm::vec4 row3 = glm::vec4(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+
+		setPlane(0, row3 + row0); // left
+		setPlane(1, row3 - row0); // right
+		setPlane(2, row3 + row1); // bottom
+		setPlane(3, row3 - row1); // top
+		setPlane(4, row3 + row2); // near
+		setPlane(5, row3 - row2); // far
+	}
+
+	FrustumResult testSphere(const glm::vec4& sphere) const
+	{
+		FrustumResult result = FRUSTUM_INSIDE;
+		for (int i = 0; i < 6; i++)
+		{
+			float distance = planeX[i] * sphere.x + planeY[i] * sphere.y + planeZ[i] * sphere.z + planeW[i];
+			if (distance < -sphere.w)
+				return FRUSTUM_OUTSIDE;
+			if (distance < sphere.w)
+				result = FRUSTUM_INTERSECTS;
+		}
+		return result;
+	}
+
+	// writes a FrustumResult per sphere
+	void testSpheres(const glm::vec4* spheres, size_t count, unsigned char* results) const
+	{
+		size_t i = 0;
+#ifdef FRUSTUM_SSE
+		const __m128 zero = _mm_setzero_ps();
+		for (; i + 4 <= count; i += 4)
+		{
+			// transpose four spheres into x, y, z and radius lanes
+			__m128 x = _mm_loadu_ps(&spheres[i].x);
+			__m128 y = _mm_loadu_ps(&spheres[i + 1].x);
+			__m128 z = _mm_loadu_ps(&spheres[i + 2].x);
+			__m128 r = _mm_loadu_ps(&spheres[i + 3].x);
+			_MM_TRANSPOSE4_PS(x, y, z, r);
+			__m128 negative = _mm_sub_ps(zero, r);
+
+			__m128 outside = zero;
+			__m128 straddles = zero;
+			for (int p = 0; p < 6; p++)
+			{
+				__m128 distance = _mm_add_ps(
+					_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planeX[p])), _mm_mul_ps(y, _mm_set1_ps(planeY[p]))),
+					_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planeZ[p])), _mm_set1_ps(planeW[p])));
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, negative));
+				straddles = _mm_or_ps(straddles, _mm_cmplt_ps(distance, r));
+			}
+
+			int outsideMask = _mm_movemask_ps(outside);
+			int straddlesMask = _mm_movemask_ps(straddles);
+			for (int lane = 0; lane < 4; lane++)
+			{
+				if (outsideMask & (1 << lane))
+					results[i + lane] = FRUSTUM_OUTSIDE;
+				else if (straddlesMask & (1 << lane))
+					results[i + lane] = FRUSTUM_INTERSECTS;
+				else
+					results[i + lane] = FRUSTUM_INSIDE;
+			}
+		}
+#endif
+		for (; i < count; i++)
+			results[i] = testSphere(spheres[i]);
+	}
+
+	// the box placed by the model matrix against each plane, using its projected
+	// extent along the plane normal
+	bool intersects(const Bounds& bounds, const glm::mat4& model) const
+	{
+		glm::vec3 center = glm::vec3(model * glm::vec4((bounds.min + bounds.max) * 0.5f, 1.0f));
+		glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+		glm::vec3 axisX = glm::vec3(model[0]) * extent.x;
+		glm::vec3 axisY = glm::vec3(model[1]) * extent.y;
+		glm::vec3 axisZ = glm::vec3(model[2]) * extent.z;
+
+		for (int i = 0; i < 6; i++)
+		{
+			glm::vec3 normal = glm::vec3(planeX[i], planeY[i], planeZ[i]);
+			float radius = fabsf(glm::dot(normal, axisX)) + fabsf(glm::dot(normal, axisY)) + fabsf(glm::dot(normal, axisZ));
+			if (glm::dot(normal, center) + planeW[i] < -radius)
+				return false;
+		}
+		return true;
+	}
+
+private:
+	float planeX[6];
+	float planeY[6];
+	float planeZ[6];
+	float planeW[6];
+
+	void setPlane(int i, glm::vec4 plane)
+	{
+		float length = glm::length(glm::vec3(plane));
+		if (length > 0.0f)
+			plane /= length;
+		planeX[i] = plane.x;
+		planeY[i] = plane.y;
+		planeZ[i] = plane.z;
+		planeW[i] = plane.w;
+	}
+};
+
+#endif
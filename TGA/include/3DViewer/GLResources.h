@@ -0,0 +1,332 @@
+#ifndef GL_RESOURCES_H
+#define GL_RESOURCES_H
+
+#include <glad/glad.h>
+
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+// frames a retired object waits before it is deleted or pooled, enough for the
+// frames the driver may still have queued to finish with it
+#define GL_DEFERRED_FRAMES 3
+// retired buffers and textures kept for reuse; the oldest are deleted past this
+#define GL_POOL_MAX_BYTES (64u << 20)
+
+struct BufferDesc {
+	size_t bytes = 0;
+	GLenum usage = GL_STATIC_DRAW;
+};
+
+struct VertexArrayDesc {
+};
+
+struct TextureDesc {
+	int width = 0;
+	int height = 0;
+	GLenum format = GL_RGBA;
+	// GL_SRGB8 or GL_SRGB8_ALPHA8 for colors stored with the sRGB curve
+	GLenum internalFormat = GL_RGBA;
+
+	bool operator==(const TextureDesc& other) const { return width == other.width && height == other.height && format == other.format && internalFormat == other.internalFormat; }
+	// base level plus a third for the mip chain
+	size_t bytes() const { return size_t(width) * height * (format == GL_RED ? 1 : format == GL_RGB ? 3 : 4) * 4 / 3; }
+};
+
+// Owning GL object name. Move-only; destroying or resetting it hands the name to
+// GLResources, which deletes or pools it once the GPU can no longer be using it.
+template <typename Desc>
+class GLHandle
+{
+public:
+	GLHandle() {}
+	GLHandle(unsigned int name, const Desc& desc) : name(name), desc(desc) {}
+	~GLHandle() { reset(); }
+
+	GLHandle(const GLHandle&) = delete;
+	GLHandle& operator=(const GLHandle&) = delete;
+
+	GLHandle(GLHandle&& other) noexcept : name(other.name), desc(other.desc)
+	{
+		other.name = 0;
+	}
+
+	GLHandle& operator=(GLHandle&& other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+			name = other.name;
+			desc = other.desc;
+			other.name = 0;
+		}
+		return *this;
+	}
+
+	unsigned int id() const { return name; }
+	const Desc& description() const { return desc; }
+	explicit operator bool() const { return name != 0; }
+
+	// gives up ownership, the caller deletes the object
+	unsigned int release()
+	{
+		unsigned int released = name;
+		name = 0;
+		return released;
+	}
+
+	void reset();
+
+private:
+	unsigned int name = 0;
+	Desc desc;
+};
+
+typedef GLHandle<BufferDesc> GLBuffer;
+typedef GLHandle<VertexArrayDesc> GLVertexArray;
+typedef GLHandle<TextureDesc> GLTexture;
+
+struct GLResourceStats {
+	unsigned int buffersCreated = 0;
+	unsigned int buffersReused = 0;
+	unsigned int texturesCreated = 0;
+	unsigned int texturesReused = 0;
+	unsigned int vertexArraysCreated = 0;
+	unsigned int deleted = 0;
+	unsigned int pending = 0;
+	size_t pooledBytes = 0;
+};
+
+// Creates, retires and recycles the GL objects of meshes, models and textures, on
+// the GL thread only. Retired objects wait GL_DEFERRED_FRAMES calls of endFrame();
+// static buffers and textures then go to a pool that the next request for the same
+// size takes from, so reloading a scene reuses the storage of the one it replaces
+// instead of growing the driver's heap. Everything else is deleted.
+class GLResources
+{
+public:
+	GLResourceStats stats;
+
+	// never destroyed, handles in other singletons may still retire objects during
+	// static destruction
+	static GLResources& instance()
+	{
+		static GLResources* resources = new GLResources();
+		return *resources;
+	}
+
+	// a buffer of bytes holding data, left bound to target; static buffers of the
+	// same size are taken from the pool
+	GLBuffer buffer(GLenum target, size_t bytes, const void* data, GLenum usage = GL_STATIC_DRAW)
+	{
+		BufferDesc desc;
+		desc.bytes = bytes;
+		desc.usage = usage;
+		for (size_t i = 0; i < bufferPool.size(); i++)
+		{
+			if (bufferPool[i].desc.bytes != bytes || bufferPool[i].desc.usage != usage)
+				continue;
+			unsigned int name = bufferPool[i].name;
+			bufferPool.erase(bufferPool.begin() + i);
+			stats.pooledBytes -= bytes;
+			stats.buffersReused++;
+			glBindBuffer(target, name);
+			if (data)
+				glBufferSubData(target, 0, bytes, data);
+			return GLBuffer(name, desc);
+		}
+
+		unsigned int name;
+		glGenBuffers(1, &name);
+		glBindBuffer(target, name);
+		glBufferData(target, bytes, data, usage);
+		stats.buffersCreated++;
+		return GLBuffer(name, desc);
+	}
+
+	GLVertexArray vertexArray()
+	{
+		unsigned int name;
+		glGenVertexArrays(1, &name);
+		stats.vertexArraysCreated++;
+		return GLVertexArray(name, VertexArrayDesc());
+	}
+
+	// a texture with a mip chain for the description, left bound to GL_TEXTURE_2D;
+	// pixels, if any, fill the base level and the mips are regenerated
+	GLTexture texture(const TextureDesc& desc, const void* pixels)
+	{
+		unsigned int name = 0;
+		for (size_t i = 0; i < texturePool.size() && desc.width > 0; i++)
+		{
+			if (!(texturePool[i].desc == desc))
+				continue;
+			name = texturePool[i].name;
+			texturePool.erase(texturePool.begin() + i);
+			stats.pooledBytes -= desc.bytes();
+			stats.texturesReused++;
+			glBindTexture(GL_TEXTURE_2D, name);
+			if (pixels)
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, desc.width, desc.height, desc.format, GL_UNSIGNED_BYTE, pixels);
+			break;
+		}
+		if (name == 0)
+		{
+			glGenTextures(1, &name);
+			glBindTexture(GL_TEXTURE_2D, name);
+			if (desc.width > 0)
+				glTexImage2D(GL_TEXTURE_2D, 0, desc.internalFormat, desc.width, desc.height, 0, desc.format, GL_UNSIGNED_BYTE, pixels);
+			stats.texturesCreated++;
+		}
+		if (desc.width > 0)
+			glGenerateMipmap(GL_TEXTURE_2D);
+		return GLTexture(name, desc);
+	}
+
+	void retire(unsigned int name, const BufferDesc& desc)
+	{
+		queue(name, desc.usage == GL_STATIC_DRAW ? BUFFER : BUFFER_DELETE, desc.bytes, TextureDesc());
+	}
+
+	void retire(unsigned int name, const VertexArrayDesc&)
+	{
+		queue(name, VERTEX_ARRAY, 0, TextureDesc());
+	}
+
+	void retire(unsigned int name, const TextureDesc& desc)
+	{
+		queue(name, desc.width > 0 ? TEXTURE : TEXTURE_DELETE, desc.bytes(), desc);
+	}
+
+	// once per frame, after the swap: objects retired GL_DEFERRED_FRAMES frames ago
+	// are deleted or pooled
+	void endFrame()
+	{
+		frame++;
+		while (!retired.empty() && frame - retired.front().frame >= GL_DEFERRED_FRAMES)
+		{
+			collect(retired.front());
+			retired.pop_front();
+		}
+		stats.pending = static_cast<unsigned int>(retired.size());
+		trim(GL_POOL_MAX_BYTES);
+	}
+
+	// deletes everything retired or pooled, while the context is still current
+	void clear()
+	{
+		for (const Retired& object : retired)
+			destroy(object);
+		retired.clear();
+		stats.pending = 0;
+		trim(0);
+	}
+
+	void report() const
+	{
+		cout << "GL_RESOURCES:: buffers: " << stats.buffersCreated << " created " << stats.buffersReused << " reused"
+			<< " textures: " << stats.texturesCreated << " created " << stats.texturesReused << " reused"
+			<< " pending: " << stats.pending << " pooled: " << stats.pooledBytes / 1024 << " KB" << endl;
+	}
+
+private:
+	enum RetiredKind { BUFFER, BUFFER_DELETE, VERTEX_ARRAY, TEXTURE, TEXTURE_DELETE };
+
+	struct Retired {
+		unsigned int name;
+		RetiredKind kind;
+		uint64_t frame;
+		size_t bytes;
+		TextureDesc texture;
+	};
+
+	template <typename Desc>
+	struct Pooled {
+		unsigned int name;
+		Desc desc;
+	};
+
+	uint64_t frame = 0;
+	deque<Retired> retired;
+	// oldest first
+	vector<Pooled<BufferDesc>> bufferPool;
+	vector<Pooled<TextureDesc>> texturePool;
+
+	GLResources() {}
+
+	void queue(unsigned int name, RetiredKind kind, size_t bytes, const TextureDesc& texture)
+	{
+		Retired object;
+		object.name = name;
+		object.kind = kind;
+		object.frame = frame;
+		object.bytes = bytes;
+		object.texture = texture;
+		retired.push_back(object);
+		stats.pending = static_cast<unsigned int>(retired.size());
+	}
+
+	void collect(const Retired& object)
+	{
+		if (object.kind == BUFFER)
+		{
+			BufferDesc desc;
+			desc.bytes = object.bytes;
+			bufferPool.push_back(Pooled<BufferDesc>{ object.name, desc });
+			stats.pooledBytes += object.bytes;
+		}
+		else if (object.kind == TEXTURE)
+		{
+			texturePool.push_back(Pooled<TextureDesc>{ object.name, object.texture });
+			stats.pooledBytes += object.bytes;
+		}
+		else
+			destroy(object);
+	}
+
+	void destroy(const Retired& object)
+	{
+		if (object.kind == BUFFER || object.kind == BUFFER_DELETE)
+			glDeleteBuffers(1, &object.name);
+		else if (object.kind == VERTEX_ARRAY)
+			glDeleteVertexArrays(1, &object.name);
+		else
+			glDeleteTextures(1, &object.name);
+		stats.deleted++;
+	}
+
+	// deletes the oldest pooled objects until the pool fits in maxBytes
+	void trim(size_t maxBytes)
+	{
+		while (stats.pooledBytes > maxBytes && (!bufferPool.empty() || !texturePool.empty()))
+		{
+			// the larger of the oldest buffer and the oldest texture goes first
+			bool buffer = texturePool.empty() || (!bufferPool.empty() && bufferPool.front().desc.bytes >= texturePool.front().desc.bytes());
+			if (buffer)
+			{
+				glDeleteBuffers(1, &bufferPool.front().name);
+				stats.pooledBytes -= bufferPool.front().desc.bytes;
+				bufferPool.erase(bufferPool.begin());
+			}
+			else
+			{
+				glDeleteTextures(1, &texturePool.front().name);
+				stats.pooledBytes -= texturePool.front().desc.bytes();
+				texturePool.erase(texturePool.begin());
+			}
+			stats.deleted++;
+		}
+	}
+};
+
+template <typename Desc>
+void GLHandle<Desc>::reset()
+{
+	if (name != 0)
+		GLResources::instance().retire(name, desc);
+	name = 0;
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef GL_STATE_H
+#define GL_STATE_H
+
+#include <glad/glad.h>
+
+#include <3DViewer/shader.h>
+
+#include <cstdint>
+#include <unordered_map>
+using namespace std;
+
+#define GL_STATE_TEXTURE_UNITS 16
+
+struct GLStateStats {
+	unsigned int programBinds = 0;
+	unsigned int vertexArrayBinds = 0;
+	unsigned int textureBinds = 0;
+	unsigned int samplerSets = 0;
+	unsigned int skipped = 0;
+};
+
+// Shadow of the bindings the renderer touches, so a bind matching the current one
+// is dropped instead of reaching the driver. reset() forgets everything and must be
+// called whenever code outside the cache may have changed the bindings.
+class GLStateCache
+{
+public:
+	GLStateStats stats;
+
+	GLStateCache()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		program = UNKNOWN;
+		vertexArray = UNKNOWN;
+		activeUnit = UNKNOWN;
+		for (int i = 0; i < GL_STATE_TEXTURE_UNITS; i++)
+			textures[i] = UNKNOWN;
+		samplers.clear();
+		stats = GLStateStats();
+	}
+
+	void useProgram(unsigned int id)
+	{
+		if (program == id)
+		{
+			stats.skipped++;
+			return;
+		}
+		glUseProgram(id);
+		program = id;
+		stats.programBinds++;
+	}
+
+	void bindVertexArray(unsigned int id)
+	{
+		if (vertexArray == id)
+		{
+			stats.skipped++;
+			return;
+		}
+		glBindVertexArray(id);
+		vertexArray = id;
+		stats.vertexArrayBinds++;
+	}
+
+	void bindTexture(unsigned int unit, unsigned int id)
+	{
+		if (unit < GL_STATE_TEXTURE_UNITS && textures[unit] == id)
+		{
+			stats.skipped++;
+			return;
+		}
+		if (activeUnit != unit)
+		{
+			glActiveTexture(GL_TEXTURE0 + unit);
+			activeUnit = unit;
+		}
+		glBindTexture(GL_TEXTURE_2D, id);
+		if (unit < GL_STATE_TEXTURE_UNITS)
+			textures[unit] = id;
+		stats.textureBinds++;
+	}
+
+	// sampler uniforms are program state, so they are remembered per program; the
+	// program must be current
+	void setSampler(const Uniform& sampler, int unit)
+	{
+		if (!sampler.valid())
+			return;
+		uint64_t key = (uint64_t(program) << 32) | uint32_t(sampler.location);
+		auto value = samplers.find(key);
+		if (value != samplers.end() && value->second == unit)
+		{
+			stats.skipped++;
+			return;
+		}
+		sampler.set(unit);
+		samplers[key] = unit;
+		stats.samplerSets++;
+	}
+
+private:
+	static constexpr unsigned int UNKNOWN = ~0u;
+
+	unsigned int program = UNKNOWN;
+	unsigned int vertexArray = UNKNOWN;
+	unsigned int activeUnit = UNKNOWN;
+	unsigned int textures[GL_STATE_TEXTURE_UNITS];
+	unordered_map<uint64_t, int> samplers;
+};
+
+#endif
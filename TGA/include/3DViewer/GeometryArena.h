@@ -0,0 +1,497 @@
+#ifndef GEOMETRY_ARENA_H
+#define GEOMETRY_ARENA_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <3DViewer/glresources.h>
+#include <3DViewer/vertexlayout.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <vector>
+using namespace std;
+
+// size of the vertex and of the index buffer of a block; larger meshes get a block
+// of their own
+#define GEOMETRY_BLOCK_BYTES (16u << 20)
+// bytes compaction may copy per frame, over all blocks
+#define GEOMETRY_COMPACT_BYTES_PER_FRAME (1u << 20)
+
+// first fit over [0, capacity) units; freed ranges merge with their neighbours
+class RangeAllocator
+{
+public:
+	static constexpr unsigned int RETIRED = ~0u;
+
+	size_t capacity = 0;
+	size_t used = 0;
+
+	RangeAllocator(size_t capacity = 0) : capacity(capacity)
+	{
+		if (capacity > 0)
+			holes[0] = capacity;
+	}
+
+	bool allocate(size_t count, unsigned int owner, size_t& offset)
+	{
+		for (auto hole = holes.begin(); hole != holes.end(); ++hole)
+		{
+			if (hole->second < count)
+				continue;
+			offset = hole->first;
+			take(hole, offset, count, owner);
+			return true;
+		}
+		return false;
+	}
+
+	// the range stays allocated, but is no longer a candidate for compaction
+	void retire(size_t offset)
+	{
+		auto range = ranges.find(offset);
+		if (range != ranges.end())
+			range->second.owner = RETIRED;
+	}
+
+	void free(size_t offset)
+	{
+		auto range = ranges.find(offset);
+		if (range == ranges.end())
+			return;
+		size_t count = range->second.count;
+		ranges.erase(range);
+		used -= count;
+
+		auto next = holes.lower_bound(offset);
+		if (next != holes.end() && offset + count == next->first)
+		{
+			count += next->second;
+			next = holes.erase(next);
+		}
+		if (next != holes.begin())
+		{
+			auto previous = prev(next);
+			if (previous->first + previous->second == offset)
+			{
+				previous->second += count;
+				return;
+			}
+		}
+		holes[offset] = count;
+	}
+
+	// the highest live range and the lowest hole below it that can take it
+	bool compaction(size_t& from, size_t& to, size_t& count, unsigned int& owner) const
+	{
+		auto range = ranges.rbegin();
+		while (range != ranges.rend() && range->second.owner == RETIRED)
+			++range;
+		if (range == ranges.rend())
+			return false;
+		for (const auto& hole : holes)
+		{
+			if (hole.first >= range->first)
+				break;
+			if (hole.second < range->second.count)
+				continue;
+			from = range->first;
+			to = hole.first;
+			count = range->second.count;
+			owner = range->second.owner;
+			return true;
+		}
+		return false;
+	}
+
+	// allocates exactly [offset, offset + count), which must lie in a hole
+	void allocateAt(size_t offset, size_t count, unsigned int owner)
+	{
+		auto hole = prev(holes.upper_bound(offset));
+		take(hole, offset, count, owner);
+	}
+
+private:
+	struct Range {
+		size_t count;
+		unsigned int owner;
+	};
+
+	map<size_t, size_t> holes;
+	map<size_t, Range> ranges;
+
+	void take(map<size_t, size_t>::iterator hole, size_t offset, size_t count, unsigned int owner)
+	{
+		size_t start = hole->first;
+		size_t end = hole->first + hole->second;
+		holes.erase(hole);
+		if (offset > start)
+			holes[start] = offset - start;
+		if (offset + count < end)
+			holes[offset + count] = end - offset - count;
+		ranges[offset] = Range{ count, owner };
+		used += count;
+	}
+};
+
+// where a mesh lives in the arena; baseVertex is added to every index it draws
+struct GeometryRange {
+	unsigned int block = 0;
+	unsigned int baseVertex = 0;
+	unsigned int vertexCount = 0;
+	unsigned int firstIndex = 0;
+	unsigned int indexCount = 0;
+};
+
+struct GeometryArenaStats {
+	unsigned int blocks = 0;
+	unsigned int allocations = 0;
+	size_t bytesUsed = 0;
+	size_t bytesCapacity = 0;
+	unsigned int moves = 0;
+	size_t bytesMoved = 0;
+};
+
+class GeometryArena;
+
+// Owning reference to a GeometryRange. Move-only; destroying it frees the range,
+// unless the arena has been cleared since it was allocated.
+class GeometryAllocation
+{
+public:
+	GeometryAllocation() {}
+	GeometryAllocation(unsigned int slot, unsigned int generation) : slot(slot), generation(generation) {}
+	~GeometryAllocation() { reset(); }
+
+	GeometryAllocation(const GeometryAllocation&) = delete;
+	GeometryAllocation& operator=(const GeometryAllocation&) = delete;
+
+	GeometryAllocation(GeometryAllocation&& other) noexcept : slot(other.slot), generation(other.generation)
+	{
+		other.slot = ~0u;
+	}
+
+	GeometryAllocation& operator=(GeometryAllocation&& other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+			slot = other.slot;
+			generation = other.generation;
+			other.slot = ~0u;
+		}
+		return *this;
+	}
+
+	bool valid() const { return slot != ~0u; }
+	unsigned int id() const { return slot; }
+	// the clear() of the arena it was allocated in
+	unsigned int arenaGeneration() const { return generation; }
+
+	void reset();
+
+private:
+	unsigned int slot = ~0u;
+	unsigned int generation = 0;
+};
+
+// Vertex and index buffers shared by every mesh of one vertex format, in blocks of
+// one VAO each, so meshes draw with a base vertex and a first index out of a VAO
+// that stays bound between them. Frees wait GL_DEFERRED_FRAMES calls of endFrame()
+// before the range is reused, and endFrame() also moves the highest allocations of
+// a block into holes below them, a bounded number of bytes per frame, so space
+// freed by unloaded meshes ends up at the tail of the block. GL thread only.
+class GeometryArena
+{
+public:
+	GeometryArenaStats stats;
+
+	// never destroyed, like GLResources
+	static GeometryArena& instance()
+	{
+		static GeometryArena* arena = new GeometryArena();
+		return *arena;
+	}
+
+	// copies the packed vertices and the indices into a block of the layout
+	GeometryAllocation allocate(const VertexLayout& layout, const vector<unsigned char>& packed, const unsigned int* indices, size_t indexCount)
+	{
+		size_t stride = layout.stride();
+		size_t vertexCount = stride > 0 ? packed.size() / stride : 0;
+
+		unsigned int slot;
+		if (!freeSlots.empty())
+		{
+			slot = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		else
+		{
+			slot = static_cast<unsigned int>(slots.size());
+			slots.push_back(GeometryRange());
+		}
+
+		// empty meshes still take a unit, so every allocation has its own offsets
+		size_t vertexUnits = std::max<size_t>(vertexCount, 1);
+		size_t indexUnits = std::max<size_t>(indexCount, 1);
+		size_t vertexOffset = 0;
+		size_t indexOffset = 0;
+		unsigned int b = 0;
+		for (; b < blocks.size(); b++)
+		{
+			GeometryBlock* block = blocks[b].get();
+			if (!block || !(block->layout == layout))
+				continue;
+			if (block->vertices.allocate(vertexUnits, slot, vertexOffset))
+			{
+				if (block->indices.allocate(indexUnits, slot, indexOffset))
+					break;
+				block->vertices.free(vertexOffset);
+			}
+		}
+		if (b == blocks.size())
+		{
+			b = createBlock(layout, std::max<size_t>(GEOMETRY_BLOCK_BYTES / std::max<size_t>(stride, 1), vertexUnits), std::max<size_t>(GEOMETRY_BLOCK_BYTES / sizeof(unsigned int), indexUnits));
+			blocks[b]->vertices.allocate(vertexUnits, slot, vertexOffset);
+			blocks[b]->indices.allocate(indexUnits, slot, indexOffset);
+		}
+
+		GeometryBlock& block = *blocks[b];
+		glBindBuffer(GL_COPY_WRITE_BUFFER, block.VBO.id());
+		glBufferSubData(GL_COPY_WRITE_BUFFER, vertexOffset * stride, packed.size(), packed.data());
+		glBindBuffer(GL_COPY_WRITE_BUFFER, block.EBO.id());
+		glBufferSubData(GL_COPY_WRITE_BUFFER, indexOffset * sizeof(unsigned int), indexCount * sizeof(unsigned int), indices);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+		GeometryRange& range = slots[slot];
+		range.block = b;
+		range.baseVertex = static_cast<unsigned int>(vertexOffset);
+		range.vertexCount = static_cast<unsigned int>(vertexCount);
+		range.firstIndex = static_cast<unsigned int>(indexOffset);
+		range.indexCount = static_cast<unsigned int>(indexCount);
+		stats.allocations++;
+		return GeometryAllocation(slot, generation);
+	}
+
+	const GeometryRange& range(const GeometryAllocation& allocation) const
+	{
+		return slots[allocation.id()];
+	}
+
+	unsigned int vertexArray(const GeometryAllocation& allocation) const
+	{
+		return blocks[slots[allocation.id()].block]->VAO.id();
+	}
+
+	// GL 3.3 has no base instance, so the matrix attributes of the block are moved
+	// instead, only when the instance buffer or the first instance changes; the VAO
+	// of the allocation must be bound
+	void pointInstances(const GeometryAllocation& allocation, unsigned int instanceBuffer, unsigned int firstInstance)
+	{
+		GeometryBlock& block = *blocks[slots[allocation.id()].block];
+		if (block.instanceBuffer == instanceBuffer && block.firstInstance == firstInstance)
+			return;
+		glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+		for (unsigned int i = 0; i < 4; i++)
+			glVertexAttribPointer(INSTANCE_MATRIX_ATTRIBUTE + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(firstInstance * sizeof(glm::mat4) + i * sizeof(glm::vec4)));
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		block.instanceBuffer = instanceBuffer;
+		block.firstInstance = firstInstance;
+	}
+
+	// instance attributes may point at a buffer that has since been deleted and its
+	// name handed out again, so the first draw of a frame always points them anew
+	void forgetInstances()
+	{
+		for (unique_ptr<GeometryBlock>& block : blocks)
+		{
+			if (block)
+				block->instanceBuffer = ~0u;
+		}
+	}
+
+	// indexOffset is relative to the allocation's first index; the VAO must be bound
+	void draw(const GeometryAllocation& allocation, unsigned int indexOffset, unsigned int indexCount, unsigned int instanceCount) const
+	{
+		const GeometryRange& range = slots[allocation.id()];
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, (void*)((range.firstIndex + indexOffset) * sizeof(unsigned int)), instanceCount, range.baseVertex);
+	}
+
+	void free(const GeometryAllocation& allocation)
+	{
+		// its block and slot went with clear()
+		if (allocation.arenaGeneration() != generation)
+			return;
+		const GeometryRange& range = slots[allocation.id()];
+		GeometryBlock& block = *blocks[range.block];
+		block.vertices.retire(range.baseVertex);
+		block.indices.retire(range.firstIndex);
+		retired.push_back(RetiredRange{ range.block, range.baseVertex, range.firstIndex, frame, true, true });
+		freeSlots.push_back(allocation.id());
+		stats.allocations--;
+	}
+
+	// once per frame, after the swap: releases ranges freed GL_DEFERRED_FRAMES frames
+	// ago, drops empty blocks and compacts
+	void endFrame()
+	{
+		frame++;
+		while (!retired.empty() && frame - retired.front().frame >= GL_DEFERRED_FRAMES)
+		{
+			const RetiredRange& range = retired.front();
+			GeometryBlock& block = *blocks[range.block];
+			if (range.vertices)
+				block.vertices.free(range.vertexOffset);
+			if (range.indices)
+				block.indices.free(range.indexOffset);
+			retired.pop_front();
+		}
+
+		size_t budget = GEOMETRY_COMPACT_BYTES_PER_FRAME;
+		stats.blocks = 0;
+		stats.bytesUsed = 0;
+		stats.bytesCapacity = 0;
+		for (unsigned int b = 0; b < blocks.size(); b++)
+		{
+			GeometryBlock* block = blocks[b].get();
+			if (!block)
+				continue;
+			if (block->vertices.used == 0 && block->indices.used == 0)
+			{
+				blocks[b].reset();
+				continue;
+			}
+			compact(b, budget);
+			stats.blocks++;
+			stats.bytesUsed += block->vertices.used * block->stride + block->indices.used * sizeof(unsigned int);
+			stats.bytesCapacity += block->vertices.capacity * block->stride + block->indices.capacity * sizeof(unsigned int);
+		}
+	}
+
+	// drops every block, while the context is still current; allocations still alive
+	// are left dangling, and only their frees are safe
+	void clear()
+	{
+		if (stats.allocations > 0)
+			cout << "ERROR::GEOMETRY_ARENA:: " << stats.allocations << " allocations outlive clear()" << endl;
+		generation++;
+		retired.clear();
+		blocks.clear();
+		slots.clear();
+		freeSlots.clear();
+		stats = GeometryArenaStats();
+	}
+
+private:
+	struct GeometryBlock {
+		VertexLayout layout;
+		size_t stride = 0;
+		GLVertexArray VAO;
+		GLBuffer VBO;
+		GLBuffer EBO;
+		RangeAllocator vertices;
+		RangeAllocator indices;
+		unsigned int instanceBuffer = ~0u;
+		unsigned int firstInstance = 0;
+	};
+
+	struct RetiredRange {
+		unsigned int block;
+		size_t vertexOffset;
+		size_t indexOffset;
+		uint64_t frame;
+		bool vertices;
+		bool indices;
+	};
+
+	vector<unique_ptr<GeometryBlock>> blocks;
+	vector<GeometryRange> slots;
+	vector<unsigned int> freeSlots;
+	deque<RetiredRange> retired;
+	uint64_t frame = 0;
+	unsigned int generation = 0;
+
+	GeometryArena() {}
+
+	unsigned int createBlock(const VertexLayout& layout, size_t vertexCapacity, size_t indexCapacity)
+	{
+		unique_ptr<GeometryBlock> block = make_unique<GeometryBlock>();
+		block->layout = layout;
+		block->stride = layout.stride();
+		block->vertices = RangeAllocator(vertexCapacity);
+		block->indices = RangeAllocator(indexCapacity);
+
+		block->VAO = GLResources::instance().vertexArray();
+		glBindVertexArray(block->VAO.id());
+		block->VBO = GLResources::instance().buffer(GL_ARRAY_BUFFER, vertexCapacity * block->stride, NULL);
+		block->EBO = GLResources::instance().buffer(GL_ELEMENT_ARRAY_BUFFER, indexCapacity * sizeof(unsigned int), NULL);
+		layout.setupAttributes();
+		for (unsigned int i = 0; i < 4; i++)
+		{
+			glEnableVertexAttribArray(INSTANCE_MATRIX_ATTRIBUTE + i);
+			glVertexAttribDivisor(INSTANCE_MATRIX_ATTRIBUTE + i, 1);
+		}
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		for (unsigned int b = 0; b < blocks.size(); b++)
+		{
+			if (!blocks[b])
+			{
+				blocks[b] = std::move(block);
+				return b;
+			}
+		}
+		blocks.push_back(std::move(block));
+		return static_cast<unsigned int>(blocks.size()) - 1;
+	}
+
+	// copies within one buffer between ranges that never overlap, the destination
+	// being a hole below the source
+	void compact(unsigned int b, size_t& budget)
+	{
+		GeometryBlock& block = *blocks[b];
+		size_t from, to, count;
+		unsigned int owner;
+		while (budget > 0 && block.vertices.compaction(from, to, count, owner) && count * block.stride <= budget)
+		{
+			move(block.VBO, block.vertices, from, to, count, block.stride, owner);
+			slots[owner].baseVertex = static_cast<unsigned int>(to);
+			retired.push_back(RetiredRange{ b, from, 0, frame, true, false });
+			budget -= count * block.stride;
+		}
+		while (budget > 0 && block.indices.compaction(from, to, count, owner) && count * sizeof(unsigned int) <= budget)
+		{
+			move(block.EBO, block.indices, from, to, count, sizeof(unsigned int), owner);
+			slots[owner].firstIndex = static_cast<unsigned int>(to);
+			retired.push_back(RetiredRange{ b, 0, from, frame, false, true });
+			budget -= count * sizeof(unsigned int);
+		}
+	}
+
+	void move(const GLBuffer& buffer, RangeAllocator& allocator, size_t from, size_t to, size_t count, size_t unit, unsigned int owner)
+	{
+		allocator.allocateAt(to, count, owner);
+		allocator.retire(from);
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer.id());
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer.id());
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, from * unit, to * unit, count * unit);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		stats.moves++;
+		stats.bytesMoved += count * unit;
+	}
+};
+
+inline void GeometryAllocation::reset()
+{
+	if (slot != ~0u)
+		GeometryArena::instance().free(*this);
+	slot = ~0u;
+}
+
+#endif
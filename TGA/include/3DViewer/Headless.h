@@ -0,0 +1,432 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <glad/glad.h>
+
+#ifdef _WIN32
+#include <GLFW/glfw3.h>
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include <3DViewer/glresources.h>
+#include <3DViewer/threadpool.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// frames in flight between glReadPixels and the file write
+#define READBACK_BUFFERS 3
+
+// GL 3.3 core context without a window. Elsewhere than Windows this is EGL on the
+// surfaceless platform, which Mesa's llvmpipe provides on hosts without a GPU
+// (link with -lEGL, as in the Linux build line of the README); on Windows a hidden
+// GLFW window.
+class OffscreenContext
+{
+public:
+	~OffscreenContext()
+	{
+		destroy();
+	}
+
+	// makes the context current and loads GL through glad
+	bool create()
+	{
+#ifdef _WIN32
+		if (!glfwInit())
+			return false;
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		window = glfwCreateWindow(1, 1, "3DViewer", NULL, NULL);
+		if (window == NULL)
+		{
+			cout << "ERROR::HEADLESS:: could not create a hidden window" << endl;
+			return false;
+		}
+		glfwMakeContextCurrent(window);
+		if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+#else
+		auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay)
+			display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+		if (display == EGL_NO_DISPLAY)
+			display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API))
+		{
+			cout << "ERROR::HEADLESS:: no EGL display" << endl;
+			return false;
+		}
+
+		const EGLint configAttributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+		EGLConfig config;
+		EGLint configs = 0;
+		if (!eglChooseConfig(display, configAttributes, &config, 1, &configs) || configs == 0)
+		{
+			cout << "ERROR::HEADLESS:: no EGL config for desktop GL" << endl;
+			return false;
+		}
+		const EGLint contextAttributes[] = {
+			EGL_CONTEXT_MAJOR_VERSION, 3,
+			EGL_CONTEXT_MINOR_VERSION, 3,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE
+		};
+		context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+		if (context == EGL_NO_CONTEXT)
+		{
+			cout << "ERROR::HEADLESS:: could not create a GL 3.3 core context" << endl;
+			return false;
+		}
+		// everything draws into framebuffer objects, the surface only matters to
+		// drivers without surfaceless contexts
+		if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+		{
+			const EGLint surfaceAttributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+			surface = eglCreatePbufferSurface(display, config, surfaceAttributes);
+			if (surface == EGL_NO_SURFACE || !eglMakeCurrent(display, surface, surface, context))
+			{
+				cout << "ERROR::HEADLESS:: could not make the context current" << endl;
+				return false;
+			}
+		}
+		if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress))
+#endif
+		{
+			cout << "Failed to initialize GLAD" << endl;
+			return false;
+		}
+		return true;
+	}
+
+	void destroy()
+	{
+#ifdef _WIN32
+		if (window != NULL)
+		{
+			glfwDestroyWindow(window);
+			glfwTerminate();
+		}
+		window = NULL;
+#else
+		if (display == EGL_NO_DISPLAY)
+			return;
+		eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (surface != EGL_NO_SURFACE)
+			eglDestroySurface(display, surface);
+		if (context != EGL_NO_CONTEXT)
+			eglDestroyContext(display, context);
+		eglTerminate(display);
+		display = EGL_NO_DISPLAY;
+		context = EGL_NO_CONTEXT;
+		surface = EGL_NO_SURFACE;
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	GLFWwindow* window = NULL;
+#else
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+	EGLSurface surface = EGL_NO_SURFACE;
+#endif
+};
+
+// framebuffer with an RGBA8 color and a 24 bit depth renderbuffer
+class OffscreenTarget
+{
+public:
+	int width = 0;
+	int height = 0;
+
+	bool create(int width, int height)
+	{
+		this->width = width;
+		this->height = height;
+		glGenFramebuffers(1, &framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glGenRenderbuffers(2, renderbuffers);
+		glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+		glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		if (!complete)
+			cout << "ERROR::HEADLESS:: framebuffer of " << width << "x" << height << " is not complete" << endl;
+		return complete;
+	}
+
+	// for drawing and for the readback
+	void bind() const
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glViewport(0, 0, width, height);
+	}
+
+	// while the context is still current
+	void destroy()
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		if (framebuffer)
+		{
+			glDeleteRenderbuffers(2, renderbuffers);
+			glDeleteFramebuffers(1, &framebuffer);
+		}
+		framebuffer = 0;
+	}
+
+private:
+	unsigned int framebuffer = 0;
+	unsigned int renderbuffers[2] = { 0, 0 };
+};
+
+// rows bottom up as read back from GL; .ppm is written as binary RGB, anything else
+// as PNG with uncompressed deflate blocks, which needs no zlib and writes at disk speed
+inline bool WriteImage(const string& path, int width, int height, const vector<unsigned char>& rgba)
+{
+	ofstream file(path, ios::binary);
+	if (!file)
+	{
+		cout << "ERROR::HEADLESS:: could not write " << path << endl;
+		return false;
+	}
+
+	size_t row = size_t(width) * 4;
+	if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".ppm") == 0)
+	{
+		file << "P6\n" << width << " " << height << "\n255\n";
+		vector<unsigned char> rgb(size_t(width) * 3);
+		for (int y = height - 1; y >= 0; y--)
+		{
+			const unsigned char* source = rgba.data() + y * row;
+			for (int x = 0; x < width; x++)
+				memcpy(&rgb[x * 3], source + x * 4, 3);
+			file.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+		}
+		return bool(file);
+	}
+
+	// built once even with several writers running
+	static const vector<uint32_t> crcTable = [] {
+		vector<uint32_t> table(256);
+		for (uint32_t n = 0; n < 256; n++)
+		{
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		return table;
+	}();
+	auto big = [](vector<unsigned char>& out, uint32_t value) {
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back(static_cast<unsigned char>(value >> shift));
+	};
+	auto chunk = [&](const char* type, const vector<unsigned char>& data) {
+		vector<unsigned char> out;
+		big(out, static_cast<uint32_t>(data.size()));
+		out.insert(out.end(), type, type + 4);
+		out.insert(out.end(), data.begin(), data.end());
+		uint32_t crc = 0xffffffffu;
+		for (size_t i = 4; i < out.size(); i++)
+			crc = crcTable[(crc ^ out[i]) & 0xff] ^ (crc >> 8);
+		big(out, crc ^ 0xffffffffu);
+		file.write(reinterpret_cast<const char*>(out.data()), out.size());
+	};
+
+	// every scanline starts with filter type 0, top row first
+	vector<unsigned char> raw;
+	raw.reserve((row + 1) * height);
+	for (int y = height - 1; y >= 0; y--)
+	{
+		raw.push_back(0);
+		raw.insert(raw.end(), rgba.begin() + y * row, rgba.begin() + (y + 1) * row);
+	}
+
+	vector<unsigned char> zlib = { 0x78, 0x01 };
+	uint32_t a = 1, b = 0;
+	for (size_t offset = 0; offset < raw.size(); offset += 65535)
+	{
+		size_t length = std::min<size_t>(65535, raw.size() - offset);
+		zlib.push_back(offset + length >= raw.size() ? 1 : 0);
+		zlib.push_back(static_cast<unsigned char>(length));
+		zlib.push_back(static_cast<unsigned char>(length >> 8));
+		zlib.push_back(static_cast<unsigned char>(~length));
+		zlib.push_back(static_cast<unsigned char>(~length >> 8));
+		zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+		for (size_t i = offset; i < offset + length; i++)
+		{
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+	}
+	big(zlib, (b << 16) | a);
+
+	vector<unsigned char> header;
+	big(header, width);
+	big(header, height);
+	header.insert(header.end(), { 8, 6, 0, 0, 0 });
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	file.write(reinterpret_cast<const char*>(signature), 8);
+	chunk("IHDR", header);
+	chunk("IDAT", zlib);
+	chunk("IEND", vector<unsigned char>());
+	return bool(file);
+}
+
+struct ReadbackStats {
+	unsigned int frames = 0;
+	// requests that had to wait for the oldest copy to land
+	unsigned int stalls = 0;
+	atomic<unsigned int> written{ 0 };
+	atomic<unsigned int> failed{ 0 };
+};
+
+// Asynchronous readback of the bound framebuffer through a ring of pixel pack
+// buffers: glReadPixels into a buffer only queues the copy, and the pixels are
+// mapped a few frames later once its fence has signaled, so rendering never waits
+// for the GPU. The files are encoded and written on the shared thread pool.
+class FrameReadback
+{
+public:
+	ReadbackStats stats;
+
+	FrameReadback(int width, int height) : width(width), height(height)
+	{
+	}
+
+	// the writers hold on to the stats
+	~FrameReadback()
+	{
+		for (future<void>& write : writes)
+			write.wait();
+	}
+
+	// queues a copy of the read framebuffer, written to path once it lands
+	void request(const string& path)
+	{
+		collect();
+		Slot& slot = slots[next];
+		if (slot.fence)
+		{
+			stats.stalls++;
+			land(slot);
+		}
+		if (!slot.buffer)
+		{
+			slot.buffer = GLResources::instance().buffer(GL_PIXEL_PACK_BUFFER, size_t(width) * height * 4, NULL, GL_STREAM_READ);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer.id());
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		slot.path = path;
+		stats.frames++;
+		next = (next + 1) % READBACK_BUFFERS;
+	}
+
+	// waits for every copy and every file
+	void finish()
+	{
+		for (size_t i = 0; i < READBACK_BUFFERS; i++)
+		{
+			Slot& slot = slots[(next + i) % READBACK_BUFFERS];
+			if (slot.fence)
+				land(slot);
+		}
+		for (future<void>& write : writes)
+			write.wait();
+		writes.clear();
+	}
+
+	void report() const
+	{
+		cout << "HEADLESS:: frames: " << stats.frames << " written: " << stats.written << " failed: " << stats.failed
+			<< " readback stalls: " << stats.stalls << endl;
+	}
+
+private:
+	struct Slot {
+		GLBuffer buffer;
+		GLsync fence = 0;
+		string path;
+	};
+
+	int width;
+	int height;
+	Slot slots[READBACK_BUFFERS];
+	size_t next = 0;
+	vector<future<void>> writes;
+
+	// lands the copies that are already done, oldest first, without waiting
+	void collect()
+	{
+		for (size_t i = 0; i < READBACK_BUFFERS; i++)
+		{
+			Slot& slot = slots[(next + i) % READBACK_BUFFERS];
+			if (!slot.fence)
+				continue;
+			if (glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+				break;
+			land(slot);
+		}
+	}
+
+	void land(Slot& slot)
+	{
+		while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+			;
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+
+		size_t bytes = size_t(width) * height * 4;
+		shared_ptr<vector<unsigned char>> pixels = make_shared<vector<unsigned char>>(bytes);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer.id());
+		void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+		if (mapped)
+		{
+			memcpy(pixels->data(), mapped, bytes);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		if (!mapped)
+		{
+			cout << "ERROR::HEADLESS:: could not map the readback of " << slot.path << endl;
+			stats.failed++;
+			return;
+		}
+
+		string path = slot.path;
+		int width = this->width;
+		int height = this->height;
+		ReadbackStats* stats = &this->stats;
+		writes.push_back(ThreadPool::shared().submit([path, width, height, pixels, stats] {
+			if (WriteImage(path, width, height, *pixels))
+				stats->written++;
+			else
+				stats->failed++;
+		}));
+	}
+};
+
+#endif
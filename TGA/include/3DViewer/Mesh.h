@@ -6,47 +6,253 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <3DViewer/frustum.h>
+#include <3DViewer/geometryarena.h>
+#include <3DViewer/glstate.h>
 #include <3DViewer/shader.h>
+#include <3DViewer/vertexlayout.h>
 
 #include <string>
 #include <vector>
 using namespace std;
 
-#define MAX_BONE_INFLUENCE 4
-
-struct Vertex {
-	glm::vec3 Position;
-	glm::vec3 Normal;
-	glm::vec2 TexCoords;
-	glm::vec3 Tangent;
-	glm::vec3 Bitangent;
-	int m_BoneIDs[MAX_BONE_INFLUENCE];
-	float m_Weights[MAX_BONE_INFLUENCE];
-};
-
 struct Texture {
 	unsigned int id;
 	string type;
 	string path;
 };
 
+// axis aligned box of the positions and a sphere around its center
+inline Bounds BoundsFromVertices(const Vertex* vertices, size_t count)
+{
+	Bounds bounds;
+	if (count == 0)
+		return bounds;
+
+	bounds.min = bounds.max = vertices[0].Position;
+	for (size_t i = 1; i < count; i++)
+	{
+		bounds.min = glm::min(bounds.min, vertices[i].Position);
+		bounds.max = glm::max(bounds.max, vertices[i].Position);
+	}
+	bounds.center = (bounds.min + bounds.max) * 0.5f;
+
+	float radius2 = 0.0f;
+	for (size_t i = 0; i < count; i++)
+	{
+		glm::vec3 offset = vertices[i].Position - bounds.center;
+		radius2 = std::max(radius2, glm::dot(offset, offset));
+	}
+	bounds.radius = sqrtf(radius2);
+	return bounds;
+}
+
+// one level of detail: a range of the index buffer over the shared vertices, and
+// the object space deviation it introduces
+struct MeshLod {
+	unsigned int indexOffset = 0;
+	unsigned int indexCount = 0;
+	float error = 0.0f;
+};
+
+// processed geometry of one mesh before upload; owns its arrays when imported or
+// points into a mapped MeshCache entry when loaded from the cache
+struct MeshData {
+	vector<Vertex>       vertices;
+	vector<unsigned int> indices;
+	vector<Texture>      textures;
+	Bounds               bounds;
+	vector<MeshLod>      lods;
+	const Vertex*       vertexData = nullptr;
+	const unsigned int* indexData = nullptr;
+	size_t vertexDataCount = 0;
+	size_t indexDataCount = 0;
+
+	const Vertex* vertexPointer() const { return vertexData ? vertexData : vertices.data(); }
+	const unsigned int* indexPointer() const { return indexData ? indexData : indices.data(); }
+	size_t vertexCount() const { return vertexData ? vertexDataCount : vertices.size(); }
+	size_t indexCount() const { return indexData ? indexDataCount : indices.size(); }
+};
+
+// Geometry on the GPU. The vertices and indices vectors are only kept once uploaded
+// when the mesh was created with cpuAccess (picking, physics, export); otherwise
+// they are empty and the GeometryArena holds the only copy. Move-only, the arena
+// range is freed with the mesh.
 class Mesh {
 public:
 	vector<Vertex>       vertices;
 	vector<unsigned int> indices;
 	vector<Texture>      textures;
-	unsigned int VAO;
+	Bounds       bounds;
+	vector<MeshLod> lods;
+	VertexLayout layout;
 
-	Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
+	Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures, bool cpuAccess = false, const VertexLayout& layout = VertexLayout::active())
 	{
-		this->vertices = vertices;
-		this->indices = indices;
-		this->textures = textures;
+		this->layout = layout;
+		this->vertices = std::move(vertices);
+		this->indices = std::move(indices);
+		this->textures = std::move(textures);
+		this->bounds = BoundsFromVertices(this->vertices.data(), this->vertices.size());
+		this->lods = { MeshLod{ 0, static_cast<unsigned int>(this->indices.size()), 0.0f } };
 
-		setupMesh();
+		setupMesh(this->vertices.data(), this->vertices.size(), this->indices.data(), this->indices.size());
+		nameSamplers();
+		if (!cpuAccess)
+			releaseCpuGeometry();
 	}
 
-	void Draw(Shader& shader)
+	Mesh(const MeshData& data, vector<Texture> textures, bool cpuAccess = false, const VertexLayout& layout = VertexLayout::active())
+	{
+		this->layout = layout;
+		this->textures = std::move(textures);
+		this->bounds = data.bounds;
+		this->lods = data.lods;
+		if (this->lods.empty())
+			this->lods = { MeshLod{ 0, static_cast<unsigned int>(data.indexCount()), 0.0f } };
+
+		setupMesh(data.vertexPointer(), data.vertexCount(), data.indexPointer(), data.indexCount());
+		nameSamplers();
+		if (cpuAccess)
+			setCpuGeometry(data);
+	}
+
+	bool hasCpuGeometry() const
+	{
+		return !vertices.empty() || !indices.empty();
+	}
+
+	// copies the geometry back to the CPU, for meshes uploaded without cpuAccess
+	void setCpuGeometry(const MeshData& data)
+	{
+		vertices.assign(data.vertexPointer(), data.vertexPointer() + data.vertexCount());
+		indices.assign(data.indexPointer(), data.indexPointer() + data.indexCount());
+	}
+
+	void releaseCpuGeometry()
+	{
+		vector<Vertex>().swap(vertices);
+		vector<unsigned int>().swap(indices);
+	}
+
+	size_t cpuBytes() const
+	{
+		return vertices.capacity() * sizeof(Vertex) + indices.capacity() * sizeof(unsigned int);
+	}
+
+	// share of the arena's vertex and index buffers
+	size_t gpuBytes() const
+	{
+		return bufferBytes;
+	}
+
+	// draws instanceCount matrices starting at firstInstance in the instance buffer
+	void Draw(Shader& shader, unsigned int instanceCount = 1, unsigned int firstInstance = 0, unsigned int lod = 0)
+	{
+		GLStateCache state;
+		bind(shader, state);
+		drawInstances(instanceCount, firstInstance, lod);
+		glBindVertexArray(0);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	// binds textures, samplers and the VAO through the cache; shader must be current
+	void bind(Shader& shader, GLStateCache& state)
+	{
+		// uniform locations are resolved once per program, not per draw
+		if (uniformProgram != shader.ID)
+		{
+			samplerUniforms.clear();
+			for (unsigned int i = 0; i < samplerNames.size(); i++)
+				samplerUniforms.push_back(shader.uniform(samplerNames[i]));
+			positionOffsetUniform = shader.uniform("positionOffset");
+			positionScaleUniform = shader.uniform("positionScale");
+			skinnedUniform = shader.uniform("skinned");
+			occludedUniform = shader.uniform("occluded");
+			occlusionBaseUniform = shader.uniform("occlusionBase");
+			uniformProgram = shader.ID;
+		}
+		positionOffsetUniform.set(positionOffset);
+		positionScaleUniform.set(positionScale);
+		skinnedUniform.set(skinned);
+		occludedUniform.set(occlusionOffset >= 0);
+		// gl_VertexID counts from the arena block, and compaction moves the range
+		if (occlusionOffset >= 0)
+			occlusionBaseUniform.set(occlusionOffset - static_cast<int>(GeometryArena::instance().range(geometry).baseVertex));
+
+		for (unsigned int i = 0; i < textures.size(); i++)
+		{
+			state.bindTexture(i, textures[i].id);
+			state.setSampler(samplerUniforms[i], (int)i);
+		}
+		state.bindVertexArray(vertexArray());
+	}
+
+	// the VAO must be bound; lod is clamped to the coarsest level the mesh has
+	void drawInstances(unsigned int instanceCount, unsigned int firstInstance, unsigned int lod = 0)
+	{
+		GeometryArena::instance().pointInstances(geometry, instanceBuffer, firstInstance);
+		const MeshLod& level = lods[std::min<size_t>(lod, lods.size() - 1)];
+		GeometryArena::instance().draw(geometry, level.indexOffset, level.indexCount, instanceCount);
+	}
+
+	// shared by every mesh in the same arena block
+	unsigned int vertexArray() const
+	{
+		return GeometryArena::instance().vertexArray(geometry);
+	}
+
+	unsigned int triangleCount(unsigned int lod = 0) const
+	{
+		return lods[std::min<size_t>(lod, lods.size() - 1)].indexCount / 3;
+	}
+
+	// texture ids in unit order, identifying the texture state of the mesh
+	const vector<unsigned int>& textureSet() const
+	{
+		return textureIds;
+	}
+
+	// weighted to bones, drawn with the palette of each instance
+	bool isSkinned() const
+	{
+		return skinned;
+	}
+
+	// sources the per-instance model matrices from the given buffer
+	void setupInstancing(unsigned int instanceBuffer)
+	{
+		this->instanceBuffer = instanceBuffer;
+	}
+
+	// the first texel of the mesh's vertices in the ambient occlusion buffer texture,
+	// -1 when it has none
+	void setOcclusion(int offset)
+	{
+		occlusionOffset = offset;
+	}
+
+private:
+	GeometryAllocation geometry;
+	size_t bufferBytes = 0;
+	unsigned int instanceBuffer = 0;
+	vector<string> samplerNames;
+	vector<unsigned int> textureIds;
+	vector<Uniform> samplerUniforms;
+	Uniform positionOffsetUniform;
+	Uniform positionScaleUniform;
+	Uniform skinnedUniform;
+	Uniform occludedUniform;
+	Uniform occlusionBaseUniform;
+	unsigned int uniformProgram = 0;
+	bool skinned = false;
+	int occlusionOffset = -1;
+	// dequantization of the packed positions, identity unless the layout quantizes
+	glm::vec3 positionOffset = glm::vec3(0.0f);
+	glm::vec3 positionScale = glm::vec3(1.0f);
+
+	// "material.texture_diffuse1", "material.texture_specular1", ... in texture order
+	void nameSamplers()
 	{
 		unsigned int diffuseNr = 1;
 		unsigned int specularNr = 1;
@@ -54,7 +260,6 @@ public:
 		unsigned int heightNr = 1;
 		for (unsigned int i = 0; i < textures.size(); i++)
 		{
-			glActiveTexture(GL_TEXTURE0 + i);
 			string number;
 			string name = textures[i].type;
 			if (name == "texture_diffuse")
@@ -66,56 +271,24 @@ public:
 			else if (name == "texture_height")
 				number = std::to_string(heightNr++);
 
-			glUniform1i(glGetUniformLocation(shader.ID, ("material." + name + number).c_str()), i);
-			glBindTexture(GL_TEXTURE_2D, textures[i].id);
+			samplerNames.push_back("material." + name + number);
+			textureIds.push_back(textures[i].id);
 		}
-
-		glBindVertexArray(VAO);
-		glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
-		glBindVertexArray(0);
-
-		glActiveTexture(GL_TEXTURE0);
 	}
 
-private:
-	unsigned int VBO, EBO;
-
-	void setupMesh()
+	void setupMesh(const Vertex* vertexData, size_t vertexCount, const unsigned int* indexData, size_t indexCount)
 	{
-		glGenVertexArrays(1, &VAO);
-		glGenBuffers(1, &VBO);
-		glGenBuffers(1, &EBO);
-
-		glBindVertexArray(VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, VBO);
-		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
-
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
-
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
+		// meshes without bone weights leave the bone attributes out
+		for (size_t v = 0; v < vertexCount && !skinned; v++)
+			skinned = vertexData[v].m_Weights[0] > 0.0f;
+		if (!skinned)
+			layout.attributes &= ~((1u << VERTEX_BONE_IDS) | (1u << VERTEX_WEIGHTS));
 
-		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
+		// only what the program reads, in the compact encodings of the layout
+		vector<unsigned char> packed = layout.pack(vertexData, vertexCount, bounds, positionOffset, positionScale);
 
-		glEnableVertexAttribArray(3);
-		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Tangent));
-
-		glEnableVertexAttribArray(4);
-		glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Bitangent));
-
-		glEnableVertexAttribArray(5);
-		glVertexAttribIPointer(5, 4, GL_INT, sizeof(Vertex), (void*)offsetof(Vertex, m_BoneIDs));
-
-		glEnableVertexAttribArray(6);
-		glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, m_Weights));
-
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindVertexArray(0);
+		geometry = GeometryArena::instance().allocate(layout, packed, indexData, indexCount);
+		bufferBytes = packed.size() + indexCount * sizeof(unsigned int);
 	}
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,392 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <3DViewer/mesh.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// bump whenever the layout below, the contents of Vertex or the processing of
+// imported meshes change
+#define MESH_CACHE_VERSION 5
+
+const string MESH_CACHE_DIRECTORY = "resources/cache";
+
+// read-only view of a whole file, mapped into the address space
+class MappedFile
+{
+public:
+	MappedFile(string const& path)
+	{
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+			return;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL)
+			return;
+		bytes = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		if (bytes)
+			length = static_cast<size_t>(fileSize.QuadPart);
+#else
+		file = open(path.c_str(), O_RDONLY);
+		if (file < 0)
+			return;
+		struct stat info;
+		if (fstat(file, &info) != 0 || info.st_size == 0)
+			return;
+		void* view = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (view == MAP_FAILED)
+			return;
+		bytes = static_cast<const unsigned char*>(view);
+		length = static_cast<size_t>(info.st_size);
+#endif
+	}
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (bytes) UnmapViewOfFile(bytes);
+		if (mapping != NULL) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+		if (bytes) munmap(const_cast<unsigned char*>(bytes), length);
+		if (file >= 0) close(file);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool valid() const { return bytes != nullptr; }
+	const unsigned char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	const unsigned char* bytes = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int file = -1;
+#endif
+};
+
+// updated from the loader threads, hence atomic
+struct MeshCacheStats {
+	atomic<unsigned int> hits{ 0 };
+	atomic<unsigned int> misses{ 0 };
+	atomic<unsigned int> stale{ 0 };
+	atomic<unsigned int> writes{ 0 };
+	atomic<size_t> bytesMapped{ 0 };
+	atomic<uint64_t> hitMicroseconds{ 0 };
+	atomic<uint64_t> missMicroseconds{ 0 };
+
+	double hitMilliseconds() const { return hitMicroseconds / 1000.0; }
+	double missMilliseconds() const { return missMicroseconds / 1000.0; }
+};
+
+// Binary cache of the processed Vertex/index arrays of a model, stored next to the
+// resources as resources/cache/<hash>.mesh. An entry is only used when the source
+// path, its modification time and size, the import flags and the cache version all
+// match; anything else counts as a miss and the entry is rebuilt after import.
+//
+// layout (native endianness, every block 8 byte aligned):
+//   MeshCacheHeader, source path
+//   per mesh: MeshCacheEntry (counts, bounds), textures (MeshCacheString type, path), vertices,
+//             indices of every level, MeshLod per level
+class MeshCache
+{
+public:
+	static MeshCacheStats stats;
+
+	static shared_ptr<MappedFile> load(string const& path, unsigned int importFlags, vector<MeshData>& meshes)
+	{
+		auto start = chrono::steady_clock::now();
+
+		SourceStamp stamp;
+		if (!sourceStamp(path, stamp))
+			return nullptr;
+
+		shared_ptr<MappedFile> file = make_shared<MappedFile>(entryPath(path, importFlags));
+		if (!file->valid())
+		{
+			stats.misses++;
+			return nullptr;
+		}
+
+		vector<MeshData> parsed;
+		if (!parse(*file, path, importFlags, stamp, parsed))
+		{
+			stats.misses++;
+			stats.stale++;
+			return nullptr;
+		}
+
+		meshes = std::move(parsed);
+		stats.hits++;
+		stats.bytesMapped += file->size();
+		stats.hitMicroseconds += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+		return file;
+	}
+
+	static void store(string const& path, unsigned int importFlags, const vector<MeshData>& meshes)
+	{
+		SourceStamp stamp;
+		if (!sourceStamp(path, stamp))
+			return;
+
+		std::error_code error;
+		filesystem::create_directories(MESH_CACHE_DIRECTORY, error);
+
+		string target = entryPath(path, importFlags);
+		// per thread so two loaders importing the same model never share a file
+		string temporary = target + "." + to_string(hash<thread::id>()(this_thread::get_id())) + ".tmp";
+		{
+			ofstream out(temporary, ios::binary | ios::trunc);
+			if (!out)
+			{
+				cout << "ERROR::MESH_CACHE::WRITE_FAILED: " << temporary << endl;
+				return;
+			}
+
+			MeshCacheHeader header;
+			memcpy(header.magic, "MSHC", 4);
+			header.version = MESH_CACHE_VERSION;
+			header.importFlags = importFlags;
+			header.meshCount = static_cast<uint32_t>(meshes.size());
+			header.vertexSize = sizeof(Vertex);
+			header.pathLength = static_cast<uint32_t>(path.size());
+			header.sourceTime = stamp.time;
+			header.sourceSize = stamp.size;
+			write(out, &header, sizeof(header));
+			write(out, path.data(), path.size());
+
+			for (const MeshData& mesh : meshes)
+			{
+				MeshCacheEntry entry;
+				entry.vertexCount = static_cast<uint32_t>(mesh.vertexCount());
+				entry.indexCount = static_cast<uint32_t>(mesh.indexCount());
+				entry.textureCount = static_cast<uint32_t>(mesh.textures.size());
+				entry.lodCount = static_cast<uint32_t>(mesh.lods.size());
+				entry.bounds = mesh.bounds;
+				write(out, &entry, sizeof(entry));
+
+				for (const Texture& texture : mesh.textures)
+				{
+					MeshCacheString type = { static_cast<uint32_t>(texture.type.size()), static_cast<uint32_t>(texture.path.size()) };
+					write(out, &type, sizeof(type));
+					write(out, texture.type.data(), texture.type.size());
+					write(out, texture.path.data(), texture.path.size());
+				}
+
+				write(out, mesh.vertexPointer(), mesh.vertexCount() * sizeof(Vertex));
+				write(out, mesh.indexPointer(), mesh.indexCount() * sizeof(unsigned int));
+				write(out, mesh.lods.data(), mesh.lods.size() * sizeof(MeshLod));
+			}
+
+			if (!out)
+			{
+				cout << "ERROR::MESH_CACHE::WRITE_FAILED: " << temporary << endl;
+				return;
+			}
+		}
+
+		filesystem::rename(temporary, target, error);
+		if (error)
+		{
+			filesystem::remove(temporary, error);
+			return;
+		}
+		stats.writes++;
+	}
+
+	static void report()
+	{
+		cout << "MESH_CACHE:: hits: " << stats.hits << " misses: " << stats.misses << " (stale: " << stats.stale << ")"
+			<< " written: " << stats.writes << " mapped: " << stats.bytesMapped / 1024 << " KB"
+			<< " hit time: " << stats.hitMilliseconds() << " ms miss time: " << stats.missMilliseconds() << " ms" << endl;
+	}
+
+private:
+	struct MeshCacheHeader {
+		char magic[4];
+		uint32_t version;
+		uint32_t importFlags;
+		uint32_t meshCount;
+		uint32_t vertexSize;
+		uint32_t pathLength;
+		int64_t sourceTime;
+		uint64_t sourceSize;
+	};
+
+	struct MeshCacheEntry {
+		uint32_t vertexCount;
+		uint32_t indexCount;
+		uint32_t textureCount;
+		uint32_t lodCount;
+		Bounds bounds;
+	};
+
+	struct MeshCacheString {
+		uint32_t typeLength;
+		uint32_t pathLength;
+	};
+
+	struct SourceStamp {
+		int64_t time;
+		uint64_t size;
+	};
+
+	static bool sourceStamp(string const& path, SourceStamp& stamp)
+	{
+		std::error_code error;
+		auto time = filesystem::last_write_time(path, error);
+		if (error)
+			return false;
+		auto size = filesystem::file_size(path, error);
+		if (error)
+			return false;
+		stamp.time = static_cast<int64_t>(time.time_since_epoch().count());
+		stamp.size = static_cast<uint64_t>(size);
+		return true;
+	}
+
+	static string entryPath(string const& path, unsigned int importFlags)
+	{
+		// FNV-1a over the source path and the import flags
+		uint64_t hash = 14695981039346656037ull;
+		auto mix = [&hash](const void* data, size_t size) {
+			const unsigned char* bytes = static_cast<const unsigned char*>(data);
+			for (size_t i = 0; i < size; i++)
+			{
+				hash ^= bytes[i];
+				hash *= 1099511628211ull;
+			}
+		};
+		mix(path.data(), path.size());
+		mix(&importFlags, sizeof(importFlags));
+
+		stringstream name;
+		name << MESH_CACHE_DIRECTORY << '/' << hex << hash << ".mesh";
+		return name.str();
+	}
+
+	static size_t align(size_t offset)
+	{
+		return (offset + 7) & ~size_t(7);
+	}
+
+	static void write(ofstream& out, const void* data, size_t size)
+	{
+		static const char zeros[8] = {};
+		out.write(static_cast<const char*>(data), size);
+		out.write(zeros, align(size) - size);
+	}
+
+	static bool parse(const MappedFile& file, string const& path, unsigned int importFlags, const SourceStamp& stamp, vector<MeshData>& meshes)
+	{
+		const unsigned char* bytes = file.data();
+		size_t size = file.size();
+		size_t offset = 0;
+
+		auto take = [&](size_t length) -> const unsigned char* {
+			if (length > size - offset)
+				return nullptr;
+			const unsigned char* block = bytes + offset;
+			offset = align(offset + length);
+			if (offset > size)
+				offset = size;
+			return block;
+		};
+
+		const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(take(sizeof(MeshCacheHeader)));
+		if (!header || memcmp(header->magic, "MSHC", 4) != 0 || header->version != MESH_CACHE_VERSION)
+			return false;
+		if (header->importFlags != importFlags || header->vertexSize != sizeof(Vertex))
+			return false;
+		if (header->sourceTime != stamp.time || header->sourceSize != stamp.size)
+			return false;
+
+		const char* source = reinterpret_cast<const char*>(take(header->pathLength));
+		if (!source || path.compare(0, string::npos, source, header->pathLength) != 0)
+			return false;
+
+		for (uint32_t m = 0; m < header->meshCount; m++)
+		{
+			const MeshCacheEntry* entry = reinterpret_cast<const MeshCacheEntry*>(take(sizeof(MeshCacheEntry)));
+			if (!entry)
+				return false;
+
+			MeshData mesh;
+			mesh.bounds = entry->bounds;
+			for (uint32_t t = 0; t < entry->textureCount; t++)
+			{
+				const MeshCacheString* lengths = reinterpret_cast<const MeshCacheString*>(take(sizeof(MeshCacheString)));
+				if (!lengths)
+					return false;
+				const char* type = reinterpret_cast<const char*>(take(lengths->typeLength));
+				const char* texturePath = reinterpret_cast<const char*>(take(lengths->pathLength));
+				if (!type || !texturePath)
+					return false;
+
+				Texture texture;
+				texture.id = 0;
+				texture.type = string(type, lengths->typeLength);
+				texture.path = string(texturePath, lengths->pathLength);
+				mesh.textures.push_back(texture);
+			}
+
+			mesh.vertexData = reinterpret_cast<const Vertex*>(take(size_t(entry->vertexCount) * sizeof(Vertex)));
+			mesh.indexData = reinterpret_cast<const unsigned int*>(take(size_t(entry->indexCount) * sizeof(unsigned int)));
+			if (!mesh.vertexData || !mesh.indexData)
+				return false;
+			mesh.vertexDataCount = entry->vertexCount;
+			mesh.indexDataCount = entry->indexCount;
+
+			const MeshLod* lods = reinterpret_cast<const MeshLod*>(take(size_t(entry->lodCount) * sizeof(MeshLod)));
+			if (!lods && entry->lodCount > 0)
+				return false;
+			for (uint32_t l = 0; l < entry->lodCount; l++)
+			{
+				if (size_t(lods[l].indexOffset) + lods[l].indexCount > entry->indexCount)
+					return false;
+				mesh.lods.push_back(lods[l]);
+			}
+
+			meshes.push_back(std::move(mesh));
+		}
+		return true;
+	}
+};
+
+MeshCacheStats MeshCache::stats;
+
+#endif
@@ -0,0 +1,381 @@
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <glm/glm.hpp>
+
+#include <3DViewer/mesh.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// FIFO size assumed when scoring and measuring vertex cache use
+#define MESH_OPTIMIZER_CACHE_SIZE 32
+// the overdraw pass may give up this much ACMR over the cache order
+#define MESH_OPTIMIZER_OVERDRAW_THRESHOLD 1.05f
+
+static_assert(sizeof(Vertex) == 22 * sizeof(float), "Vertex must have no padding for hashing and welding");
+
+// updated from the loader threads, hence atomic
+struct MeshOptimizerStats {
+	atomic<unsigned int> meshes{ 0 };
+	atomic<size_t> triangles{ 0 };
+	atomic<size_t> verticesBefore{ 0 };
+	atomic<size_t> verticesAfter{ 0 };
+	atomic<size_t> missesBefore{ 0 };
+	atomic<size_t> missesAfter{ 0 };
+
+	double acmrBefore() const { return triangles ? double(missesBefore) / triangles : 0.0; }
+	double acmrAfter() const { return triangles ? double(missesAfter) / triangles : 0.0; }
+};
+
+// Post-import pass over each mesh, in order: weld bitwise identical vertices,
+// reorder triangles for the post-transform cache (Forsyth), regroup them into
+// clusters drawn outside-in to cut overdraw, then renumber vertices in first use
+// order so fetches walk the vertex buffer forwards.
+class MeshOptimizer
+{
+public:
+	static MeshOptimizerStats stats;
+
+	static void optimize(MeshData& mesh)
+	{
+		vector<Vertex>& vertices = mesh.vertices;
+		vector<unsigned int>& indices = mesh.indices;
+		if (indices.size() < 3 || indices.size() % 3 != 0)
+			return;
+
+		size_t verticesBefore = vertices.size();
+		size_t missesBefore = cacheMisses(indices, vertices.size(), MESH_OPTIMIZER_CACHE_SIZE);
+
+		weldVertices(vertices, indices);
+		optimizeVertexCache(indices, vertices.size());
+		optimizeOverdraw(vertices, indices);
+		optimizeVertexFetch(vertices, indices);
+
+		stats.meshes++;
+		stats.triangles += indices.size() / 3;
+		stats.verticesBefore += verticesBefore;
+		stats.verticesAfter += vertices.size();
+		stats.missesBefore += missesBefore;
+		stats.missesAfter += cacheMisses(indices, vertices.size(), MESH_OPTIMIZER_CACHE_SIZE);
+	}
+
+	// vertices transformed per triangle with a FIFO cache of the given size
+	static double acmr(const vector<unsigned int>& indices, size_t vertexCount, unsigned int cacheSize = MESH_OPTIMIZER_CACHE_SIZE)
+	{
+		return indices.empty() ? 0.0 : double(cacheMisses(indices, vertexCount, cacheSize)) / (indices.size() / 3);
+	}
+
+	static void report()
+	{
+		cout << "MESH_OPTIMIZER:: meshes: " << stats.meshes << " vertices: " << stats.verticesBefore << " -> " << stats.verticesAfter
+			<< " ACMR: " << stats.acmrBefore() << " -> " << stats.acmrAfter() << endl;
+	}
+
+	static void weldVertices(vector<Vertex>& vertices, vector<unsigned int>& indices)
+	{
+		unordered_map<uint64_t, vector<unsigned int>> buckets;
+		buckets.reserve(vertices.size());
+		vector<unsigned int> remap(vertices.size());
+		vector<Vertex> welded;
+		welded.reserve(vertices.size());
+
+		for (unsigned int i = 0; i < vertices.size(); i++)
+		{
+			vector<unsigned int>& bucket = buckets[hashVertex(vertices[i])];
+			unsigned int match = ~0u;
+			for (unsigned int candidate : bucket)
+			{
+				if (memcmp(&welded[candidate], &vertices[i], sizeof(Vertex)) == 0)
+				{
+					match = candidate;
+					break;
+				}
+			}
+			if (match == ~0u)
+			{
+				match = static_cast<unsigned int>(welded.size());
+				welded.push_back(vertices[i]);
+				bucket.push_back(match);
+			}
+			remap[i] = match;
+		}
+
+		for (unsigned int& index : indices)
+			index = remap[index];
+		vertices.swap(welded);
+	}
+
+	// Forsyth's greedy ordering: always emit the highest scoring triangle, scoring
+	// vertices by recency in a simulated LRU cache and by how few triangles they have left
+	static void optimizeVertexCache(vector<unsigned int>& indices, size_t vertexCount)
+	{
+		const int cacheSize = MESH_OPTIMIZER_CACHE_SIZE;
+		size_t triangleCount = indices.size() / 3;
+
+		vector<unsigned int> triangleStart(vertexCount + 1, 0);
+		for (unsigned int index : indices)
+			triangleStart[index + 1]++;
+		for (size_t v = 0; v < vertexCount; v++)
+			triangleStart[v + 1] += triangleStart[v];
+		vector<unsigned int> vertexTriangles(indices.size());
+		vector<unsigned int> fill(triangleStart.begin(), triangleStart.end() - 1);
+		for (size_t t = 0; t < triangleCount; t++)
+		{
+			for (int k = 0; k < 3; k++)
+				vertexTriangles[fill[indices[t * 3 + k]]++] = static_cast<unsigned int>(t);
+		}
+
+		vector<unsigned int> liveTriangles(vertexCount);
+		for (size_t v = 0; v < vertexCount; v++)
+			liveTriangles[v] = triangleStart[v + 1] - triangleStart[v];
+		vector<int> cachePosition(vertexCount, -1);
+		vector<float> vertexScore(vertexCount);
+		for (size_t v = 0; v < vertexCount; v++)
+			vertexScore[v] = forsythScore(-1, liveTriangles[v]);
+
+		vector<float> triangleScore(triangleCount);
+		vector<bool> emitted(triangleCount, false);
+		for (size_t t = 0; t < triangleCount; t++)
+			triangleScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+
+		vector<unsigned int> cache;
+		vector<unsigned int> next;
+		cache.reserve(cacheSize + 3);
+		next.reserve(cacheSize + 3);
+		vector<unsigned int> ordered;
+		ordered.reserve(indices.size());
+		size_t scan = 0;
+		long best = -1;
+
+		for (size_t emittedCount = 0; emittedCount < triangleCount; emittedCount++)
+		{
+			// nothing in the cache touches a live triangle: start over at the next unused one
+			if (best < 0)
+			{
+				while (emitted[scan])
+					scan++;
+				best = static_cast<long>(scan);
+			}
+
+			unsigned int triangle = static_cast<unsigned int>(best);
+			emitted[triangle] = true;
+			next.clear();
+			for (int k = 0; k < 3; k++)
+			{
+				unsigned int v = indices[triangle * 3 + k];
+				ordered.push_back(v);
+				if (find(next.begin(), next.end(), v) == next.end())
+					next.push_back(v);
+				liveTriangles[v]--;
+				// drop the triangle from the vertex's live list
+				unsigned int* first = &vertexTriangles[triangleStart[v]];
+				unsigned int* last = first + liveTriangles[v];
+				for (unsigned int* it = first; it <= last; it++)
+				{
+					if (*it == triangle)
+					{
+						swap(*it, *last);
+						break;
+					}
+				}
+			}
+			for (unsigned int v : cache)
+			{
+				if (find(next.begin(), next.end(), v) == next.end())
+					next.push_back(v);
+			}
+
+			for (size_t i = 0; i < next.size(); i++)
+			{
+				// vertices pushed out of the cache lose their position
+				unsigned int v = next[i];
+				cachePosition[v] = i < size_t(cacheSize) ? static_cast<int>(i) : -1;
+				float score = forsythScore(cachePosition[v], liveTriangles[v]);
+				float delta = score - vertexScore[v];
+				vertexScore[v] = score;
+				for (unsigned int j = 0; j < liveTriangles[v]; j++)
+					triangleScore[vertexTriangles[triangleStart[v] + j]] += delta;
+			}
+			if (next.size() > size_t(cacheSize))
+				next.resize(cacheSize);
+			cache.swap(next);
+
+			best = -1;
+			float bestScore = -1.0f;
+			for (unsigned int v : cache)
+			{
+				for (unsigned int j = 0; j < liveTriangles[v]; j++)
+				{
+					unsigned int t = vertexTriangles[triangleStart[v] + j];
+					if (triangleScore[t] > bestScore)
+					{
+						bestScore = triangleScore[t];
+						best = static_cast<long>(t);
+					}
+				}
+			}
+		}
+
+		indices.swap(ordered);
+	}
+
+	// Splits the cache ordered triangles into clusters where the cache runs cold and
+	// draws clusters facing away from the mesh center first, in the spirit of Sander,
+	// Nehab and Barczak's fast triangle reordering. Kept only if the ACMR stays within
+	// MESH_OPTIMIZER_OVERDRAW_THRESHOLD of the cache order.
+	static void optimizeOverdraw(const vector<Vertex>& vertices, vector<unsigned int>& indices)
+	{
+		size_t triangleCount = indices.size() / 3;
+		vector<size_t> clusterStart;
+		{
+			vector<unsigned int> fifo(vertices.size(), 0);
+			unsigned int time = MESH_OPTIMIZER_CACHE_SIZE + 1;
+			for (size_t t = 0; t < triangleCount; t++)
+			{
+				int misses = 0;
+				for (int k = 0; k < 3; k++)
+				{
+					unsigned int v = indices[t * 3 + k];
+					if (time - fifo[v] > MESH_OPTIMIZER_CACHE_SIZE)
+					{
+						fifo[v] = time++;
+						misses++;
+					}
+				}
+				if (misses == 3 || t == 0)
+					clusterStart.push_back(t);
+			}
+		}
+		if (clusterStart.size() < 2)
+			return;
+		clusterStart.push_back(triangleCount);
+
+		glm::vec3 meshCenter = glm::vec3(0.0f);
+		float meshArea = 0.0f;
+		vector<glm::vec3> centers(clusterStart.size() - 1);
+		vector<glm::vec3> normals(clusterStart.size() - 1);
+		for (size_t c = 0; c + 1 < clusterStart.size(); c++)
+		{
+			glm::vec3 center = glm::vec3(0.0f);
+			glm::vec3 normal = glm::vec3(0.0f);
+			float area = 0.0f;
+			for (size_t t = clusterStart[c]; t < clusterStart[c + 1]; t++)
+			{
+				const glm::vec3& a = vertices[indices[t * 3]].Position;
+				const glm::vec3& b = vertices[indices[t * 3 + 1]].Position;
+				const glm::vec3& d = vertices[indices[t * 3 + 2]].Position;
+				glm::vec3 cross = glm::cross(b - a, d - a);
+				float triangleArea = glm::length(cross);
+				center += (a + b + d) * (triangleArea / 3.0f);
+				normal += cross;
+				area += triangleArea;
+			}
+			meshCenter += center;
+			meshArea += area;
+			centers[c] = area > 0.0f ? center / area : vertices[indices[clusterStart[c] * 3]].Position;
+			float length = glm::length(normal);
+			normals[c] = length > 0.0f ? normal / length : glm::vec3(0.0f);
+		}
+		if (meshArea > 0.0f)
+			meshCenter /= meshArea;
+
+		vector<float> sortKey(centers.size());
+		vector<unsigned int> order(centers.size());
+		for (unsigned int c = 0; c < centers.size(); c++)
+		{
+			sortKey[c] = glm::dot(centers[c] - meshCenter, normals[c]);
+			order[c] = c;
+		}
+		stable_sort(order.begin(), order.end(), [&sortKey](unsigned int a, unsigned int b) { return sortKey[a] > sortKey[b]; });
+
+		vector<unsigned int> reordered;
+		reordered.reserve(indices.size());
+		for (unsigned int c : order)
+			reordered.insert(reordered.end(), indices.begin() + clusterStart[c] * 3, indices.begin() + clusterStart[c + 1] * 3);
+
+		if (acmr(reordered, vertices.size()) <= acmr(indices, vertices.size()) * MESH_OPTIMIZER_OVERDRAW_THRESHOLD)
+			indices.swap(reordered);
+	}
+
+	// renumbers vertices in the order the index buffer first uses them, dropping
+	// vertices no triangle references
+	static void optimizeVertexFetch(vector<Vertex>& vertices, vector<unsigned int>& indices)
+	{
+		vector<unsigned int> remap(vertices.size(), ~0u);
+		vector<Vertex> fetched;
+		fetched.reserve(vertices.size());
+		for (unsigned int& index : indices)
+		{
+			if (remap[index] == ~0u)
+			{
+				remap[index] = static_cast<unsigned int>(fetched.size());
+				fetched.push_back(vertices[index]);
+			}
+			index = remap[index];
+		}
+		vertices.swap(fetched);
+	}
+
+private:
+	static uint64_t hashVertex(const Vertex& vertex)
+	{
+		// FNV-1a over the raw bytes, Vertex has no padding
+		uint64_t hash = 14695981039346656037ull;
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&vertex);
+		for (size_t i = 0; i < sizeof(Vertex); i++)
+		{
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	static float forsythScore(int cachePosition, unsigned int liveTriangles)
+	{
+		if (liveTriangles == 0)
+			return -1.0f;
+
+		float score = 0.0f;
+		if (cachePosition >= 0)
+		{
+			// the last triangle's vertices get a fixed score so the next pick does not
+			// depend on their order within it
+			if (cachePosition < 3)
+				score = 0.75f;
+			else
+			{
+				float scale = 1.0f / (MESH_OPTIMIZER_CACHE_SIZE - 3);
+				score = powf(1.0f - (cachePosition - 3) * scale, 1.5f);
+			}
+		}
+		return score + 2.0f * powf(float(liveTriangles), -0.5f);
+	}
+
+	static size_t cacheMisses(const vector<unsigned int>& indices, size_t vertexCount, unsigned int cacheSize)
+	{
+		vector<unsigned int> stamp(vertexCount, 0);
+		unsigned int time = cacheSize + 1;
+		size_t misses = 0;
+		for (unsigned int index : indices)
+		{
+			if (time - stamp[index] > cacheSize)
+			{
+				stamp[index] = time++;
+				misses++;
+			}
+		}
+		return misses;
+	}
+};
+
+MeshOptimizerStats MeshOptimizer::stats;
+
+#endif
@@ -0,0 +1,315 @@
+#ifndef MESH_SIMPLIFIER_H
+#define MESH_SIMPLIFIER_H
+
+#include <glm/glm.hpp>
+
+#include <3DViewer/mesh.h>
+#include <3DViewer/meshoptimizer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// levels after the full resolution one
+#define MESH_LOD_LEVELS 4
+// each level aims for this fraction of the triangles of the previous one
+#define MESH_LOD_RATIO 0.4f
+#define MESH_LOD_MIN_TRIANGLES 16
+// collapses deviating more than this fraction of the mesh radius are never taken
+#define MESH_LOD_MAX_ERROR 0.1f
+
+// Quadric error edge collapse over the index buffer only: every collapse moves one
+// vertex onto a neighbour, so all levels share the vertex buffer of the mesh.
+// Vertices on open borders or UV/normal seams (several vertices at one position)
+// never move, which keeps texture seams and silhouettes of open meshes intact.
+class MeshSimplifier
+{
+public:
+	// appends the LOD chain to mesh.indices and describes it in mesh.lods; expects the
+	// mesh to own its arrays
+	static void buildLods(MeshData& mesh)
+	{
+		mesh.lods.clear();
+		MeshLod full;
+		full.indexOffset = 0;
+		full.indexCount = static_cast<unsigned int>(mesh.indices.size());
+		full.error = 0.0f;
+		mesh.lods.push_back(full);
+
+		vector<unsigned int> previous = mesh.indices;
+		float maxError = BoundsFromVertices(mesh.vertices.data(), mesh.vertices.size()).radius * MESH_LOD_MAX_ERROR;
+		float error = 0.0f;
+		for (int level = 0; level < MESH_LOD_LEVELS; level++)
+		{
+			size_t target = size_t(previous.size() / 3 * MESH_LOD_RATIO) * 3;
+			if (target < MESH_LOD_MIN_TRIANGLES * 3)
+				break;
+
+			vector<unsigned int> simplified = simplify(mesh.vertices, previous, target, maxError, error);
+			// stop once the locked vertices keep a level from getting meaningfully smaller
+			if (simplified.size() > previous.size() * 9 / 10)
+				break;
+			MeshOptimizer::optimizeVertexCache(simplified, mesh.vertices.size());
+
+			MeshLod lod;
+			lod.indexOffset = static_cast<unsigned int>(mesh.indices.size());
+			lod.indexCount = static_cast<unsigned int>(simplified.size());
+			lod.error = error;
+			mesh.lods.push_back(lod);
+			mesh.indices.insert(mesh.indices.end(), simplified.begin(), simplified.end());
+			previous.swap(simplified);
+		}
+	}
+
+	// collapses edges, cheapest first, until at most targetIndexCount indices remain or
+	// every collapse left would deviate more than maxError; error is raised to the
+	// largest object space deviation introduced
+	static vector<unsigned int> simplify(const vector<Vertex>& vertices, const vector<unsigned int>& source, size_t targetIndexCount, float maxError, float& error)
+	{
+		vector<unsigned int> indices = source;
+		size_t vertexCount = vertices.size();
+
+		vector<bool> locked = lockedVertices(vertices, indices);
+
+		vector<Quadric> quadrics(vertexCount);
+		for (size_t t = 0; t + 2 < indices.size(); t += 3)
+		{
+			Quadric plane = planeQuadric(vertices[indices[t]].Position, vertices[indices[t + 1]].Position, vertices[indices[t + 2]].Position);
+			for (int k = 0; k < 3; k++)
+				quadrics[indices[t + k]].add(plane);
+		}
+
+		vector<unsigned int> remap(vertexCount);
+		vector<bool> touched(vertexCount);
+		vector<Collapse> collapses;
+		vector<unsigned int> triangleStart(vertexCount + 1);
+		vector<unsigned int> vertexTriangles;
+
+		while (indices.size() > targetIndexCount)
+		{
+			buildAdjacency(indices, vertexCount, triangleStart, vertexTriangles);
+
+			collapses.clear();
+			for (size_t t = 0; t + 2 < indices.size(); t += 3)
+			{
+				for (int k = 0; k < 3; k++)
+				{
+					unsigned int a = indices[t + k];
+					unsigned int b = indices[t + (k + 1) % 3];
+					// each direction of an edge is its own candidate
+					for (int direction = 0; direction < 2; direction++)
+					{
+						unsigned int from = direction ? b : a;
+						unsigned int to = direction ? a : b;
+						if (locked[from])
+							continue;
+						Quadric merged = quadrics[from];
+						merged.add(quadrics[to]);
+						Collapse collapse;
+						collapse.from = from;
+						collapse.to = to;
+						collapse.cost = merged.error(vertices[to].Position);
+						if (collapse.cost <= maxError)
+							collapses.push_back(collapse);
+					}
+				}
+			}
+			if (collapses.empty())
+				break;
+			sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+			for (size_t v = 0; v < vertexCount; v++)
+			{
+				remap[v] = static_cast<unsigned int>(v);
+				touched[v] = false;
+			}
+
+			// every collapse removes about two triangles
+			size_t budget = (indices.size() - targetIndexCount) / 6 + 1;
+			size_t collapsed = 0;
+			for (const Collapse& collapse : collapses)
+			{
+				if (collapsed >= budget)
+					break;
+				if (touched[collapse.from] || touched[collapse.to])
+					continue;
+				if (flips(vertices, indices, triangleStart, vertexTriangles, collapse.from, collapse.to))
+					continue;
+
+				remap[collapse.from] = collapse.to;
+				quadrics[collapse.to].add(quadrics[collapse.from]);
+				error = std::max(error, collapse.cost);
+				collapsed++;
+
+				// the one ring of the moved vertex changed, leave it alone for this pass
+				for (unsigned int j = triangleStart[collapse.from]; j < triangleStart[collapse.from + 1]; j++)
+				{
+					unsigned int t = vertexTriangles[j];
+					for (int k = 0; k < 3; k++)
+						touched[indices[t * 3 + k]] = true;
+				}
+			}
+			if (collapsed == 0)
+				break;
+
+			size_t write = 0;
+			for (size_t t = 0; t + 2 < indices.size(); t += 3)
+			{
+				unsigned int a = remap[indices[t]];
+				unsigned int b = remap[indices[t + 1]];
+				unsigned int c = remap[indices[t + 2]];
+				if (a == b || b == c || a == c)
+					continue;
+				indices[write++] = a;
+				indices[write++] = b;
+				indices[write++] = c;
+			}
+			indices.resize(write);
+		}
+		return indices;
+	}
+
+private:
+	// symmetric 4x4 plane quadric, area weighted; error() is the weighted mean
+	// squared distance, returned as a distance
+	struct Quadric {
+		double a2 = 0, ab = 0, ac = 0, ad = 0;
+		double b2 = 0, bc = 0, bd = 0;
+		double c2 = 0, cd = 0;
+		double d2 = 0;
+		double weight = 0;
+
+		void add(const Quadric& q)
+		{
+			a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+			b2 += q.b2; bc += q.bc; bd += q.bd;
+			c2 += q.c2; cd += q.cd;
+			d2 += q.d2;
+			weight += q.weight;
+		}
+
+		float error(const glm::vec3& p) const
+		{
+			double x = p.x, y = p.y, z = p.z;
+			double e = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+				+ b2 * y * y + 2 * bc * y * z + 2 * bd * y
+				+ c2 * z * z + 2 * cd * z
+				+ d2;
+			return weight > 0.0 ? float(sqrt(std::max(e, 0.0) / weight)) : 0.0f;
+		}
+	};
+
+	struct Collapse {
+		unsigned int from;
+		unsigned int to;
+		float cost;
+	};
+
+	static Quadric planeQuadric(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2)
+	{
+		Quadric q;
+		glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+		float area = glm::length(normal);
+		if (area <= 0.0f)
+			return q;
+		normal /= area;
+		double a = normal.x, b = normal.y, c = normal.z, d = -glm::dot(normal, p0);
+		q.a2 = a * a * area; q.ab = a * b * area; q.ac = a * c * area; q.ad = a * d * area;
+		q.b2 = b * b * area; q.bc = b * c * area; q.bd = b * d * area;
+		q.c2 = c * c * area; q.cd = c * d * area;
+		q.d2 = d * d * area;
+		q.weight = area;
+		return q;
+	}
+
+	// vertices sharing their position with another vertex (attribute seams) and
+	// vertices on edges used by a single triangle (open borders)
+	static vector<bool> lockedVertices(const vector<Vertex>& vertices, const vector<unsigned int>& indices)
+	{
+		vector<bool> locked(vertices.size(), false);
+
+		// equal positions end up next to each other
+		vector<unsigned int> byPosition(vertices.size());
+		for (unsigned int v = 0; v < vertices.size(); v++)
+			byPosition[v] = v;
+		auto less = [&vertices](unsigned int a, unsigned int b) {
+			const glm::vec3& p = vertices[a].Position;
+			const glm::vec3& q = vertices[b].Position;
+			return p.x < q.x || (p.x == q.x && (p.y < q.y || (p.y == q.y && p.z < q.z)));
+		};
+		sort(byPosition.begin(), byPosition.end(), less);
+		for (size_t i = 1; i < byPosition.size(); i++)
+		{
+			if (vertices[byPosition[i]].Position == vertices[byPosition[i - 1]].Position)
+			{
+				locked[byPosition[i]] = true;
+				locked[byPosition[i - 1]] = true;
+			}
+		}
+
+		unordered_map<uint64_t, int> edges;
+		edges.reserve(indices.size());
+		for (size_t t = 0; t + 2 < indices.size(); t += 3)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				unsigned int a = indices[t + k];
+				unsigned int b = indices[t + (k + 1) % 3];
+				edges[(uint64_t(std::min(a, b)) << 32) | std::max(a, b)]++;
+			}
+		}
+		for (const auto& edge : edges)
+		{
+			if (edge.second == 1)
+			{
+				locked[edge.first >> 32] = true;
+				locked[edge.first & 0xffffffffu] = true;
+			}
+		}
+		return locked;
+	}
+
+	static void buildAdjacency(const vector<unsigned int>& indices, size_t vertexCount, vector<unsigned int>& triangleStart, vector<unsigned int>& vertexTriangles)
+	{
+		fill(triangleStart.begin(), triangleStart.end(), 0);
+		for (unsigned int index : indices)
+			triangleStart[index + 1]++;
+		for (size_t v = 0; v < vertexCount; v++)
+			triangleStart[v + 1] += triangleStart[v];
+		vertexTriangles.resize(indices.size());
+		vector<unsigned int> next(triangleStart.begin(), triangleStart.end() - 1);
+		for (size_t i = 0; i < indices.size(); i++)
+			vertexTriangles[next[indices[i]]++] = static_cast<unsigned int>(i / 3);
+	}
+
+	// whether moving from onto to turns any surviving triangle around from over
+	static bool flips(const vector<Vertex>& vertices, const vector<unsigned int>& indices, const vector<unsigned int>& triangleStart, const vector<unsigned int>& vertexTriangles, unsigned int from, unsigned int to)
+	{
+		for (unsigned int j = triangleStart[from]; j < triangleStart[from + 1]; j++)
+		{
+			unsigned int t = vertexTriangles[j];
+			unsigned int corner[3] = { indices[t * 3], indices[t * 3 + 1], indices[t * 3 + 2] };
+			if (corner[0] == to || corner[1] == to || corner[2] == to)
+				continue;
+
+			glm::vec3 p[3];
+			glm::vec3 q[3];
+			for (int k = 0; k < 3; k++)
+			{
+				p[k] = vertices[corner[k]].Position;
+				q[k] = corner[k] == from ? vertices[to].Position : p[k];
+			}
+			glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+			glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+			// turning by more than about 75 degrees counts too, small turns add up
+			if (glm::dot(before, after) <= 0.25f * glm::length(before) * glm::length(after))
+				return true;
+		}
+		return false;
+	}
+};
+
+#endif
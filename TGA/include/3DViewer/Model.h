@@ -1,92 +1,434 @@
 #ifndef MODEL_H
 #define MODEL_H
 
-#define STB_IMAGE_IMPLEMENTATION
-
 #include <glad/glad.h> 
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
-#include <stb_image/stb_image.h>
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
+#include <3DViewer/frustum.h>
 #include <3DViewer/mesh.h>
+#include <3DViewer/meshcache.h>
+#include <3DViewer/meshoptimizer.h>
+#include <3DViewer/meshsimplifier.h>
+#include <3DViewer/renderqueue.h>
 #include <3DViewer/shader.h>
+#include <3DViewer/skeleton.h>
+#include <3DViewer/texturecache.h>
 
+#include <chrono>
+#include <cstring>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 
-unsigned int TextureFromFile(const char* path, const string& directory, bool gamma = false);
+// everything Model::import produces off the GL thread
+struct ModelData {
+	string path;
+	string directory;
+	vector<MeshData> meshes;
+	shared_ptr<MappedFile> cached;
+	Skeleton skeleton;
+	// keep vertices and indices in the meshes after upload
+	bool cpuAccess = false;
+	bool loaded = false;
+	double importMilliseconds = 0.0;
+	double decodeMilliseconds = 0.0;
+};
+
+// owned like any GLTexture, for textures kept outside the TextureCache
+GLTexture TextureFromFile(const char* path, const string& directory, bool gamma = false);
+
+// largest projected deviation, in pixels, a level of detail may introduce
+#define LOD_PIXEL_ERROR 1.0f
+// a coarser level is only taken once its error is this far under the limit, so
+// objects near a switching distance do not flicker between two levels
+#define LOD_HYSTERESIS 0.75f
+
+// turns object space errors into pixels on screen
+struct LodView {
+	glm::vec3 eye = glm::vec3(0.0f);
+	// screen height over the height of the view frustum at distance one
+	float pixelsPerUnit = 1.0f;
+
+	LodView() {}
+	LodView(const glm::vec3& eye, float fovy, float screenHeight) : eye(eye)
+	{
+		pixelsPerUnit = screenHeight / (2.0f * tanf(fovy * 0.5f));
+	}
+};
+
+struct ModelMemory {
+	size_t cpuBytes = 0;
+	size_t gpuBytes = 0;
+};
+
+const unsigned int MODEL_IMPORT_FLAGS = aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace;
 
 class Model
 {
 public:
 	vector<Texture> textures_loaded;
 	vector<Mesh>    meshes;
+	Bounds bounds;
 	string directory;
+	string path;
 	bool gammaCorrection;
+	// bones and clips, empty unless the meshes are skinned
+	Skeleton skeleton;
 
 	Model() {}
 
-	Model(string const& path, bool gamma = false) : gammaCorrection(gamma)
+	Model(string const& path, bool gamma = false, bool cpuAccess = false) : gammaCorrection(gamma)
+	{
+		ModelData data = import(path, gamma, cpuAccess);
+		upload(data);
+	}
+
+	Model(const ModelData& data, bool gamma = false) : gammaCorrection(gamma)
+	{
+		upload(data);
+	}
+
+	// models are shared through ModelManager, never duplicated
+	Model(const Model&) = delete;
+	Model& operator=(const Model&) = delete;
+	Model(Model&&) = default;
+	Model& operator=(Model&&) = default;
+
+	// CPU half of loading: mesh cache or Assimp, then image decoding. Makes no GL
+	// calls, so the scene loader runs it on worker threads.
+	static ModelData import(string const& path, bool gamma = false, bool cpuAccess = false)
 	{
-		loadModel(path);
+		ModelData data;
+		data.path = path;
+		data.directory = path.substr(0, path.find_last_of('/'));
+		data.cpuAccess = cpuAccess;
+
+		auto start = chrono::steady_clock::now();
+		if (!loadGeometry(path, data.meshes, data.cached, &data.skeleton))
+			return data;
+		auto imported = chrono::steady_clock::now();
+		data.importMilliseconds = chrono::duration<double, milli>(imported - start).count();
+
+		for (const MeshData& mesh : data.meshes)
+		{
+			for (const Texture& texture : mesh.textures)
+				TextureCache::instance().request(texture.path, data.directory, gamma);
+		}
+		data.decodeMilliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - imported).count();
+
+		data.loaded = true;
+		return data;
 	}
 
-	void Draw(Shader& shader)
+	// mesh cache, or Assimp followed by the optimizer and LOD passes on a miss; the
+	// meshes come out in the order the model uploads them. The cache holds no
+	// skeletons, so skinned models are never stored and always imported.
+	static bool loadGeometry(string const& path, vector<MeshData>& meshes, shared_ptr<MappedFile>& cached, Skeleton* skeleton = nullptr)
 	{
+		auto start = chrono::steady_clock::now();
+		cached = MeshCache::load(path, MODEL_IMPORT_FLAGS, meshes);
+		if (cached)
+			return true;
+
+		Skeleton imported;
+		if (!importModel(path, meshes, imported))
+			return false;
+		for (MeshData& mesh : meshes)
+		{
+			MeshOptimizer::optimize(mesh);
+			MeshSimplifier::buildLods(mesh);
+		}
+		if (imported.boneCount() == 0)
+			MeshCache::store(path, MODEL_IMPORT_FLAGS, meshes);
+		if (skeleton)
+			*skeleton = std::move(imported);
+		MeshCache::stats.missMicroseconds += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+		return true;
+	}
+
+	// brings back the vertices and indices dropped after upload, from the mesh cache
+	// or the source file; the meshes come out in the same order as when uploaded
+	bool requireCpuAccess()
+	{
+		bool resident = true;
+		for (const Mesh& mesh : meshes)
+			resident = resident && mesh.hasCpuGeometry();
+		if (resident)
+			return true;
+
+		vector<MeshData> data;
+		shared_ptr<MappedFile> cached;
+		if (!loadGeometry(path, data, cached) || data.size() != meshes.size())
+		{
+			cout << "ERROR::MODEL:: could not reload geometry of " << path << endl;
+			return false;
+		}
 		for (unsigned int i = 0; i < meshes.size(); i++)
-			meshes[i].Draw(shader);
+			meshes[i].setCpuGeometry(data[i]);
+		return true;
+	}
+
+	ModelMemory memory() const
+	{
+		ModelMemory memory;
+		for (const Mesh& mesh : meshes)
+		{
+			memory.cpuBytes += mesh.cpuBytes();
+			memory.gpuBytes += mesh.gpuBytes();
+		}
+		memory.gpuBytes += instanceCapacity;
+		return memory;
+	}
+
+	bool skinned() const
+	{
+		return skeleton.boneCount() > 0;
+	}
+
+	unsigned int lodCount() const
+	{
+		return static_cast<unsigned int>(lodErrors.size());
+	}
+
+	// level of detail for an instance placed by model, given the level it had last frame
+	unsigned int selectLod(const glm::mat4& model, const LodView& view, unsigned int current) const
+	{
+		if (lodErrors.size() < 2)
+			return 0;
+
+		glm::vec4 sphere = TransformSphere(bounds, model);
+		float scale = bounds.radius > 0.0f ? sphere.w / bounds.radius : 1.0f;
+		float distance = std::max(glm::length(glm::vec3(sphere) - view.eye) - sphere.w, 1e-3f);
+		auto pixels = [&](unsigned int level) { return lodErrors[level] * scale / distance * view.pixelsPerUnit; };
+
+		current = std::min(current, lodCount() - 1);
+		for (unsigned int level = lodCount() - 1; level > current; level--)
+		{
+			if (pixels(level) <= LOD_PIXEL_ERROR * LOD_HYSTERESIS)
+				return level;
+		}
+		if (pixels(current) <= LOD_PIXEL_ERROR)
+			return current;
+		while (current > 0 && pixels(current) > LOD_PIXEL_ERROR)
+			current--;
+		return current;
+	}
+
+	// queues every mesh once per matrix that leaves it inside the frustum, as one
+	// instanced draw per mesh and level of detail in use; skinned models take a pose
+	// per instance, the bind pose for instances without one
+	void Submit(RenderQueue& queue, Shader& shader, const vector<glm::mat4>& instances, const vector<unsigned int>& lods, const Frustum& frustum, CullingStats& stats, const vector<SkinPose>& poses = vector<SkinPose>())
+	{
+		if (instances.empty())
+			return;
+		palettes.assign(skinned() ? instances.size() : 0, -1);
+		sharedPalettes.clear();
+
+		// the whole model first, then each of its meshes for instances that straddle a plane
+		spheres.resize(instances.size());
+		for (size_t i = 0; i < instances.size(); i++)
+			spheres[i] = TransformSphere(bounds, instances[i]);
+		modelResults.resize(instances.size());
+		frustum.testSpheres(spheres.data(), spheres.size(), modelResults.data());
+
+		visible.clear();
+		batches.clear();
+		meshVisible.resize(instances.size());
+		for (unsigned int m = 0; m < meshes.size(); m++)
+		{
+			unsigned int drawn = 0;
+			for (size_t i = 0; i < instances.size(); i++)
+			{
+				meshVisible[i] = modelResults[i] == FRUSTUM_INSIDE
+					|| (modelResults[i] == FRUSTUM_INTERSECTS && frustum.intersects(meshes[m].bounds, instances[i]));
+				drawn += meshVisible[i];
+			}
+			stats.meshesDrawn += drawn;
+			stats.meshesCulled += static_cast<unsigned int>(instances.size()) - drawn;
+
+			// instances at the same level of this mesh are drawn together
+			unsigned int coarsest = static_cast<unsigned int>(meshes[m].lods.size()) - 1;
+			for (unsigned int level = 0; level <= coarsest && drawn > 0; level++)
+			{
+				InstanceBatch batch;
+				batch.mesh = m;
+				batch.lod = level;
+				batch.first = static_cast<unsigned int>(visible.size());
+				batch.nearest = FLT_MAX;
+				for (size_t i = 0; i < instances.size(); i++)
+				{
+					if (!meshVisible[i] || std::min(lods[i], coarsest) != level)
+						continue;
+					visible.push_back(instances[i]);
+					if (skinned())
+						visible.back()[0][3] = float(palette(i, poses));
+					batch.nearest = std::min(batch.nearest, queue.distance(glm::vec3(spheres[i])));
+				}
+				batch.count = static_cast<unsigned int>(visible.size()) - batch.first;
+				if (batch.count > 0)
+					batches.push_back(batch);
+			}
+		}
+		if (visible.empty())
+			return;
+
+		size_t bytes = visible.size() * sizeof(glm::mat4);
+		glBindBuffer(GL_ARRAY_BUFFER, instanceVBO.id());
+		if (bytes > instanceCapacity)
+		{
+			instanceCapacity = bytes;
+			glBufferData(GL_ARRAY_BUFFER, bytes, visible.data(), GL_STREAM_DRAW);
+		}
+		else
+		{
+			// orphan the previous frame's storage instead of waiting on it
+			glBufferData(GL_ARRAY_BUFFER, instanceCapacity, NULL, GL_STREAM_DRAW);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, visible.data());
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		for (const InstanceBatch& batch : batches)
+			queue.add(shader, meshes[batch.mesh], batch.count, batch.first, batch.nearest, batch.lod);
+	}
+
+	// drops this model's references in the TextureCache
+	void releaseTextures()
+	{
+		for (unsigned int i = 0; i < textures_loaded.size(); i++)
+			TextureCache::instance().release(textures_loaded[i].id);
+		textures_loaded.clear();
+		textures_index.clear();
 	}
 
 private:
-	void loadModel(string const& path)
+	unordered_map<string, size_t> textures_index;
+	GLBuffer instanceVBO;
+	size_t instanceCapacity = 0;
+	// object space error of each level over all meshes, see selectLod
+	vector<float> lodErrors;
+
+	struct InstanceBatch {
+		unsigned int mesh;
+		unsigned int lod;
+		unsigned int first;
+		unsigned int count;
+		float nearest;
+	};
+
+	// per frame culling scratch, kept to avoid reallocating
+	vector<glm::vec4> spheres;
+	vector<int> palettes;
+	unordered_map<uint64_t, int> sharedPalettes;
+	vector<unsigned char> modelResults;
+	vector<unsigned char> meshVisible;
+	vector<glm::mat4> visible;
+	vector<InstanceBatch> batches;
+
+	// BonePalette index of the instance's bone matrices, sampled once per frame and
+	// shared by instances in the same pose. The affine instance matrices leave their
+	// bottom row free: [0][3] carries the index to shader.vs, which restores the zero.
+	int palette(size_t instance, const vector<SkinPose>& poses)
+	{
+		if (palettes[instance] >= 0)
+			return palettes[instance];
+
+		SkinPose pose = instance < poses.size() ? poses[instance] : SkinPose();
+		float ticks = pose.clip < skeleton.clips.size() ? skeleton.ticks(skeleton.clips[pose.clip], pose.seconds) : 0.0f;
+		uint32_t tickBits;
+		memcpy(&tickBits, &ticks, sizeof(tickBits));
+		uint64_t key = (uint64_t(pose.clip) << 32) | tickBits;
+		auto shared = sharedPalettes.find(key);
+		if (shared != sharedPalettes.end())
+		{
+			BonePalette::instance().frameStats.shared++;
+			return palettes[instance] = shared->second;
+		}
+
+		int first = BonePalette::instance().allocate(skeleton.boneCount());
+		if (first < 0)
+			return palettes[instance] = 0;
+		skeleton.pose(pose, BonePalette::instance().data(first));
+		sharedPalettes[key] = first;
+		return palettes[instance] = first;
+	}
+
+	// GL half of loading, on the thread that owns the context
+	void upload(const ModelData& data)
+	{
+		directory = data.directory;
+		path = data.path;
+		skeleton = data.skeleton;
+
+		for (unsigned int i = 0; i < data.meshes.size(); i++)
+		{
+			meshes.push_back(Mesh(data.meshes[i], loadTextures(data.meshes[i].textures), data.cpuAccess));
+			bounds = i == 0 ? meshes[i].bounds : MergeBounds(bounds, meshes[i].bounds);
+
+			// a mesh with fewer levels keeps drawing its coarsest one
+			const vector<MeshLod>& lods = meshes[i].lods;
+			if (lods.size() > lodErrors.size())
+				lodErrors.resize(lods.size(), 0.0f);
+			for (size_t level = 0; level < lodErrors.size(); level++)
+				lodErrors[level] = std::max(lodErrors[level], lods[std::min(level, lods.size() - 1)].error);
+		}
+
+		instanceVBO = GLResources::instance().buffer(GL_ARRAY_BUFFER, 0, NULL, GL_STREAM_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		for (unsigned int i = 0; i < meshes.size(); i++)
+			meshes[i].setupInstancing(instanceVBO.id());
+	}
+
+	static bool importModel(string const& path, vector<MeshData>& data, Skeleton& skeleton)
 	{
 		Assimp::Importer importer;
-		const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+		const aiScene* scene = importer.ReadFile(path, MODEL_IMPORT_FLAGS);
 
 		if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
 		{
 			cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << endl;
-			return;
+			return false;
 		}
 
-		directory = path.substr(0, path.find_last_of('/'));
-
-		processNode(scene->mRootNode, scene);
+		skeleton.build(scene);
+		processNode(scene->mRootNode, scene, data, skeleton);
+		return true;
 	}
 
-	void processNode(aiNode* node, const aiScene* scene)
+	static void processNode(aiNode* node, const aiScene* scene, vector<MeshData>& data, Skeleton& skeleton)
 	{
 		for (unsigned int i = 0; i < node->mNumMeshes; i++)
 		{
 			aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-			meshes.push_back(processMesh(mesh, scene));
+			data.push_back(processMesh(mesh, scene, skeleton));
 		}
 
 		for (unsigned int i = 0; i < node->mNumChildren; i++)
 		{
-			processNode(node->mChildren[i], scene);
+			processNode(node->mChildren[i], scene, data, skeleton);
 		}
 
 	}
 
-	Mesh processMesh(aiMesh* mesh, const aiScene* scene)
+	static MeshData processMesh(aiMesh* mesh, const aiScene* scene, Skeleton& skeleton)
 	{
-		vector<Vertex> vertices;
-		vector<unsigned int> indices;
-		vector<Texture> textures;
+		MeshData data;
+		vector<Vertex>& vertices = data.vertices;
+		vector<unsigned int>& indices = data.indices;
+		vector<Texture>& textures = data.textures;
 
 		for (unsigned int i = 0; i < mesh->mNumVertices; i++)
 		{
-			Vertex vertex;
+			Vertex vertex = {};
 			glm::vec3 vector;
 			vector.x = mesh->mVertices[i].x;
 			vector.y = mesh->mVertices[i].y;
@@ -122,12 +464,34 @@ private:
 			vertices.push_back(vertex);
 		}
 
+		// the four strongest bones of each vertex, indices into the model's palette
+		for (unsigned int b = 0; b < mesh->mNumBones; b++)
+		{
+			const aiBone* bone = mesh->mBones[b];
+			int index = skeleton.bone(bone);
+			if (index < 0)
+				continue;
+			for (unsigned int w = 0; w < bone->mNumWeights; w++)
+			{
+				const aiVertexWeight& weight = bone->mWeights[w];
+				if (weight.mVertexId < vertices.size() && weight.mWeight > 0.0f)
+					AddBoneInfluence(vertices[weight.mVertexId], index, weight.mWeight);
+			}
+		}
+		if (mesh->HasBones())
+		{
+			for (Vertex& vertex : vertices)
+				NormalizeBoneWeights(vertex);
+		}
+
 		for (unsigned int i = 0; i < mesh->mNumFaces; i++)
 		{
 			aiFace face = mesh->mFaces[i];
 			for (unsigned int j = 0; j < face.mNumIndices; j++)
 				indices.push_back(face.mIndices[j]);
 		}
+		data.bounds = BoundsFromVertices(vertices.data(), vertices.size());
+
 		aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
 
 		// 1. diffuse maps
@@ -143,80 +507,55 @@ private:
 		std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
 		textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
 
-		return Mesh(vertices, indices, textures);
+		return data;
 	}
 
-	vector<Texture> loadMaterialTextures(aiMaterial* mat, aiTextureType type, string typeName)
+	static vector<Texture> loadMaterialTextures(aiMaterial* mat, aiTextureType type, string typeName)
 	{
 		vector<Texture> textures;
 		for (unsigned int i = 0; i < mat->GetTextureCount(type); i++)
 		{
 			aiString str;
 			mat->GetTexture(type, i, &str);
-			bool skip = false;
 
-			for (unsigned int j = 0; j < textures_loaded.size(); j++)
-			{
-				if (std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0)
-				{
-					textures.push_back(textures_loaded[j]);
-					skip = true;
-					break;
-				}
-			}
+			Texture texture;
+			texture.id = 0;
+			texture.type = typeName;
+			texture.path = str.C_Str();
+			textures.push_back(texture);
+		}
+		return textures;
+	}
 
-			if (!skip)
+	vector<Texture> loadTextures(const vector<Texture>& references)
+	{
+		vector<Texture> textures;
+		for (unsigned int i = 0; i < references.size(); i++)
+		{
+			auto loaded = textures_index.find(references[i].path);
+			if (loaded != textures_index.end())
 			{
-				Texture texture;
-				texture.id = TextureFromFile(str.C_Str(), this->directory);
-				texture.type = typeName;
-				texture.path = str.C_Str();
-				textures.push_back(texture);
-				textures_loaded.push_back(texture);
+				textures.push_back(textures_loaded[loaded->second]);
+				continue;
 			}
+
+			// one cache reference per model, shared by all of its meshes
+			Texture texture;
+			texture.id = TextureCache::instance().acquire(references[i].path, this->directory, gammaCorrection);
+			texture.type = references[i].type;
+			texture.path = references[i].path;
+			textures.push_back(texture);
+			textures_index[texture.path] = textures_loaded.size();
+			textures_loaded.push_back(texture);
 		}
 		return textures;
 	}
 };
 
 
-unsigned int TextureFromFile(const char* path, const string& directory, bool gamma)
+GLTexture TextureFromFile(const char* path, const string& directory, bool gamma)
 {
-	string filename = string(path);
-	filename = directory + '/' + filename;
-
-	unsigned int textureID;
-	glGenTextures(1, &textureID);
-
-	int width, height, nrComponents;
-	unsigned char* data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-	if (data)
-	{
-		GLenum format;
-		if (nrComponents == 1)
-			format = GL_RED;
-		else if (nrComponents == 3)
-			format = GL_RGB;
-		else if (nrComponents == 4)
-			format = GL_RGBA;
-
-		glBindTexture(GL_TEXTURE_2D, textureID);
-		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
-
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		
-		stbi_image_free(data);
-	}
-	else
-	{
-		std::cout << "Texture failed to load at path: " << path << std::endl;
-		stbi_image_free(data);
-	}
-
-	return textureID;
+	return UploadImage(DecodeImage(path, directory), gamma);
 }
+
 #endif
\ No newline at end of file
@@ -0,0 +1,173 @@
+#ifndef MODEL_LOADER_H
+#define MODEL_LOADER_H
+
+#include <3DViewer/model.h>
+#include <3DViewer/modelmanager.h>
+#include <3DViewer/threadpool.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct LoadTiming {
+	string path;
+	bool cached = false;
+	double importMilliseconds = 0.0;
+	double decodeMilliseconds = 0.0;
+	double uploadMilliseconds = 0.0;
+};
+
+// Runs Model::import for every distinct queued path on the thread pool and hands the
+// results back to the GL thread in completion order, so uploads overlap the remaining
+// imports. Paths already resident in the ModelManager, or queued twice, are not
+// imported again. A path queued with cpuAccess keeps its geometry on the CPU.
+class ModelLoader
+{
+public:
+	ModelLoader(ThreadPool& pool = ThreadPool::shared()) : pool(pool)
+	{
+		start = chrono::steady_clock::now();
+	}
+
+	// imports still running write into this loader, so it only goes once they are
+	// done, e.g. when loadScene throws halfway; what was never handed out is dropped,
+	// along with the images of models that were never uploaded
+	~ModelLoader()
+	{
+		unique_lock<mutex> lock(resultsMutex);
+		while (pending > 0)
+		{
+			resultReady.wait(lock, [this] { return !results.empty(); });
+			results.pop();
+			pending--;
+		}
+		lock.unlock();
+		TextureCache::instance().releaseUnacquired();
+		for (auto& entry : ready)
+			ModelManager::instance().release(entry.second);
+	}
+
+	void enqueue(size_t id, string const& path, bool cpuAccess = false)
+	{
+		ModelHandle resident = ModelManager::instance().find(path);
+		if (resident.valid())
+		{
+			if (cpuAccess)
+				ModelManager::instance().get(resident)->requireCpuAccess();
+			ready.push_back(make_pair(id, ModelManager::instance().acquire(resident)));
+			return;
+		}
+
+		// the import is shared, so one object asking is enough for all of them
+		if (cpuAccess)
+			cpuAccessPaths.insert(path);
+		vector<size_t>& waiting = waitingIds[path];
+		waiting.push_back(id);
+		if (waiting.size() > 1)
+			return;
+
+		pending++;
+		pool.submit([this, path] {
+			ModelData data = Model::import(path);
+			{
+				lock_guard<mutex> lock(resultsMutex);
+				results.push(std::move(data));
+			}
+			resultReady.notify_one();
+		});
+	}
+
+	// hands out the model for one queued id, waiting for and uploading the next
+	// finished import on the calling thread when needed; returns false once every
+	// queued id has been handed out. Each handle carries its own reference.
+	bool next(size_t& id, ModelHandle& handle)
+	{
+		while (ready.empty())
+		{
+			if (pending == 0)
+				return false;
+			uploadNext();
+		}
+
+		id = ready.front().first;
+		handle = ready.front().second;
+		ready.pop_front();
+		return true;
+	}
+
+	const vector<LoadTiming>& getTimings() const
+	{
+		return timings;
+	}
+
+	void report() const
+	{
+		double total = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		double sum = 0.0;
+		ios state(nullptr);
+		state.copyfmt(cout);
+		cout << "MODEL_LOADER:: " << timings.size() << " models on " << pool.size() << " threads" << endl;
+		cout << fixed << setprecision(1);
+		for (const LoadTiming& timing : timings)
+		{
+			double asset = timing.importMilliseconds + timing.decodeMilliseconds + timing.uploadMilliseconds;
+			sum += asset;
+			cout << "  " << timing.path << (timing.cached ? " [cached]" : "")
+				<< " import: " << timing.importMilliseconds << " ms decode: " << timing.decodeMilliseconds
+				<< " ms upload: " << timing.uploadMilliseconds << " ms" << endl;
+		}
+		cout << "  wall: " << total << " ms (sequential sum: " << sum << " ms)" << endl;
+		cout.copyfmt(state);
+	}
+
+private:
+	ThreadPool& pool;
+	queue<ModelData> results;
+	mutex resultsMutex;
+	condition_variable resultReady;
+	size_t pending = 0;
+	map<string, vector<size_t>> waitingIds;
+	set<string> cpuAccessPaths;
+	deque<pair<size_t, ModelHandle>> ready;
+	vector<LoadTiming> timings;
+	chrono::steady_clock::time_point start;
+
+	void uploadNext()
+	{
+		ModelData data;
+		{
+			unique_lock<mutex> lock(resultsMutex);
+			resultReady.wait(lock, [this] { return !results.empty(); });
+			data = std::move(results.front());
+			results.pop();
+		}
+		pending--;
+
+		data.cpuAccess = cpuAccessPaths.count(data.path) > 0;
+		auto upload = chrono::steady_clock::now();
+		ModelHandle handle = ModelManager::instance().add(data.path, Model(data));
+
+		LoadTiming timing;
+		timing.path = data.path;
+		timing.cached = data.cached != nullptr;
+		timing.importMilliseconds = data.importMilliseconds;
+		timing.decodeMilliseconds = data.decodeMilliseconds;
+		timing.uploadMilliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - upload).count();
+		timings.push_back(timing);
+
+		for (size_t id : waitingIds[data.path])
+			ready.push_back(make_pair(id, ModelManager::instance().acquire(handle)));
+		waitingIds.erase(data.path);
+	}
+};
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef MODEL_MANAGER_H
+#define MODEL_MANAGER_H
+
+#include <3DViewer/model.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// index into ModelManager's slots; the generation catches handles to a slot that
+// has since been freed and reused
+struct ModelHandle {
+	unsigned int index = ~0u;
+	unsigned int generation = 0;
+
+	bool valid() const { return index != ~0u; }
+	bool operator==(const ModelHandle& other) const { return index == other.index && generation == other.generation; }
+	bool operator!=(const ModelHandle& other) const { return !(*this == other); }
+	bool operator<(const ModelHandle& other) const { return index < other.index || (index == other.index && generation < other.generation); }
+};
+
+struct ResidentModel {
+	string path;
+	unsigned int references = 0;
+	ModelMemory memory;
+};
+
+// Owns every loaded Model exactly once, keyed by its source path. Objects hold a
+// ModelHandle and a reference; the model (its meshes and texture references) is
+// freed when the last object releases it.
+class ModelManager
+{
+public:
+	static ModelManager& instance()
+	{
+		static ModelManager manager;
+		return manager;
+	}
+
+	ModelHandle find(string const& path) const
+	{
+		auto slot = byPath.find(path);
+		if (slot == byPath.end())
+			return ModelHandle();
+		return handleOf(slot->second);
+	}
+
+	// takes ownership of an uploaded model; the returned handle holds no reference
+	ModelHandle add(string const& path, Model&& model)
+	{
+		ModelHandle existing = find(path);
+		if (existing.valid())
+		{
+			model.releaseTextures();
+			return existing;
+		}
+
+		unsigned int index;
+		if (!freeSlots.empty())
+		{
+			index = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		else
+		{
+			index = static_cast<unsigned int>(slots.size());
+			slots.push_back(ModelSlot());
+		}
+
+		ModelSlot& slot = slots[index];
+		slot.model = make_unique<Model>(std::move(model));
+		slot.path = path;
+		slot.references = 0;
+		byPath[path] = index;
+		return handleOf(index);
+	}
+
+	// synchronous load, reusing the resident model when there is one; cpuAccess keeps
+	// its geometry on the CPU, reloading it if the resident copy dropped it
+	ModelHandle load(string const& path, bool cpuAccess = false)
+	{
+		ModelHandle handle = find(path);
+		if (!handle.valid())
+			handle = add(path, Model(path, false, cpuAccess));
+		else if (cpuAccess)
+			get(handle)->requireCpuAccess();
+		return acquire(handle);
+	}
+
+	ModelHandle acquire(ModelHandle handle)
+	{
+		if (ModelSlot* slot = slotOf(handle))
+			slot->references++;
+		return handle;
+	}
+
+	void release(ModelHandle handle)
+	{
+		ModelSlot* slot = slotOf(handle);
+		if (!slot || slot->references == 0 || --slot->references > 0)
+			return;
+
+		slot->model->releaseTextures();
+		slot->model.reset();
+		byPath.erase(slot->path);
+		slot->path.clear();
+		slot->generation++;
+		freeSlots.push_back(handle.index);
+	}
+
+	Model* get(ModelHandle handle)
+	{
+		ModelSlot* slot = slotOf(handle);
+		return slot ? slot->model.get() : nullptr;
+	}
+
+	unsigned int residentCount() const
+	{
+		return static_cast<unsigned int>(byPath.size());
+	}
+
+	unsigned int referenceCount() const
+	{
+		unsigned int references = 0;
+		for (const ModelSlot& slot : slots)
+			references += slot.references;
+		return references;
+	}
+
+	vector<ResidentModel> resident() const
+	{
+		vector<ResidentModel> models;
+		for (const ModelSlot& slot : slots)
+		{
+			if (!slot.model)
+				continue;
+			ResidentModel model;
+			model.path = slot.path;
+			model.references = slot.references;
+			model.memory = slot.model->memory();
+			models.push_back(model);
+		}
+		return models;
+	}
+
+	void report() const
+	{
+		cout << "MODEL_MANAGER:: models: " << residentCount() << " references: " << referenceCount() << endl;
+	}
+
+private:
+	struct ModelSlot {
+		unique_ptr<Model> model;
+		string path;
+		unsigned int references = 0;
+		unsigned int generation = 0;
+	};
+
+	vector<ModelSlot> slots;
+	vector<unsigned int> freeSlots;
+	unordered_map<string, unsigned int> byPath;
+
+	ModelManager() {}
+
+	ModelHandle handleOf(unsigned int index) const
+	{
+		ModelHandle handle;
+		handle.index = index;
+		handle.generation = slots[index].generation;
+		return handle;
+	}
+
+	ModelSlot* slotOf(ModelHandle handle)
+	{
+		if (handle.index >= slots.size() || slots[handle.index].generation != handle.generation || !slots[handle.index].model)
+			return nullptr;
+		return &slots[handle.index];
+	}
+};
+
+#endif
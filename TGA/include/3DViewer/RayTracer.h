@@ -0,0 +1,466 @@
+#ifndef RAY_TRACER_H
+#define RAY_TRACER_H
+
+#include <glm/glm.hpp>
+
+#include <3DViewer/frameuniforms.h>
+#include <3DViewer/skeleton.h>
+#include <3DViewer/softwarerenderer.h>
+#include <3DViewer/threadpool.h>
+#include <3DViewer/trianglebvh.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <vector>
+using namespace std;
+
+// pixels per side of the tiles workers take
+#define RAYTRACE_TILE_SIZE 16
+// vertices or triangles a worker puts in world space per job
+#define RAYTRACE_CHUNK 4096
+// how far shadow rays start off the surface, relative to its distance from the origin
+#define RAYTRACE_EPSILON 1e-4f
+#define RAYTRACE_MAX_SUPERSAMPLE 8
+
+struct RayTraceStats {
+	unsigned int workers = 1;
+	unsigned int draws = 0;
+	unsigned int meshes = 0;
+	size_t triangles = 0;
+	BvhStats bvh;
+	size_t primaryRays = 0;
+	size_t shadowRays = 0;
+	size_t hits = 0;
+	unsigned int tiles = 0;
+	float buildMilliseconds = 0.0f;
+	float traceMilliseconds = 0.0f;
+
+	double raysPerSecond() const
+	{
+		return traceMilliseconds > 0.0f ? (primaryRays + shadowRays) * 1000.0 / traceMilliseconds : 0.0;
+	}
+};
+
+// Offline CPU path for stills, drawing SoftwareModels with the lights and materials
+// of shader.fs, and hard shadows from both lights. A frame runs in two phases:
+//
+// build: every mesh of every draw is put in world space (skinned if it has bones),
+//   culled or not, since what is off screen still casts shadows, and a TriangleBVH
+//   is built over all the triangles on every worker.
+// trace: workers take RAYTRACE_TILE_SIZE tiles off a counter. A sample is a ray from
+//   the eye between the near and far planes; its nearest hit is shaded with
+//   interpolated attributes, texture footprints from where the neighbouring samples'
+//   rays cross the triangle's plane, and ShadePhong, after a shadow ray toward each
+//   light. The spotlight of updateFrame sits at the eye, which sees nothing it does
+//   not light, so it only casts rays once it is somewhere else.
+//
+// Workers only read the scene and write pixels of their own, so rays per second grow
+// with the cores. Images come out bottom row first, as from glReadPixels.
+class RayTracer
+{
+public:
+	RayTraceStats stats;
+
+	// threads besides the calling one
+	void setWorkers(unsigned int count)
+	{
+		pool.reset();
+		if (count > 0)
+			pool = make_unique<ThreadPool>(count);
+		workers.clear();
+		for (unsigned int w = 0; w < workerCount(); w++)
+			workers.push_back(make_unique<Worker>());
+	}
+
+	unsigned int workerCount() const
+	{
+		return pool ? pool->size() + 1 : 1;
+	}
+
+	bool resize(int width, int height)
+	{
+		if (width <= 0 || height <= 0 || width > SOFTWARE_MAX_SIZE || height > SOFTWARE_MAX_SIZE)
+		{
+			cout << "ERROR::RAYTRACE:: target must be between 1 and " << SOFTWARE_MAX_SIZE << " pixels on a side" << endl;
+			return false;
+		}
+		this->width = width;
+		this->height = height;
+		color.assign(size_t(width) * height * 4, 0);
+		return true;
+	}
+
+	// an n by n grid of samples per pixel, averaged
+	void setSupersampling(unsigned int n)
+	{
+		supersampling = std::min(std::max(n, 1u), unsigned(RAYTRACE_MAX_SUPERSAMPLE));
+	}
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+	// RGBA8, bottom row first
+	const vector<unsigned char>& pixels() const
+	{
+		return color;
+	}
+
+	void render(const FrameBlock& frame, const vector<SoftwareDraw>& draws, const glm::vec3& clearColor)
+	{
+		auto begin = chrono::steady_clock::now();
+		if (workers.empty())
+			setWorkers(0);
+		this->frame = frame;
+		this->clearColor = clearColor;
+		for (unique_ptr<Worker>& worker : workers)
+			*worker = Worker();
+
+		stats = RayTraceStats();
+		stats.workers = workerCount();
+		stats.draws = static_cast<unsigned int>(draws.size());
+		prepare(draws);
+		bvh.build(corners, pool.get());
+		stats.bvh = bvh.stats;
+		auto built = chrono::steady_clock::now();
+
+		setupCamera();
+		unsigned int tilesX = (width + RAYTRACE_TILE_SIZE - 1) / RAYTRACE_TILE_SIZE;
+		unsigned int tileCount = tilesX * ((height + RAYTRACE_TILE_SIZE - 1) / RAYTRACE_TILE_SIZE);
+		atomic<unsigned int> nextTile{ 0 };
+		parallel([&](unsigned int w) {
+			for (unsigned int tile = nextTile++; tile < tileCount; tile = nextTile++)
+				traceTile(*workers[w], tile % tilesX, tile / tilesX);
+		});
+
+		for (const unique_ptr<Worker>& worker : workers)
+		{
+			stats.primaryRays += worker->primaryRays;
+			stats.shadowRays += worker->shadowRays;
+			stats.hits += worker->hits;
+			stats.tiles += worker->tiles;
+		}
+		auto end = chrono::steady_clock::now();
+		stats.buildMilliseconds = chrono::duration<float, milli>(built - begin).count();
+		stats.traceMilliseconds = chrono::duration<float, milli>(end - built).count();
+	}
+
+	void report() const
+	{
+		cout << "RAYTRACE:: " << width << "x" << height << " samples: " << supersampling << "x" << supersampling
+			<< " workers: " << stats.workers << " draws: " << stats.draws << " meshes: " << stats.meshes << " triangles: " << stats.triangles << endl;
+		cout << "RAYTRACE:: bvh nodes: " << stats.bvh.nodes << " leaves: " << stats.bvh.leaves << " (binary nodes: " << stats.bvh.binaryNodes
+			<< " tasks: " << stats.bvh.tasks << ") in " << stats.bvh.buildMilliseconds << " ms, frame built in " << stats.buildMilliseconds << " ms" << endl;
+		cout << "RAYTRACE:: primary rays: " << stats.primaryRays << " (hits: " << stats.hits << ") shadow rays: " << stats.shadowRays
+			<< " tiles: " << stats.tiles << " traced in " << stats.traceMilliseconds << " ms, " << stats.raysPerSecond() / 1e6 << " Mrays/s" << endl;
+	}
+
+private:
+	// a mesh of a draw, and where its vertices and triangles start
+	struct Item {
+		const SoftwareMesh* mesh;
+		glm::mat4 transform;
+		glm::mat3 normalMatrix;
+		int palette;
+		size_t firstVertex;
+		size_t firstTriangle;
+	};
+
+	struct WorldVertex {
+		glm::vec3 position;
+		glm::vec3 normal;
+		glm::vec2 uv;
+	};
+
+	// a triangle with what shading needs, by its place in the scene
+	struct Primitive {
+		uint32_t vertex[3];
+		const SoftwareMesh* mesh;
+	};
+
+	struct Worker {
+		size_t primaryRays = 0;
+		size_t shadowRays = 0;
+		size_t hits = 0;
+		unsigned int tiles = 0;
+	};
+
+	unique_ptr<ThreadPool> pool;
+	vector<unique_ptr<Worker>> workers;
+	int width = 0;
+	int height = 0;
+	unsigned int supersampling = 1;
+	vector<unsigned char> color;
+	FrameBlock frame = {};
+	glm::vec3 clearColor = glm::vec3(0.0f);
+
+	vector<Item> items;
+	vector<glm::mat4> palettes;
+	vector<WorldVertex> vertices;
+	vector<Primitive> primitives;
+	// three per primitive, what the hierarchy is built from
+	vector<glm::vec3> corners;
+	TriangleBVH bvh;
+
+	// the eye, the near plane corner at the bottom left of the image and the steps of
+	// a pixel along it; the far plane is farRatio times farther on every ray
+	glm::vec3 eye = glm::vec3(0.0f);
+	glm::vec3 nearCorner = glm::vec3(0.0f);
+	glm::vec3 nearStepX = glm::vec3(0.0f);
+	glm::vec3 nearStepY = glm::vec3(0.0f);
+	float farRatio = 1.0f;
+
+	// job(worker) on every worker, the calling thread being worker 0
+	void parallel(const function<void(unsigned int)>& job)
+	{
+		vector<future<void>> done;
+		for (unsigned int w = 1; w < workerCount(); w++)
+			done.push_back(pool->submit([&job, w] { job(w); }));
+		job(0);
+		for (future<void>& d : done)
+			d.get();
+	}
+
+	// job(first, last) over [0, count) in chunks, on every worker
+	void parallelChunks(size_t count, const function<void(size_t, size_t)>& job)
+	{
+		atomic<size_t> next{ 0 };
+		parallel([&](unsigned int) {
+			for (size_t first = next.fetch_add(RAYTRACE_CHUNK); first < count; first = next.fetch_add(RAYTRACE_CHUNK))
+				job(first, std::min(first + RAYTRACE_CHUNK, count));
+		});
+	}
+
+	static float epsilonAt(const glm::vec3& p)
+	{
+		glm::vec3 a = glm::abs(p);
+		return RAYTRACE_EPSILON * std::max(1.0f, std::max(a.x, std::max(a.y, a.z)));
+	}
+
+	// every mesh in world space, and the corners of its triangles
+	void prepare(const vector<SoftwareDraw>& draws)
+	{
+		items.clear();
+		palettes.clear();
+		size_t vertexCount = 0;
+		for (const SoftwareDraw& draw : draws)
+		{
+			if (!draw.model)
+				continue;
+			int palette = -1;
+			if (draw.model->skeleton.boneCount() > 0)
+			{
+				palette = static_cast<int>(palettes.size());
+				palettes.resize(palettes.size() + draw.model->skeleton.boneCount());
+				draw.model->skeleton.pose(draw.pose, &palettes[palette]);
+			}
+			glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(draw.transform)));
+			for (const SoftwareMesh& mesh : draw.model->meshes)
+			{
+				items.push_back(Item{ &mesh, draw.transform, normalMatrix, mesh.skinned ? palette : -1, vertexCount, stats.triangles });
+				vertexCount += mesh.vertices.size();
+				stats.triangles += mesh.indices.size() / 3;
+			}
+		}
+		stats.meshes = static_cast<unsigned int>(items.size());
+		vertices.resize(vertexCount);
+		primitives.resize(stats.triangles);
+		corners.resize(stats.triangles * 3);
+
+		parallelChunks(vertices.size(), [this](size_t first, size_t last) { transformVertices(first, last); });
+		parallelChunks(primitives.size(), [this](size_t first, size_t last) { setupPrimitives(first, last); });
+	}
+
+	// the item holding a vertex or a triangle
+	size_t itemOf(size_t index, size_t Item::* first) const
+	{
+		size_t lo = 0, hi = items.size();
+		while (hi - lo > 1)
+		{
+			size_t middle = (lo + hi) / 2;
+			if (items[middle].*first <= index)
+				lo = middle;
+			else
+				hi = middle;
+		}
+		return lo;
+	}
+
+	void transformVertices(size_t first, size_t last)
+	{
+		size_t i = itemOf(first, &Item::firstVertex);
+		for (size_t v = first; v < last; v++)
+		{
+			while (i + 1 < items.size() && items[i + 1].firstVertex <= v)
+				i++;
+			const Item& item = items[i];
+			const Vertex& source = item.mesh->vertices[v - item.firstVertex];
+			glm::vec3 position = source.Position;
+			glm::vec3 normal = source.Normal;
+			if (item.palette >= 0)
+			{
+				glm::mat4 skin = SkinMatrix(source, &palettes[item.palette]);
+				position = glm::vec3(skin * glm::vec4(position, 1.0f));
+				normal = glm::mat3(skin) * normal;
+			}
+
+			WorldVertex& out = vertices[v];
+			out.position = glm::vec3(item.transform * glm::vec4(position, 1.0f));
+			out.normal = item.normalMatrix * normal;
+			out.uv = source.TexCoords;
+		}
+	}
+
+	void setupPrimitives(size_t first, size_t last)
+	{
+		size_t i = itemOf(first, &Item::firstTriangle);
+		for (size_t t = first; t < last; t++)
+		{
+			while (i + 1 < items.size() && items[i + 1].firstTriangle <= t)
+				i++;
+			const Item& item = items[i];
+			const unsigned int* index = &item.mesh->indices[(t - item.firstTriangle) * 3];
+			Primitive& primitive = primitives[t];
+			for (int k = 0; k < 3; k++)
+			{
+				primitive.vertex[k] = static_cast<uint32_t>(item.firstVertex + index[k]);
+				corners[t * 3 + k] = vertices[primitive.vertex[k]].position;
+			}
+			primitive.mesh = item.mesh;
+		}
+	}
+
+	void setupCamera()
+	{
+		glm::mat4 inverse = glm::inverse(frame.projection * frame.view);
+		auto unproject = [&inverse](float x, float y, float z) {
+			glm::vec4 p = inverse * glm::vec4(x, y, z, 1.0f);
+			return glm::vec3(p) / p.w;
+		};
+		eye = glm::vec3(glm::inverse(frame.view)[3]);
+		nearCorner = unproject(-1.0f, -1.0f, -1.0f);
+		nearStepX = (unproject(1.0f, -1.0f, -1.0f) - nearCorner) / float(width);
+		nearStepY = (unproject(-1.0f, 1.0f, -1.0f) - nearCorner) / float(height);
+		farRatio = glm::length(unproject(0.0f, 0.0f, 1.0f) - eye) / glm::length(unproject(0.0f, 0.0f, -1.0f) - eye);
+	}
+
+	void traceTile(Worker& worker, unsigned int tileX, unsigned int tileY)
+	{
+		int x0 = tileX * RAYTRACE_TILE_SIZE;
+		int y0 = tileY * RAYTRACE_TILE_SIZE;
+		int x1 = std::min(x0 + RAYTRACE_TILE_SIZE, width);
+		int y1 = std::min(y0 + RAYTRACE_TILE_SIZE, height);
+		float spacing = 1.0f / supersampling;
+		float weight = spacing * spacing;
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = x0; x < x1; x++)
+			{
+				glm::vec3 sum(0.0f);
+				for (unsigned int sy = 0; sy < supersampling; sy++)
+				{
+					for (unsigned int sx = 0; sx < supersampling; sx++)
+						sum += traceSample(worker, x + (sx + 0.5f) * spacing, y + (sy + 0.5f) * spacing, spacing);
+				}
+				sum *= weight;
+				unsigned char* out = &color[(size_t(y) * width + x) * 4];
+				out[0] = ColorByte(sum.r);
+				out[1] = ColorByte(sum.g);
+				out[2] = ColorByte(sum.b);
+				out[3] = 255;
+			}
+		}
+		worker.tiles++;
+	}
+
+	// the color seen through a point of the image, in pixels from its bottom left
+	glm::vec3 traceSample(Worker& worker, float x, float y, float spacing)
+	{
+		// from the eye, clipped to the near and far planes as the GL draws
+		glm::vec3 toNear = nearCorner + nearStepX * x + nearStepY * y - eye;
+		float nearDistance = glm::length(toNear);
+		BvhRay ray(eye, toNear / nearDistance, nearDistance, nearDistance * farRatio);
+		worker.primaryRays++;
+		BvhHit hit;
+		if (!bvh.intersect(ray, hit))
+			return clearColor;
+		worker.hits++;
+
+		const Primitive& primitive = primitives[hit.triangle];
+		const WorldVertex* v[3] = { &vertices[primitive.vertex[0]], &vertices[primitive.vertex[1]], &vertices[primitive.vertex[2]] };
+		float w = 1.0f - hit.u - hit.v;
+		glm::vec3 position = ray.origin + ray.direction * hit.t;
+		glm::vec3 normal = w * v[0]->normal + hit.u * v[1]->normal + hit.v * v[2]->normal;
+		glm::vec2 uv = w * v[0]->uv + hit.u * v[1]->uv + hit.v * v[2]->uv;
+
+		// the texture footprint of the sample, from the next samples' rays
+		glm::vec3 geometric = glm::cross(v[1]->position - v[0]->position, v[2]->position - v[0]->position);
+		glm::vec2 uvdx = uvOnPlane(v, geometric, toNear + nearStepX * spacing, uv) - uv;
+		glm::vec2 uvdy = uvOnPlane(v, geometric, toNear + nearStepY * spacing, uv) - uv;
+		// without a map the unit samples an incomplete texture, black
+		const SoftwareMesh& mesh = *primitive.mesh;
+		glm::vec3 diffuse = mesh.diffuse ? glm::vec3(mesh.diffuse->sample(uv, uvdx, uvdy)) : glm::vec3(0.0f);
+		glm::vec3 specular = mesh.specular ? glm::vec3(mesh.specular->sample(uv, uvdx, uvdy)) : glm::vec3(0.0f);
+
+		// shadow rays leave from the side the eye sees
+		float side = glm::dot(geometric, ray.direction) < 0.0f ? 1.0f : -1.0f;
+		float length = glm::length(geometric);
+		glm::vec3 origin = length > 0.0f ? position + geometric * (side * epsilonAt(position) / length) : position;
+
+		float dirVisibility = 1.0f;
+		glm::vec3 toDirLight = -frame.dirLight.direction;
+		if (glm::length(toDirLight) > 0.0f)
+			dirVisibility = lit(worker, origin, glm::normalize(toDirLight), FLT_MAX) ? 1.0f : 0.0f;
+
+		float spotVisibility = 1.0f;
+		const SpotLightBlock& spot = frame.spotLight;
+		if (spot.constant + spot.linear + spot.quadratic > 0.0f && glm::distance(spot.position, eye) > epsilonAt(eye))
+		{
+			glm::vec3 toSpot = spot.position - origin;
+			float distance = glm::length(toSpot);
+			// outside the cone it adds nothing to shadow
+			if (distance > 0.0f && glm::dot(toSpot / distance, glm::normalize(-spot.direction)) > spot.outerCutOff)
+				spotVisibility = lit(worker, origin, toSpot / distance, distance) ? 1.0f : 0.0f;
+		}
+		return ShadePhong(frame, position, normal, diffuse, specular, SOFTWARE_SHININESS, dirVisibility, spotVisibility);
+	}
+
+	// the texture coordinates where a ray from the eye crosses the triangle's plane, or
+	// the hit's own if it runs along the plane
+	glm::vec2 uvOnPlane(const WorldVertex* const* v, const glm::vec3& geometric, const glm::vec3& direction, const glm::vec2& hit) const
+	{
+		float facing = glm::dot(direction, geometric);
+		if (facing == 0.0f)
+			return hit;
+		glm::vec3 v0 = v[0]->position;
+		glm::vec3 e1 = v[1]->position - v0;
+		glm::vec3 e2 = v[2]->position - v0;
+		glm::vec3 p = eye + direction * (glm::dot(v0 - eye, geometric) / facing) - v0;
+		float d00 = glm::dot(e1, e1);
+		float d01 = glm::dot(e1, e2);
+		float d11 = glm::dot(e2, e2);
+		float d20 = glm::dot(p, e1);
+		float d21 = glm::dot(p, e2);
+		float denominator = d00 * d11 - d01 * d01;
+		if (denominator == 0.0f)
+			return hit;
+		float b1 = (d11 * d20 - d01 * d21) / denominator;
+		float b2 = (d00 * d21 - d01 * d20) / denominator;
+		return (1.0f - b1 - b2) * v[0]->uv + b1 * v[1]->uv + b2 * v[2]->uv;
+	}
+
+	bool lit(Worker& worker, const glm::vec3& origin, const glm::vec3& direction, float distance)
+	{
+		worker.shadowRays++;
+		return !bvh.occluded(BvhRay(origin, direction, 0.0f, distance));
+	}
+};
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <3DViewer/glstate.h>
+#include <3DViewer/mesh.h>
+#include <3DViewer/shader.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <vector>
+using namespace std;
+
+// sort key, most significant first: program | texture set | vertex array | depth;
+// meshes share vertex arrays through the GeometryArena
+#define RENDER_KEY_PROGRAM_BITS 8
+#define RENDER_KEY_TEXTURES_BITS 20
+#define RENDER_KEY_VERTEX_ARRAY_BITS 20
+#define RENDER_KEY_DEPTH_BITS 16
+
+struct DrawItem {
+	uint64_t key;
+	Shader* shader;
+	Mesh* mesh;
+	unsigned int instanceCount;
+	unsigned int firstInstance;
+	unsigned int lod;
+};
+
+// Collects the frame's draws and submits them ordered by state, so meshes that
+// share a program, textures and vertex array run back to back and the GLStateCache
+// drops the repeated binds. Within one state opaque draws go front to back.
+class RenderQueue
+{
+public:
+	GLStateCache state;
+	unsigned int draws = 0;
+	size_t triangles = 0;
+
+	// eye position and far plane for the depth part of the key
+	void begin(const glm::vec3& eye, float farPlane)
+	{
+		this->eye = eye;
+		this->farPlane = farPlane;
+		items.clear();
+	}
+
+	float distance(const glm::vec3& position) const
+	{
+		return glm::length(position - eye);
+	}
+
+	// distance is that of the draw's closest instance
+	void add(Shader& shader, Mesh& mesh, unsigned int instanceCount, unsigned int firstInstance, float distance, unsigned int lod = 0)
+	{
+		DrawItem item;
+		item.key = makeKey(intern(programs, shader.ID), intern(textureSets, mesh.textureSet()), mesh.vertexArray(), distance);
+		item.shader = &shader;
+		item.mesh = &mesh;
+		item.instanceCount = instanceCount;
+		item.firstInstance = firstInstance;
+		item.lod = lod;
+		items.push_back(item);
+	}
+
+	// forgets the interned programs and texture sets, whose GL names the next scene
+	// reuses, so the ids stay within their key bits across scene loads
+	void clear()
+	{
+		items.clear();
+		programs.clear();
+		textureSets.clear();
+	}
+
+	void submit()
+	{
+		sort(items.begin(), items.end(), [](const DrawItem& a, const DrawItem& b) { return a.key < b.key; });
+
+		// bindings made outside the queue (model uploads, ImGui) are not tracked
+		state.reset();
+		GeometryArena::instance().forgetInstances();
+		triangles = 0;
+		for (const DrawItem& item : items)
+		{
+			state.useProgram(item.shader->ID);
+			item.mesh->bind(*item.shader, state);
+			item.mesh->drawInstances(item.instanceCount, item.firstInstance, item.lod);
+			triangles += size_t(item.mesh->triangleCount(item.lod)) * item.instanceCount;
+		}
+		draws = static_cast<unsigned int>(items.size());
+
+		glBindVertexArray(0);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+private:
+	vector<DrawItem> items;
+	map<unsigned int, unsigned int> programs;
+	map<vector<unsigned int>, unsigned int> textureSets;
+	glm::vec3 eye = glm::vec3(0.0f);
+	float farPlane = 100.0f;
+
+	// small dense ids for wide values, handed out in first seen order
+	template <typename T>
+	static unsigned int intern(map<T, unsigned int>& ids, const T& value)
+	{
+		auto id = ids.find(value);
+		if (id != ids.end())
+			return id->second;
+		unsigned int next = static_cast<unsigned int>(ids.size());
+		ids[value] = next;
+		return next;
+	}
+
+	uint64_t makeKey(unsigned int program, unsigned int textures, unsigned int vertexArray, float distance) const
+	{
+		assert(program < (1u << RENDER_KEY_PROGRAM_BITS) && "more programs than the sort key holds");
+		assert(textures < (1u << RENDER_KEY_TEXTURES_BITS) && "more texture sets than the sort key holds");
+		assert(vertexArray < (1u << RENDER_KEY_VERTEX_ARRAY_BITS) && "vertex array name past the sort key");
+		uint64_t depth = static_cast<uint64_t>(glm::clamp(distance / farPlane, 0.0f, 1.0f) * ((1 << RENDER_KEY_DEPTH_BITS) - 1));
+		uint64_t key = program & ((1u << RENDER_KEY_PROGRAM_BITS) - 1);
+		key = (key << RENDER_KEY_TEXTURES_BITS) | (textures & ((1u << RENDER_KEY_TEXTURES_BITS) - 1));
+		key = (key << RENDER_KEY_VERTEX_ARRAY_BITS) | (vertexArray & ((1u << RENDER_KEY_VERTEX_ARRAY_BITS) - 1));
+		key = (key << RENDER_KEY_DEPTH_BITS) | depth;
+		return key;
+	}
+};
+
+#endif
@@ -10,6 +10,28 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <unordered_map>
+
+// pre-resolved uniform location; setting it does no lookup and builds no strings
+class Uniform
+{
+public:
+	GLint location;
+
+	Uniform(GLint location = -1) : location(location) {}
+
+	bool valid() const { return location != -1; }
+
+	void set(bool value) const { glUniform1i(location, (int)value); }
+	void set(int value) const { glUniform1i(location, value); }
+	void set(float value) const { glUniform1f(location, value); }
+	void set(const glm::vec2& value) const { glUniform2fv(location, 1, &value[0]); }
+	void set(const glm::vec3& value) const { glUniform3fv(location, 1, &value[0]); }
+	void set(const glm::vec4& value) const { glUniform4fv(location, 1, &value[0]); }
+	void set(const glm::mat2& mat) const { glUniformMatrix2fv(location, 1, GL_FALSE, &mat[0][0]); }
+	void set(const glm::mat3& mat) const { glUniformMatrix3fv(location, 1, GL_FALSE, &mat[0][0]); }
+	void set(const glm::mat4& mat) const { glUniformMatrix4fv(location, 1, GL_FALSE, &mat[0][0]); }
+};
 
 class Shader
 {
@@ -59,6 +81,7 @@ public:
 		glDeleteShader(vertex);
 		glDeleteShader(fragment);
 
+		cacheUniforms();
 	}
 
 	void use() const
@@ -66,64 +89,121 @@ public:
 		glUseProgram(ID);
 	}
 
+	// location from the table built at link time, -1 for inactive uniforms
+	GLint location(const std::string& name) const
+	{
+		auto uniform = uniforms.find(name);
+		return uniform != uniforms.end() ? uniform->second : -1;
+	}
+
+	Uniform uniform(const std::string& name) const
+	{
+		return Uniform(location(name));
+	}
+
+	void bindUniformBlock(const std::string& name, GLuint binding) const
+	{
+		GLuint index = glGetUniformBlockIndex(ID, name.c_str());
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(ID, index, binding);
+	}
+
 	void setBool(const std::string& name, bool value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+		glUniform1i(location(name), (int)value);
 	}
 	// ------------------------------------------------------------------------
 	void setInt(const std::string& name, int value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+		glUniform1i(location(name), value);
 	}
 	// ------------------------------------------------------------------------
 	void setFloat(const std::string& name, float value) const
 	{
-		glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+		glUniform1f(location(name), value);
 	}
 	// ------------------------------------------------------------------------
 	void setVec2(const std::string& name, const glm::vec2& value) const
 	{
-		glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform2fv(location(name), 1, &value[0]);
 	}
 	void setVec2(const std::string& name, float x, float y) const
 	{
-		glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+		glUniform2f(location(name), x, y);
 	}
 	// ------------------------------------------------------------------------
 	void setVec3(const std::string& name, const glm::vec3& value) const
 	{
-		glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform3fv(location(name), 1, &value[0]);
 	}
 	void setVec3(const std::string& name, float x, float y, float z) const
 	{
-		glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+		glUniform3f(location(name), x, y, z);
 	}
 	// ------------------------------------------------------------------------
 	void setVec4(const std::string& name, const glm::vec4& value) const
 	{
-		glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform4fv(location(name), 1, &value[0]);
 	}
 	void setVec4(const std::string& name, float x, float y, float z, float w) const
 	{
-		glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+		glUniform4f(location(name), x, y, z, w);
 	}
 	// ------------------------------------------------------------------------
 	void setMat2(const std::string& name, const glm::mat2& mat) const
 	{
-		glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix2fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat3(const std::string& name, const glm::mat3& mat) const
 	{
-		glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat4(const std::string& name, const glm::mat4& mat) const
 	{
-		glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix4fv(location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 
 private:
+	std::unordered_map<std::string, GLint> uniforms;
+
+	void cacheUniforms()
+	{
+		GLint count = 0;
+		GLint maxLength = 0;
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+		std::string name(maxLength > 0 ? maxLength : 1, '\0');
+		for (GLint i = 0; i < count; i++)
+		{
+			GLsizei length = 0;
+			GLint size = 0;
+			GLenum type = 0;
+			glGetActiveUniform(ID, i, maxLength, &length, &size, &type, &name[0]);
+			std::string uniformName = name.substr(0, length);
+
+			GLint uniformLocation = glGetUniformLocation(ID, uniformName.c_str());
+			if (uniformLocation == -1)
+				continue;
+			uniforms[uniformName] = uniformLocation;
+
+			// arrays are reported as "name[0]"; make every element reachable
+			size_t bracket = uniformName.find("[0]");
+			if (bracket != std::string::npos && bracket + 3 == uniformName.size())
+			{
+				std::string base = uniformName.substr(0, bracket);
+				uniforms[base] = uniformLocation;
+				for (GLint element = 1; element < size; element++)
+				{
+					std::string elementName = base + "[" + std::to_string(element) + "]";
+					uniforms[elementName] = glGetUniformLocation(ID, elementName.c_str());
+				}
+			}
+		}
+	}
+
 	void checkCompileErrors(GLuint shader, std::string type)
 	{
 		GLint success;
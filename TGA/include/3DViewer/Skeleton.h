@@ -0,0 +1,375 @@
+#ifndef SKELETON_H
+#define SKELETON_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <assimp/scene.h>
+
+#include <3DViewer/glresources.h>
+#include <3DViewer/vertexlayout.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// texture unit of the bone palette buffer texture, above the units meshes use
+#define BONE_PALETTE_TEXTURE_UNIT 15
+// palette matrices per frame, GL guarantees 65536 texels in a buffer texture
+#define BONE_PALETTE_MAX_MATRICES 16384
+// ticks per second of clips that do not say
+#define SKELETON_DEFAULT_TICKS 25.0f
+
+// a clip and the time into it
+struct SkinPose {
+	unsigned int clip = 0;
+	float seconds = 0.0f;
+};
+
+template <typename T>
+struct SkeletonKey {
+	float time;
+	T value;
+};
+
+// sampled transform of one node over a clip, times in ticks
+struct SkeletonChannel {
+	int node;
+	vector<SkeletonKey<glm::vec3>> positions;
+	vector<SkeletonKey<glm::quat>> rotations;
+	vector<SkeletonKey<glm::vec3>> scales;
+};
+
+struct SkeletonClip {
+	string name;
+	float duration = 0.0f;
+	float ticksPerSecond = SKELETON_DEFAULT_TICKS;
+	vector<SkeletonChannel> channels;
+	// channel animating each node, -1 for nodes keeping their bind transform
+	vector<int> channelOfNode;
+};
+
+// The node hierarchy of an imported scene flattened parents first, the bones the
+// meshes are weighted to and the scene's animations. pose() walks the hierarchy
+// once and writes a palette, one matrix per bone, taking the bind pose positions
+// of skinned vertices to the posed ones in model space.
+class Skeleton
+{
+public:
+	struct Node {
+		string name;
+		glm::mat4 transform;
+		int parent;
+		int bone;
+	};
+
+	vector<Node> nodes;
+	// bind pose model space to bone space, per bone
+	vector<glm::mat4> offsets;
+	vector<SkeletonClip> clips;
+	glm::mat4 globalInverse = glm::mat4(1.0f);
+
+	// the hierarchy and clips of the scene; bones are added while its meshes are processed
+	void build(const aiScene* scene)
+	{
+		nodes.clear();
+		offsets.clear();
+		clips.clear();
+		nodeIndex.clear();
+		addNode(scene->mRootNode, -1);
+		globalInverse = glm::inverse(nodes[0].transform);
+
+		for (unsigned int a = 0; a < scene->mNumAnimations; a++)
+		{
+			const aiAnimation* animation = scene->mAnimations[a];
+			SkeletonClip clip;
+			clip.name = animation->mName.C_Str();
+			clip.duration = static_cast<float>(animation->mDuration);
+			if (animation->mTicksPerSecond > 0.0)
+				clip.ticksPerSecond = static_cast<float>(animation->mTicksPerSecond);
+			clip.channelOfNode.assign(nodes.size(), -1);
+
+			for (unsigned int c = 0; c < animation->mNumChannels; c++)
+			{
+				const aiNodeAnim* source = animation->mChannels[c];
+				auto node = nodeIndex.find(source->mNodeName.C_Str());
+				if (node == nodeIndex.end())
+					continue;
+				SkeletonChannel channel;
+				channel.node = node->second;
+				for (unsigned int k = 0; k < source->mNumPositionKeys; k++)
+				{
+					const aiVectorKey& key = source->mPositionKeys[k];
+					channel.positions.push_back({ float(key.mTime), glm::vec3(key.mValue.x, key.mValue.y, key.mValue.z) });
+				}
+				for (unsigned int k = 0; k < source->mNumRotationKeys; k++)
+				{
+					const aiQuatKey& key = source->mRotationKeys[k];
+					channel.rotations.push_back({ float(key.mTime), glm::quat(key.mValue.w, key.mValue.x, key.mValue.y, key.mValue.z) });
+				}
+				for (unsigned int k = 0; k < source->mNumScalingKeys; k++)
+				{
+					const aiVectorKey& key = source->mScalingKeys[k];
+					channel.scales.push_back({ float(key.mTime), glm::vec3(key.mValue.x, key.mValue.y, key.mValue.z) });
+				}
+				clip.channelOfNode[channel.node] = static_cast<int>(clip.channels.size());
+				clip.channels.push_back(channel);
+			}
+			clips.push_back(clip);
+		}
+	}
+
+	// palette index of the bone, added on first use; -1 if no node has its name
+	int bone(const aiBone* bone)
+	{
+		auto node = nodeIndex.find(bone->mName.C_Str());
+		if (node == nodeIndex.end())
+		{
+			cout << "ERROR::SKELETON:: no node for bone " << bone->mName.C_Str() << endl;
+			return -1;
+		}
+		Node& target = nodes[node->second];
+		if (target.bone < 0)
+		{
+			target.bone = static_cast<int>(offsets.size());
+			offsets.push_back(toGlm(bone->mOffsetMatrix));
+		}
+		return target.bone;
+	}
+
+	size_t boneCount() const
+	{
+		return offsets.size();
+	}
+
+	// boneCount() matrices for the clip at seconds into it, looping; the bind pose
+	// when there is no such clip. Not thread safe, the hierarchy is walked in scratch.
+	void pose(const SkinPose& skinPose, glm::mat4* palette) const
+	{
+		const SkeletonClip* clip = skinPose.clip < clips.size() ? &clips[skinPose.clip] : nullptr;
+		float ticks = clip ? this->ticks(*clip, skinPose.seconds) : 0.0f;
+
+		global.resize(nodes.size());
+		for (size_t n = 0; n < nodes.size(); n++)
+		{
+			int channel = clip ? clip->channelOfNode[n] : -1;
+			glm::mat4 local = channel < 0 ? nodes[n].transform : sample(clip->channels[channel], ticks);
+			global[n] = nodes[n].parent < 0 ? local : global[nodes[n].parent] * local;
+			if (nodes[n].bone >= 0)
+				palette[nodes[n].bone] = globalInverse * global[n] * offsets[nodes[n].bone];
+		}
+	}
+
+	// the time in ticks the clip is sampled at, wrapped into its duration
+	float ticks(const SkeletonClip& clip, float seconds) const
+	{
+		float ticks = std::max(seconds, 0.0f) * clip.ticksPerSecond;
+		return clip.duration > 0.0f ? fmod(ticks, clip.duration) : 0.0f;
+	}
+
+	static glm::mat4 toGlm(const aiMatrix4x4& m)
+	{
+		// aiMatrix4x4 is row major
+		return glm::transpose(glm::make_mat4(&m.a1));
+	}
+
+private:
+	unordered_map<string, int> nodeIndex;
+	mutable vector<glm::mat4> global;
+
+	void addNode(const aiNode* node, int parent)
+	{
+		int index = static_cast<int>(nodes.size());
+		nodes.push_back(Node{ node->mName.C_Str(), toGlm(node->mTransformation), parent, -1 });
+		nodeIndex[nodes.back().name] = index;
+		for (unsigned int i = 0; i < node->mNumChildren; i++)
+			addNode(node->mChildren[i], index);
+	}
+
+	// index of the last key at or before time
+	template <typename T>
+	static size_t keyAt(const vector<SkeletonKey<T>>& keys, float time)
+	{
+		size_t next = upper_bound(keys.begin(), keys.end(), time, [](float t, const SkeletonKey<T>& key) { return t < key.time; }) - keys.begin();
+		return next > 0 ? next - 1 : 0;
+	}
+
+	template <typename T>
+	static float blend(const vector<SkeletonKey<T>>& keys, size_t key, float time)
+	{
+		if (key + 1 >= keys.size())
+			return 0.0f;
+		float span = keys[key + 1].time - keys[key].time;
+		return span > 0.0f ? glm::clamp((time - keys[key].time) / span, 0.0f, 1.0f) : 0.0f;
+	}
+
+	static glm::vec3 sampleVector(const vector<SkeletonKey<glm::vec3>>& keys, float time, const glm::vec3& none)
+	{
+		if (keys.empty())
+			return none;
+		size_t key = keyAt(keys, time);
+		float f = blend(keys, key, time);
+		return f > 0.0f ? glm::mix(keys[key].value, keys[key + 1].value, f) : keys[key].value;
+	}
+
+	static glm::mat4 sample(const SkeletonChannel& channel, float time)
+	{
+		glm::vec3 position = sampleVector(channel.positions, time, glm::vec3(0.0f));
+		glm::vec3 scale = sampleVector(channel.scales, time, glm::vec3(1.0f));
+		glm::quat rotation(1.0f, 0.0f, 0.0f, 0.0f);
+		if (!channel.rotations.empty())
+		{
+			size_t key = keyAt(channel.rotations, time);
+			float f = blend(channel.rotations, key, time);
+			rotation = f > 0.0f ? glm::slerp(channel.rotations[key].value, channel.rotations[key + 1].value, f) : channel.rotations[key].value;
+		}
+		return glm::scale(glm::translate(glm::mat4(1.0f), position) * glm::mat4_cast(glm::normalize(rotation)), scale);
+	}
+};
+
+// keeps the four largest influences of a vertex, weights summing to one
+inline void AddBoneInfluence(Vertex& vertex, int bone, float weight)
+{
+	int slot = -1;
+	for (int i = 0; i < MAX_BONE_INFLUENCE; i++)
+	{
+		if (vertex.m_Weights[i] == 0.0f)
+		{
+			slot = i;
+			break;
+		}
+		if (slot < 0 || vertex.m_Weights[i] < vertex.m_Weights[slot])
+			slot = i;
+	}
+	if (vertex.m_Weights[slot] != 0.0f && vertex.m_Weights[slot] >= weight)
+		return;
+	vertex.m_BoneIDs[slot] = bone;
+	vertex.m_Weights[slot] = weight;
+}
+
+inline void NormalizeBoneWeights(Vertex& vertex)
+{
+	float sum = 0.0f;
+	for (int i = 0; i < MAX_BONE_INFLUENCE; i++)
+		sum += vertex.m_Weights[i];
+	for (int i = 0; i < MAX_BONE_INFLUENCE && sum > 0.0f; i++)
+		vertex.m_Weights[i] /= sum;
+}
+
+// the bone matrices of a palette blended by the vertex's weights, as shader.vs skins
+inline glm::mat4 SkinMatrix(const Vertex& vertex, const glm::mat4* palette)
+{
+	glm::mat4 skin(0.0f);
+	float total = 0.0f;
+	for (int i = 0; i < MAX_BONE_INFLUENCE; i++)
+	{
+		if (vertex.m_Weights[i] <= 0.0f)
+			continue;
+		skin += vertex.m_Weights[i] * palette[vertex.m_BoneIDs[i]];
+		total += vertex.m_Weights[i];
+	}
+	return skin / std::max(total, 1e-4f);
+}
+
+struct BonePaletteStats {
+	unsigned int palettes = 0;
+	unsigned int matrices = 0;
+	unsigned int shared = 0;
+	unsigned int overflows = 0;
+};
+
+// The bone matrices of every skinned instance drawn this frame, in one buffer
+// texture read by shader.vs (samplerBuffer bonePalette, four texels per matrix).
+// Instances find their palette through the index Model::Submit stores in their
+// instance matrix, so skinned instances draw instanced like any other.
+class BonePalette
+{
+public:
+	BonePaletteStats stats;
+	BonePaletteStats frameStats;
+
+	static BonePalette& instance()
+	{
+		static BonePalette* palette = new BonePalette();
+		return *palette;
+	}
+
+	// index of count free matrices this frame, -1 once the palette is full
+	int allocate(size_t count)
+	{
+		if (matrices.size() + count > BONE_PALETTE_MAX_MATRICES)
+		{
+			frameStats.overflows++;
+			return -1;
+		}
+		int first = static_cast<int>(matrices.size());
+		matrices.resize(matrices.size() + count);
+		frameStats.palettes++;
+		frameStats.matrices += static_cast<unsigned int>(count);
+		return first;
+	}
+
+	// invalidated by the next allocate()
+	glm::mat4* data(int first)
+	{
+		return matrices.data() + first;
+	}
+
+	// sends this frame's palettes and binds them to BONE_PALETTE_TEXTURE_UNIT, after
+	// every Submit and before the queue draws; the next frame starts empty
+	void upload()
+	{
+		stats = frameStats;
+		frameStats = BonePaletteStats();
+		if (matrices.empty())
+			return;
+
+		size_t bytes = matrices.size() * sizeof(glm::mat4);
+		if (!buffer)
+			buffer = GLResources::instance().buffer(GL_TEXTURE_BUFFER, 0, NULL, GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, buffer.id());
+		// orphaned like the instance buffers, the previous frame may still read it
+		capacity = std::max(capacity, bytes);
+		glBufferData(GL_TEXTURE_BUFFER, capacity, NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, matrices.data());
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+		glActiveTexture(GL_TEXTURE0 + BONE_PALETTE_TEXTURE_UNIT);
+		if (!texture)
+		{
+			unsigned int name;
+			glGenTextures(1, &name);
+			texture = GLTexture(name, TextureDesc());
+		}
+		glBindTexture(GL_TEXTURE_BUFFER, texture.id());
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer.id());
+		glActiveTexture(GL_TEXTURE0);
+		matrices.clear();
+	}
+
+	// while the context is still current
+	void clear()
+	{
+		matrices.clear();
+		texture.reset();
+		buffer.reset();
+		capacity = 0;
+	}
+
+private:
+	vector<glm::mat4> matrices;
+	GLBuffer buffer;
+	GLTexture texture;
+	size_t capacity = 0;
+
+	BonePalette() {}
+};
+
+#endif
@@ -0,0 +1,1209 @@
+#ifndef SOFTWARE_RENDERER_H
+#define SOFTWARE_RENDERER_H
+
+#include <glm/glm.hpp>
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SOFTWARE_SSE
+#endif
+
+#include <3DViewer/frameuniforms.h>
+#include <3DViewer/frustum.h>
+#include <3DViewer/model.h>
+#include <3DViewer/skeleton.h>
+#include <3DViewer/texturecache.h>
+#include <3DViewer/threadpool.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+using namespace std;
+
+// pixels per side of a binned tile, and of the blocks its hierarchical depth keeps
+#define SOFTWARE_TILE_SIZE 64
+#define SOFTWARE_BLOCK_SIZE 8
+#define SOFTWARE_SUBPIXEL_BITS 4
+// largest target side; with the guard band it keeps the edge functions in 32 bits
+#define SOFTWARE_MAX_SIZE 4096
+// pixels from the screen center beyond which triangles are clipped in x and y
+#define SOFTWARE_GUARD_BAND 6000.0f
+// vertices a worker transforms per job
+#define SOFTWARE_VERTEX_CHUNK 1024
+// material.shininess as setupRenderer sets it
+#define SOFTWARE_SHININESS 32.0f
+#define SOFTWARE_NO_TRIANGLE 0xFFFFFFFFu
+
+// shader.fs for one fragment: the directional light and the spotlight of the Frame
+// block, given what the diffuse and specular maps hold at the fragment. The
+// visibilities scale what each light adds besides its ambient term, 0 in its shadow.
+inline glm::vec3 ShadePhong(const FrameBlock& frame, const glm::vec3& position, const glm::vec3& normal, const glm::vec3& diffuseMap, const glm::vec3& specularMap, float shininess, float dirVisibility = 1.0f, float spotVisibility = 1.0f)
+{
+	glm::vec3 norm = glm::normalize(normal);
+	glm::vec3 viewDir = glm::normalize(frame.viewPos - position);
+
+	const DirLightBlock& dir = frame.dirLight;
+	glm::vec3 lightDir = glm::normalize(-dir.direction);
+	float diff = std::max(glm::dot(norm, lightDir), 0.0f);
+	glm::vec3 reflectDir = glm::reflect(-lightDir, norm);
+	float spec = powf(std::max(glm::dot(viewDir, reflectDir), 0.0f), shininess);
+	glm::vec3 result = dir.ambient * diffuseMap + (dir.diffuse * diff * diffuseMap + dir.specular * spec * specularMap) * dirVisibility;
+
+	// a spotlight that was never set would divide by zero
+	const SpotLightBlock& spot = frame.spotLight;
+	if (spot.constant + spot.linear + spot.quadratic <= 0.0f)
+		return result;
+	lightDir = glm::normalize(spot.position - position);
+	diff = std::max(glm::dot(norm, lightDir), 0.0f);
+	reflectDir = glm::reflect(-lightDir, norm);
+	spec = powf(std::max(glm::dot(viewDir, reflectDir), 0.0f), shininess);
+	float distance = glm::length(spot.position - position);
+	float attenuation = 1.0f / (spot.constant + spot.linear * distance + spot.quadratic * (distance * distance));
+	float theta = glm::dot(lightDir, glm::normalize(-spot.direction));
+	float epsilon = spot.cutOff - spot.outerCutOff;
+	float intensity = glm::clamp((theta - spot.outerCutOff) / epsilon, 0.0f, 1.0f);
+	result += (spot.ambient * diffuseMap + (spot.diffuse * diff * diffuseMap + spot.specular * spec * specularMap) * spotVisibility) * attenuation * intensity;
+	return result;
+}
+
+// a color channel as stored in an RGBA8 target; NaN ends up black, as it does on the GPU
+inline unsigned char ColorByte(float c)
+{
+	return c > 0.0f ? (c < 1.0f ? static_cast<unsigned char>(c * 255.0f + 0.5f) : 255) : 0;
+}
+
+// RGBA8 mip chain of a decoded image, sampled the way UploadImage sets textures up:
+// GL_REPEAT, GL_LINEAR_MIPMAP_LINEAR when minified and GL_LINEAR when magnified
+class SoftwareTexture
+{
+public:
+	SoftwareTexture() {}
+
+	explicit SoftwareTexture(const ImageData& image)
+	{
+		if (!image.pixels || image.width <= 0 || image.height <= 0)
+			return;
+
+		Level base;
+		base.width = image.width;
+		base.height = image.height;
+		base.texels.resize(size_t(image.width) * image.height);
+		const unsigned char* source = image.pixels.get();
+		for (size_t i = 0; i < base.texels.size(); i++)
+		{
+			// one and two channel images upload as GL_RED, read back as (r, 0, 0, 1)
+			const unsigned char* p = source + i * image.components;
+			uint32_t r = p[0];
+			uint32_t g = image.components >= 3 ? p[1] : 0;
+			uint32_t b = image.components >= 3 ? p[2] : 0;
+			uint32_t a = image.components == 4 ? p[3] : 255;
+			base.texels[i] = r | (g << 8) | (b << 16) | (a << 24);
+		}
+		levels.push_back(std::move(base));
+
+		// box filtered halves down to 1x1, as glGenerateMipmap
+		while (levels.back().width > 1 || levels.back().height > 1)
+		{
+			const Level& above = levels.back();
+			Level level;
+			level.width = std::max(above.width / 2, 1);
+			level.height = std::max(above.height / 2, 1);
+			level.texels.resize(size_t(level.width) * level.height);
+			for (int y = 0; y < level.height; y++)
+			{
+				int y0 = std::min(2 * y, above.height - 1);
+				int y1 = std::min(2 * y + 1, above.height - 1);
+				for (int x = 0; x < level.width; x++)
+				{
+					int x0 = std::min(2 * x, above.width - 1);
+					int x1 = std::min(2 * x + 1, above.width - 1);
+					uint32_t texels[4] = { above.texel(x0, y0), above.texel(x1, y0), above.texel(x0, y1), above.texel(x1, y1) };
+					uint32_t average = 0;
+					for (int c = 0; c < 32; c += 8)
+					{
+						uint32_t sum = 2;
+						for (uint32_t texel : texels)
+							sum += (texel >> c) & 0xFF;
+						average |= (sum / 4) << c;
+					}
+					level.texels[size_t(y) * level.width + x] = average;
+				}
+			}
+			levels.push_back(std::move(level));
+		}
+	}
+
+	bool valid() const
+	{
+		return !levels.empty();
+	}
+
+	size_t bytes() const
+	{
+		size_t total = 0;
+		for (const Level& level : levels)
+			total += level.texels.size() * sizeof(uint32_t);
+		return total;
+	}
+
+	// uv with its screen space derivatives, which select the mip levels
+	glm::vec4 sample(const glm::vec2& uv, const glm::vec2& dx, const glm::vec2& dy) const
+	{
+		if (levels.empty())
+			return glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+		glm::vec2 size(levels[0].width, levels[0].height);
+		float rho = std::max(glm::length(dx * size), glm::length(dy * size));
+		if (!(rho > 1.0f))
+			return bilinear(levels[0], uv);
+
+		float lod = std::min(log2f(rho), float(levels.size() - 1));
+		size_t level = static_cast<size_t>(lod);
+		float fraction = lod - level;
+		glm::vec4 finer = bilinear(levels[level], uv);
+		if (fraction <= 0.0f || level + 1 >= levels.size())
+			return finer;
+		return glm::mix(finer, bilinear(levels[level + 1], uv), fraction);
+	}
+
+private:
+	struct Level {
+		int width = 0;
+		int height = 0;
+		vector<uint32_t> texels;
+
+		uint32_t texel(int x, int y) const
+		{
+			return texels[size_t(y) * width + x];
+		}
+	};
+
+	vector<Level> levels;
+
+	static glm::vec4 unpack(uint32_t texel)
+	{
+		return glm::vec4(texel & 0xFF, (texel >> 8) & 0xFF, (texel >> 16) & 0xFF, texel >> 24) * (1.0f / 255.0f);
+	}
+
+	static glm::vec4 bilinear(const Level& level, const glm::vec2& uv)
+	{
+		// wrapped first, so the texel indices stay small
+		float x = (uv.x - floorf(uv.x)) * level.width - 0.5f;
+		float y = (uv.y - floorf(uv.y)) * level.height - 0.5f;
+		float fx = floorf(x);
+		float fy = floorf(y);
+		int x0 = fx < 0.0f ? level.width - 1 : std::min(static_cast<int>(fx), level.width - 1);
+		int y0 = fy < 0.0f ? level.height - 1 : std::min(static_cast<int>(fy), level.height - 1);
+		int x1 = x0 + 1 < level.width ? x0 + 1 : 0;
+		int y1 = y0 + 1 < level.height ? y0 + 1 : 0;
+		float ax = x - fx;
+		float ay = y - fy;
+		glm::vec4 bottom = glm::mix(unpack(level.texel(x0, y0)), unpack(level.texel(x1, y0)), ax);
+		glm::vec4 top = glm::mix(unpack(level.texel(x0, y1)), unpack(level.texel(x1, y1)), ax);
+		return glm::mix(bottom, top, ay);
+	}
+};
+
+// one mesh of a model kept on the CPU at full detail; Mesh binds the first diffuse
+// and specular maps as material.texture_diffuse1 and material.texture_specular1
+struct SoftwareMesh {
+	vector<Vertex> vertices;
+	vector<unsigned int> indices;
+	vector<Texture> textures;
+	Bounds bounds;
+	bool skinned = false;
+	const SoftwareTexture* diffuse = nullptr;
+	const SoftwareTexture* specular = nullptr;
+};
+
+struct SoftwareModel {
+	string path;
+	string directory;
+	vector<SoftwareMesh> meshes;
+	Bounds bounds;
+	Skeleton skeleton;
+
+	size_t triangleCount() const
+	{
+		size_t triangles = 0;
+		for (const SoftwareMesh& mesh : meshes)
+			triangles += mesh.indices.size() / 3;
+		return triangles;
+	}
+};
+
+// Geometry and decoded textures of models without any GL: the mesh cache or Assimp
+// through Model::loadGeometry, on the thread pool, each path and each image once.
+// Textures are keyed the way TextureCache keys them, so models share their images.
+class SoftwareModels
+{
+public:
+	// loads the paths that are not resident yet
+	void load(const vector<string>& paths, ThreadPool& pool = ThreadPool::shared())
+	{
+		auto start = chrono::steady_clock::now();
+		set<string> missing;
+		for (const string& path : paths)
+		{
+			if (!models.count(path))
+				missing.insert(path);
+		}
+
+		vector<future<unique_ptr<SoftwareModel>>> imports;
+		for (const string& path : missing)
+			imports.push_back(pool.submit([path] { return import(path); }));
+
+		vector<SoftwareModel*> loaded;
+		for (future<unique_ptr<SoftwareModel>>& import : imports)
+		{
+			unique_ptr<SoftwareModel> model = import.get();
+			if (!model)
+				continue;
+			loaded.push_back(model.get());
+			models[model->path] = std::move(model);
+		}
+
+		// every image not decoded yet, then the meshes point at them
+		map<string, future<unique_ptr<SoftwareTexture>>> decodes;
+		for (SoftwareModel* model : loaded)
+		{
+			for (const SoftwareMesh& mesh : model->meshes)
+			{
+				for (const Texture& texture : mesh.textures)
+				{
+					string name = TextureCache::key(texture.path, model->directory, false);
+					if (textures.count(name) || decodes.count(name))
+						continue;
+					string path = texture.path;
+					string directory = model->directory;
+					decodes[name] = pool.submit([path, directory] { return make_unique<SoftwareTexture>(DecodeImage(path.c_str(), directory)); });
+				}
+			}
+		}
+		for (auto& decode : decodes)
+		{
+			unique_ptr<SoftwareTexture> texture = decode.second.get();
+			if (!texture->valid())
+				cout << "Texture failed to load at path: " << decode.first << endl;
+			textures[decode.first] = std::move(texture);
+		}
+		for (SoftwareModel* model : loaded)
+		{
+			for (SoftwareMesh& mesh : model->meshes)
+			{
+				for (const Texture& texture : mesh.textures)
+				{
+					const SoftwareTexture* image = textures[TextureCache::key(texture.path, model->directory, false)].get();
+					if (texture.type == "texture_diffuse" && !mesh.diffuse)
+						mesh.diffuse = image;
+					else if (texture.type == "texture_specular" && !mesh.specular)
+						mesh.specular = image;
+				}
+			}
+		}
+		loadMilliseconds += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	}
+
+	const SoftwareModel* get(string const& path) const
+	{
+		auto model = models.find(path);
+		return model == models.end() ? nullptr : model->second.get();
+	}
+
+	void clear()
+	{
+		models.clear();
+		textures.clear();
+		loadMilliseconds = 0.0;
+	}
+
+	void report() const
+	{
+		size_t meshes = 0, triangles = 0, textureBytes = 0;
+		for (const auto& model : models)
+		{
+			meshes += model.second->meshes.size();
+			triangles += model.second->triangleCount();
+		}
+		for (const auto& texture : textures)
+			textureBytes += texture.second->bytes();
+		cout << "SOFTWARE_MODELS:: models: " << models.size() << " meshes: " << meshes << " triangles: " << triangles
+			<< " textures: " << textures.size() << " (" << textureBytes / 1024 << " KB) in " << loadMilliseconds << " ms" << endl;
+	}
+
+private:
+	map<string, unique_ptr<SoftwareModel>> models;
+	map<string, unique_ptr<SoftwareTexture>> textures;
+	double loadMilliseconds = 0.0;
+
+	static unique_ptr<SoftwareModel> import(string const& path)
+	{
+		vector<MeshData> meshes;
+		shared_ptr<MappedFile> cached;
+		unique_ptr<SoftwareModel> model = make_unique<SoftwareModel>();
+		if (!Model::loadGeometry(path, meshes, cached, &model->skeleton))
+			return nullptr;
+
+		model->path = path;
+		model->directory = path.substr(0, path.find_last_of('/'));
+		for (size_t m = 0; m < meshes.size(); m++)
+		{
+			const MeshData& data = meshes[m];
+			SoftwareMesh mesh;
+			mesh.vertices.assign(data.vertexPointer(), data.vertexPointer() + data.vertexCount());
+			// the full detail level is the first range of the index buffer
+			size_t indexCount = data.lods.empty() ? data.indexCount() : data.lods[0].indexCount;
+			mesh.indices.assign(data.indexPointer(), data.indexPointer() + indexCount);
+			mesh.textures = data.textures;
+			mesh.bounds = data.bounds;
+			for (size_t v = 0; v < mesh.vertices.size() && !mesh.skinned; v++)
+				mesh.skinned = mesh.vertices[v].m_Weights[0] > 0.0f;
+			model->bounds = m == 0 ? mesh.bounds : MergeBounds(model->bounds, mesh.bounds);
+			model->meshes.push_back(std::move(mesh));
+		}
+		return model;
+	}
+};
+
+// one placed model, the software counterpart of an instance matrix and its pose
+struct SoftwareDraw {
+	const SoftwareModel* model = nullptr;
+	glm::mat4 transform = glm::mat4(1.0f);
+	SkinPose pose;
+};
+
+struct SoftwareStats {
+	unsigned int workers = 1;
+	unsigned int draws = 0;
+	unsigned int meshesDrawn = 0;
+	unsigned int meshesCulled = 0;
+	// in the meshes drawn, then left after clipping and setup
+	size_t triangles = 0;
+	size_t trianglesBinned = 0;
+	size_t trianglesClipped = 0;
+	size_t binEntries = 0;
+	size_t pixelsShaded = 0;
+	// 8x8 blocks skipped by the hierarchical depth
+	size_t blocksOccluded = 0;
+	unsigned int tiles = 0;
+	unsigned int tilesStolen = 0;
+	float geometryMilliseconds = 0.0f;
+	float rasterMilliseconds = 0.0f;
+};
+
+// CPU backend for hosts without a GPU, drawing SoftwareModels with the lighting of
+// shader.fs. A frame runs in two parallel phases:
+//
+// geometry: vertices are transformed (and skinned) once per visible mesh. Each worker
+//   then takes a contiguous share of the triangles, clips them against the near and
+//   far planes and a guard band, snaps them to 1/16 pixel and bins them into
+//   SOFTWARE_TILE_SIZE tiles. Every worker has bins of its own, so binning takes no
+//   locks, and reading the bins in worker order keeps the submission order.
+// raster: tiles are dealt to per-worker queues, and idle workers steal from the back
+//   of the others'. A tile walks its triangles over 8x8 blocks, skipping blocks whose
+//   farthest depth is nearer than the triangle and blocks outside an edge, and tests
+//   four pixels at a time (SSE2) against integer edge functions with the top-left
+//   rule, so shared edges are drawn once, and against the depth buffer. Only the
+//   nearest triangle of each pixel is kept and shaded afterwards, once: perspective
+//   correct attributes, trilinear texture sampling with analytic derivatives and
+//   ShadePhong.
+//
+// Depth, visibility and the hierarchical depth are per tile and stay in the worker's
+// cache; only the color target is shared. Images come out bottom row first, as from
+// glReadPixels.
+class SoftwareRenderer
+{
+public:
+	SoftwareStats stats;
+
+	// threads besides the calling one
+	void setWorkers(unsigned int count)
+	{
+		pool.reset();
+		if (count > 0)
+			pool = make_unique<ThreadPool>(count);
+		workers.clear();
+		for (unsigned int w = 0; w < workerCount(); w++)
+			workers.push_back(make_unique<Worker>());
+		tileCount = 0;
+	}
+
+	unsigned int workerCount() const
+	{
+		return pool ? pool->size() + 1 : 1;
+	}
+
+	bool resize(int width, int height)
+	{
+		if (width <= 0 || height <= 0 || width > SOFTWARE_MAX_SIZE || height > SOFTWARE_MAX_SIZE)
+		{
+			cout << "ERROR::SOFTWARE:: target must be between 1 and " << SOFTWARE_MAX_SIZE << " pixels on a side" << endl;
+			return false;
+		}
+		this->width = width;
+		this->height = height;
+		color.assign(size_t(width) * height * 4, 0);
+		tileCount = 0;
+		return true;
+	}
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+	// RGBA8, bottom row first
+	const vector<unsigned char>& pixels() const
+	{
+		return color;
+	}
+
+	void render(const FrameBlock& frame, const vector<SoftwareDraw>& draws, const glm::vec3& clearColor)
+	{
+		auto begin = chrono::steady_clock::now();
+		if (workers.empty())
+			setWorkers(0);
+		unsigned int count = workerCount();
+		tilesX = (width + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+		tilesY = (height + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+		if (tileCount != unsigned(tilesX * tilesY))
+		{
+			tileCount = tilesX * tilesY;
+			for (unique_ptr<Worker>& worker : workers)
+				worker->bins.assign(tileCount, vector<uint32_t>());
+		}
+		this->frame = frame;
+		for (unsigned int c = 0; c < 3; c++)
+			clear[c] = ColorByte(clearColor[c]);
+		clear[3] = 255;
+
+		stats = SoftwareStats();
+		stats.workers = count;
+		stats.draws = static_cast<unsigned int>(draws.size());
+		prepare(draws);
+
+		atomic<size_t> nextVertex{ 0 };
+		parallel([&](unsigned int) {
+			for (size_t first = nextVertex.fetch_add(SOFTWARE_VERTEX_CHUNK); first < vertices.size(); first = nextVertex.fetch_add(SOFTWARE_VERTEX_CHUNK))
+				shadeVertices(first, std::min(first + SOFTWARE_VERTEX_CHUNK, vertices.size()));
+		});
+		parallel([&](unsigned int w) {
+			setupTriangles(*workers[w], stats.triangles * w / count, stats.triangles * (w + 1) / count);
+		});
+		auto geometry = chrono::steady_clock::now();
+
+		// neighbouring tiles go to the same worker until someone steals them
+		for (unsigned int tile = 0; tile < tileCount; tile++)
+			workers[size_t(tile) * count / tileCount]->queue.push_back(tile);
+		parallel([&](unsigned int w) {
+			unsigned int tile;
+			while (nextTile(w, tile))
+				rasterTile(*workers[w], tile);
+		});
+
+		for (const unique_ptr<Worker>& worker : workers)
+		{
+			stats.trianglesBinned += worker->triangles.size();
+			stats.trianglesClipped += worker->clippedTriangles;
+			stats.binEntries += worker->binEntries;
+			stats.pixelsShaded += worker->pixelsShaded;
+			stats.blocksOccluded += worker->blocksOccluded;
+			stats.tiles += worker->tiles;
+			stats.tilesStolen += worker->tilesStolen;
+		}
+		auto end = chrono::steady_clock::now();
+		stats.geometryMilliseconds = chrono::duration<float, milli>(geometry - begin).count();
+		stats.rasterMilliseconds = chrono::duration<float, milli>(end - geometry).count();
+	}
+
+	void report() const
+	{
+		cout << "SOFTWARE:: " << width << "x" << height << " workers: " << stats.workers << " draws: " << stats.draws
+			<< " meshes: " << stats.meshesDrawn << " (culled: " << stats.meshesCulled << ")"
+			<< " triangles: " << stats.triangles << " binned: " << stats.trianglesBinned << " (clipped: " << stats.trianglesClipped << ")" << endl;
+		cout << "SOFTWARE:: bin entries: " << stats.binEntries << " blocks occluded: " << stats.blocksOccluded
+			<< " pixels shaded: " << stats.pixelsShaded << " tiles: " << stats.tiles << " (stolen: " << stats.tilesStolen << ")"
+			<< " geometry: " << stats.geometryMilliseconds << " ms raster: " << stats.rasterMilliseconds << " ms" << endl;
+	}
+
+private:
+	// a vertex after the vertex stage of shader.vs
+	struct ShadedVertex {
+		glm::vec4 clip;
+		glm::vec3 world;
+		glm::vec3 normal;
+		glm::vec2 uv;
+	};
+
+	// a visible mesh of a draw, and where its vertices and triangles start
+	struct Item {
+		const SoftwareMesh* mesh;
+		glm::mat4 transform;
+		glm::mat3 normalMatrix;
+		int palette;
+		size_t firstVertex;
+		size_t firstTriangle;
+	};
+
+	// screen space setup of a triangle. Edge k is opposite vertex k, positive inside:
+	// a * x + b * y + c at a pixel center in 1/16 pixels, minus one unless the edge is
+	// a top or left edge. The planes give a value at the origin and its x and y steps.
+	struct Triangle {
+		int32_t a[3];
+		int32_t b[3];
+		int64_t c[3];
+		int minX, minY, maxX, maxY;
+		float zMin;
+		float originX, originY;
+		float z[3];
+		// 1/w, and the second and third barycentric weights over w
+		float q[3];
+		float p1[3];
+		float p2[3];
+		// into vertices, or into the worker's clipped vertices with the high bit set
+		uint32_t vertex[3];
+		const SoftwareMesh* mesh;
+	};
+
+	// a triangle binned to the tile being drawn, with the clipped vertices it may use
+	struct TileTriangle {
+		const Triangle* triangle;
+		const ShadedVertex* clipped;
+	};
+
+	struct Worker {
+		vector<Triangle> triangles;
+		vector<ShadedVertex> clipped;
+		vector<vector<uint32_t>> bins;
+		mutex queueMutex;
+		deque<unsigned int> queue;
+
+		// the tile being drawn
+		vector<TileTriangle> tileTriangles;
+		float depth[SOFTWARE_TILE_SIZE * SOFTWARE_TILE_SIZE];
+		uint32_t visible[SOFTWARE_TILE_SIZE * SOFTWARE_TILE_SIZE];
+		float blockMax[(SOFTWARE_TILE_SIZE / SOFTWARE_BLOCK_SIZE) * (SOFTWARE_TILE_SIZE / SOFTWARE_BLOCK_SIZE)];
+
+		size_t clippedTriangles = 0;
+		size_t binEntries = 0;
+		size_t pixelsShaded = 0;
+		size_t blocksOccluded = 0;
+		unsigned int tiles = 0;
+		unsigned int tilesStolen = 0;
+	};
+
+	static const uint32_t CLIPPED_VERTEX = 0x80000000u;
+	static const int BLOCKS = SOFTWARE_TILE_SIZE / SOFTWARE_BLOCK_SIZE;
+
+	// outcodes: outside the view volume, then outside the guard band
+	enum Outcode : unsigned int {
+		OUT_LEFT = 1, OUT_RIGHT = 2, OUT_BOTTOM = 4, OUT_TOP = 8, OUT_NEAR = 16, OUT_FAR = 32,
+		GUARD_LEFT = 64, GUARD_RIGHT = 128, GUARD_BOTTOM = 256, GUARD_TOP = 512
+	};
+
+	unique_ptr<ThreadPool> pool;
+	vector<unique_ptr<Worker>> workers;
+	int width = 0;
+	int height = 0;
+	int tilesX = 0;
+	int tilesY = 0;
+	unsigned int tileCount = 0;
+	vector<unsigned char> color;
+	unsigned char clear[4] = { 0, 0, 0, 255 };
+	FrameBlock frame = {};
+	glm::mat4 viewProjection = glm::mat4(1.0f);
+	float guardX = 1.0f;
+	float guardY = 1.0f;
+
+	vector<Item> items;
+	vector<glm::mat4> palettes;
+	vector<ShadedVertex> vertices;
+
+	// job(worker) on every worker, the calling thread being worker 0
+	void parallel(const function<void(unsigned int)>& job)
+	{
+		vector<future<void>> done;
+		for (unsigned int w = 1; w < workerCount(); w++)
+			done.push_back(pool->submit([&job, w] { job(w); }));
+		job(0);
+		for (future<void>& d : done)
+			d.get();
+	}
+
+	// visible meshes, their vertex and triangle ranges, and the poses of skinned draws
+	void prepare(const vector<SoftwareDraw>& draws)
+	{
+		viewProjection = frame.projection * frame.view;
+		guardX = SOFTWARE_GUARD_BAND / (0.5f * width);
+		guardY = SOFTWARE_GUARD_BAND / (0.5f * height);
+		Frustum frustum(viewProjection);
+
+		items.clear();
+		palettes.clear();
+		size_t vertexCount = 0;
+		for (const SoftwareDraw& draw : draws)
+		{
+			if (!draw.model)
+				continue;
+			int palette = -1;
+			if (draw.model->skeleton.boneCount() > 0)
+			{
+				palette = static_cast<int>(palettes.size());
+				palettes.resize(palettes.size() + draw.model->skeleton.boneCount());
+				draw.model->skeleton.pose(draw.pose, &palettes[palette]);
+			}
+			glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(draw.transform)));
+			for (const SoftwareMesh& mesh : draw.model->meshes)
+			{
+				if (!frustum.intersects(mesh.bounds, draw.transform))
+				{
+					stats.meshesCulled++;
+					continue;
+				}
+				stats.meshesDrawn++;
+				items.push_back(Item{ &mesh, draw.transform, normalMatrix, mesh.skinned ? palette : -1, vertexCount, stats.triangles });
+				vertexCount += mesh.vertices.size();
+				stats.triangles += mesh.indices.size() / 3;
+			}
+		}
+		vertices.resize(vertexCount);
+
+		for (unique_ptr<Worker>& worker : workers)
+		{
+			worker->triangles.clear();
+			worker->clipped.clear();
+			for (vector<uint32_t>& bin : worker->bins)
+				bin.clear();
+			worker->queue.clear();
+			worker->clippedTriangles = 0;
+			worker->binEntries = 0;
+			worker->pixelsShaded = 0;
+			worker->blocksOccluded = 0;
+			worker->tiles = 0;
+			worker->tilesStolen = 0;
+		}
+	}
+
+	// the item holding a vertex or a triangle
+	size_t itemOf(size_t index, size_t Item::* first) const
+	{
+		size_t lo = 0, hi = items.size();
+		while (hi - lo > 1)
+		{
+			size_t middle = (lo + hi) / 2;
+			if (items[middle].*first <= index)
+				lo = middle;
+			else
+				hi = middle;
+		}
+		return lo;
+	}
+
+	void shadeVertices(size_t first, size_t last)
+	{
+		size_t i = itemOf(first, &Item::firstVertex);
+		for (size_t v = first; v < last; v++)
+		{
+			while (i + 1 < items.size() && items[i + 1].firstVertex <= v)
+				i++;
+			const Item& item = items[i];
+			const Vertex& source = item.mesh->vertices[v - item.firstVertex];
+			glm::vec3 position = source.Position;
+			glm::vec3 normal = source.Normal;
+			if (item.palette >= 0)
+			{
+				glm::mat4 skin = SkinMatrix(source, &palettes[item.palette]);
+				position = glm::vec3(skin * glm::vec4(position, 1.0f));
+				normal = glm::mat3(skin) * normal;
+			}
+
+			ShadedVertex& out = vertices[v];
+			glm::vec4 world = item.transform * glm::vec4(position, 1.0f);
+			out.world = glm::vec3(world);
+			out.normal = item.normalMatrix * normal;
+			out.uv = source.TexCoords;
+			out.clip = viewProjection * world;
+		}
+	}
+
+	unsigned int outcode(const glm::vec4& c) const
+	{
+		unsigned int code = 0;
+		if (c.x < -c.w) code |= OUT_LEFT;
+		if (c.x > c.w) code |= OUT_RIGHT;
+		if (c.y < -c.w) code |= OUT_BOTTOM;
+		if (c.y > c.w) code |= OUT_TOP;
+		if (c.z < -c.w) code |= OUT_NEAR;
+		if (c.z > c.w) code |= OUT_FAR;
+		if (c.x < -guardX * c.w) code |= GUARD_LEFT;
+		if (c.x > guardX * c.w) code |= GUARD_RIGHT;
+		if (c.y < -guardY * c.w) code |= GUARD_BOTTOM;
+		if (c.y > guardY * c.w) code |= GUARD_TOP;
+		return code;
+	}
+
+	void setupTriangles(Worker& worker, size_t first, size_t last)
+	{
+		if (first >= last)
+			return;
+		size_t i = itemOf(first, &Item::firstTriangle);
+		for (size_t t = first; t < last; t++)
+		{
+			while (i + 1 < items.size() && items[i + 1].firstTriangle <= t)
+				i++;
+			const Item& item = items[i];
+			const unsigned int* corner = &item.mesh->indices[(t - item.firstTriangle) * 3];
+			uint32_t index[3];
+			unsigned int codes[3];
+			for (int k = 0; k < 3; k++)
+			{
+				index[k] = static_cast<uint32_t>(item.firstVertex + corner[k]);
+				codes[k] = outcode(vertices[index[k]].clip);
+			}
+			if (codes[0] & codes[1] & codes[2] & (OUT_LEFT | OUT_RIGHT | OUT_BOTTOM | OUT_TOP | OUT_NEAR | OUT_FAR))
+				continue;
+			unsigned int crossed = (codes[0] | codes[1] | codes[2]) & (OUT_NEAR | OUT_FAR | GUARD_LEFT | GUARD_RIGHT | GUARD_BOTTOM | GUARD_TOP);
+			if (crossed)
+				clipTriangle(worker, index, crossed, item.mesh);
+			else
+				setupTriangle(worker, index, item.mesh);
+		}
+	}
+
+	const ShadedVertex& vertexOf(const Worker& worker, uint32_t index) const
+	{
+		return index & CLIPPED_VERTEX ? worker.clipped[index & ~CLIPPED_VERTEX] : vertices[index];
+	}
+
+	static ShadedVertex lerp(const ShadedVertex& a, const ShadedVertex& b, float t)
+	{
+		ShadedVertex v;
+		v.clip = glm::mix(a.clip, b.clip, t);
+		v.world = glm::mix(a.world, b.world, t);
+		v.normal = glm::mix(a.normal, b.normal, t);
+		v.uv = glm::mix(a.uv, b.uv, t);
+		return v;
+	}
+
+	// Sutherland-Hodgman in clip space against the planes crossed, then a fan
+	void clipTriangle(Worker& worker, const uint32_t index[3], unsigned int crossed, const SoftwareMesh* mesh)
+	{
+		ShadedVertex polygons[2][16];
+		int count = 3;
+		for (int k = 0; k < 3; k++)
+			polygons[0][k] = vertexOf(worker, index[k]);
+
+		int current = 0;
+		const unsigned int planes[6] = { OUT_NEAR, OUT_FAR, GUARD_LEFT, GUARD_RIGHT, GUARD_BOTTOM, GUARD_TOP };
+		for (unsigned int plane : planes)
+		{
+			if (!(crossed & plane))
+				continue;
+			auto distance = [&](const glm::vec4& c) {
+				switch (plane)
+				{
+				case OUT_NEAR: return c.z + c.w;
+				case OUT_FAR: return c.w - c.z;
+				case GUARD_LEFT: return guardX * c.w + c.x;
+				case GUARD_RIGHT: return guardX * c.w - c.x;
+				case GUARD_BOTTOM: return guardY * c.w + c.y;
+				default: return guardY * c.w - c.y;
+				}
+			};
+			const ShadedVertex* in = polygons[current];
+			ShadedVertex* out = polygons[1 - current];
+			int outCount = 0;
+			for (int k = 0; k < count; k++)
+			{
+				const ShadedVertex& a = in[k];
+				const ShadedVertex& b = in[(k + 1) % count];
+				float da = distance(a.clip);
+				float db = distance(b.clip);
+				if (da >= 0.0f)
+					out[outCount++] = a;
+				if ((da >= 0.0f) != (db >= 0.0f))
+					out[outCount++] = lerp(a, b, da / (da - db));
+			}
+			count = outCount;
+			current = 1 - current;
+			if (count < 3)
+				return;
+		}
+
+		worker.clippedTriangles++;
+		uint32_t base = static_cast<uint32_t>(worker.clipped.size());
+		worker.clipped.insert(worker.clipped.end(), polygons[current], polygons[current] + count);
+		for (int k = 1; k + 1 < count; k++)
+		{
+			uint32_t fan[3] = { CLIPPED_VERTEX | base, CLIPPED_VERTEX | (base + k), CLIPPED_VERTEX | (base + k + 1) };
+			setupTriangle(worker, fan, mesh);
+		}
+	}
+
+	void setupTriangle(Worker& worker, const uint32_t vertex[3], const SoftwareMesh* mesh)
+	{
+		Triangle t;
+		int32_t x[3], y[3];
+		for (int k = 0; k < 3; k++)
+		{
+			const glm::vec4& c = vertexOf(worker, vertex[k]).clip;
+			float w = 1.0f / c.w;
+			x[k] = static_cast<int32_t>(lrintf((c.x * w * 0.5f + 0.5f) * width * (1 << SOFTWARE_SUBPIXEL_BITS)));
+			y[k] = static_cast<int32_t>(lrintf((c.y * w * 0.5f + 0.5f) * height * (1 << SOFTWARE_SUBPIXEL_BITS)));
+			t.z[k] = c.z * w * 0.5f + 0.5f;
+			t.q[k] = w;
+			t.vertex[k] = vertex[k];
+		}
+
+		// counterclockwise on screen, so that inside is positive for every edge
+		int64_t area = int64_t(x[1] - x[0]) * (y[2] - y[0]) - int64_t(x[2] - x[0]) * (y[1] - y[0]);
+		if (area == 0)
+			return;
+		if (area < 0)
+		{
+			std::swap(x[1], x[2]);
+			std::swap(y[1], y[2]);
+			std::swap(t.z[1], t.z[2]);
+			std::swap(t.q[1], t.q[2]);
+			std::swap(t.vertex[1], t.vertex[2]);
+			area = -area;
+		}
+
+		// pixels whose centers may be covered
+		const int half = 1 << (SOFTWARE_SUBPIXEL_BITS - 1);
+		t.minX = std::max((std::min({ x[0], x[1], x[2] }) - half + (1 << SOFTWARE_SUBPIXEL_BITS) - 1) >> SOFTWARE_SUBPIXEL_BITS, 0);
+		t.minY = std::max((std::min({ y[0], y[1], y[2] }) - half + (1 << SOFTWARE_SUBPIXEL_BITS) - 1) >> SOFTWARE_SUBPIXEL_BITS, 0);
+		t.maxX = std::min((std::max({ x[0], x[1], x[2] }) - half) >> SOFTWARE_SUBPIXEL_BITS, width - 1);
+		t.maxY = std::min((std::max({ y[0], y[1], y[2] }) - half) >> SOFTWARE_SUBPIXEL_BITS, height - 1);
+		if (t.minX > t.maxX || t.minY > t.maxY)
+			return;
+
+		for (int k = 0; k < 3; k++)
+		{
+			int from = (k + 1) % 3;
+			int to = (k + 2) % 3;
+			t.a[k] = y[from] - y[to];
+			t.b[k] = x[to] - x[from];
+			t.c[k] = int64_t(x[from]) * y[to] - int64_t(y[from]) * x[to];
+			bool topLeft = t.a[k] > 0 || (t.a[k] == 0 && t.b[k] < 0);
+			if (!topLeft)
+				t.c[k] -= 1;
+		}
+
+		// planes over the snapped positions, in pixels from vertex 0
+		const float scale = 1.0f / (1 << SOFTWARE_SUBPIXEL_BITS);
+		t.originX = x[0] * scale;
+		t.originY = y[0] * scale;
+		float dx1 = (x[1] - x[0]) * scale, dy1 = (y[1] - y[0]) * scale;
+		float dx2 = (x[2] - x[0]) * scale, dy2 = (y[2] - y[0]) * scale;
+		float inverseArea = 1.0f / (float(area) * scale * scale);
+		auto plane = [&](float* p, float f0, float f1, float f2) {
+			p[0] = f0;
+			p[1] = ((f1 - f0) * dy2 - (f2 - f0) * dy1) * inverseArea;
+			p[2] = ((f2 - f0) * dx1 - (f1 - f0) * dx2) * inverseArea;
+		};
+		float z0 = t.z[0], z1 = t.z[1], z2 = t.z[2];
+		float q0 = t.q[0], q1 = t.q[1], q2 = t.q[2];
+		plane(t.z, z0, z1, z2);
+		plane(t.q, q0, q1, q2);
+		plane(t.p1, 0.0f, q1, 0.0f);
+		plane(t.p2, 0.0f, 0.0f, q2);
+		t.zMin = std::max(std::min({ z0, z1, z2 }), 0.0f);
+		t.mesh = mesh;
+
+		uint32_t id = static_cast<uint32_t>(worker.triangles.size());
+		worker.triangles.push_back(t);
+		bin(worker, t, id);
+	}
+
+	// into every tile the triangle's box overlaps, unless an edge leaves the tile out
+	void bin(Worker& worker, const Triangle& t, uint32_t id)
+	{
+		int tx0 = t.minX / SOFTWARE_TILE_SIZE, tx1 = t.maxX / SOFTWARE_TILE_SIZE;
+		int ty0 = t.minY / SOFTWARE_TILE_SIZE, ty1 = t.maxY / SOFTWARE_TILE_SIZE;
+		for (int ty = ty0; ty <= ty1; ty++)
+		{
+			for (int tx = tx0; tx <= tx1; tx++)
+			{
+				if (tx0 != tx1 || ty0 != ty1)
+				{
+					int x0 = tx * SOFTWARE_TILE_SIZE, x1 = std::min(x0 + SOFTWARE_TILE_SIZE, width) - 1;
+					int y0 = ty * SOFTWARE_TILE_SIZE, y1 = std::min(y0 + SOFTWARE_TILE_SIZE, height) - 1;
+					if (outside(t, x0, y0, x1, y1))
+						continue;
+				}
+				worker.bins[ty * tilesX + tx].push_back(id);
+				worker.binEntries++;
+			}
+		}
+	}
+
+	// no pixel center of the rectangle is inside every edge
+	static bool outside(const Triangle& t, int x0, int y0, int x1, int y1)
+	{
+		const int one = 1 << SOFTWARE_SUBPIXEL_BITS, half = one / 2;
+		for (int k = 0; k < 3; k++)
+		{
+			int64_t x = (t.a[k] > 0 ? x1 : x0) * int64_t(one) + half;
+			int64_t y = (t.b[k] > 0 ? y1 : y0) * int64_t(one) + half;
+			if (t.a[k] * x + t.b[k] * y + t.c[k] < 0)
+				return true;
+		}
+		return false;
+	}
+
+	// the worker's own queue from the front, otherwise another's from the back
+	bool nextTile(unsigned int w, unsigned int& tile)
+	{
+		Worker& self = *workers[w];
+		{
+			lock_guard<mutex> lock(self.queueMutex);
+			if (!self.queue.empty())
+			{
+				tile = self.queue.front();
+				self.queue.pop_front();
+				return true;
+			}
+		}
+		for (size_t i = 1; i < workers.size(); i++)
+		{
+			Worker& victim = *workers[(w + i) % workers.size()];
+			lock_guard<mutex> lock(victim.queueMutex);
+			if (!victim.queue.empty())
+			{
+				tile = victim.queue.back();
+				victim.queue.pop_back();
+				self.tilesStolen++;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void rasterTile(Worker& self, unsigned int tile)
+	{
+		self.tiles++;
+		int x0 = (tile % tilesX) * SOFTWARE_TILE_SIZE;
+		int y0 = (tile / tilesX) * SOFTWARE_TILE_SIZE;
+		int x1 = std::min(x0 + SOFTWARE_TILE_SIZE, width);
+		int y1 = std::min(y0 + SOFTWARE_TILE_SIZE, height);
+
+		// pixels past the target edge can never pass, nor hold a block's depth up
+		for (int y = 0; y < SOFTWARE_TILE_SIZE; y++)
+		{
+			for (int x = 0; x < SOFTWARE_TILE_SIZE; x++)
+				self.depth[y * SOFTWARE_TILE_SIZE + x] = x0 + x < x1 && y0 + y < y1 ? 1.0f : 0.0f;
+		}
+		std::fill(self.visible, self.visible + SOFTWARE_TILE_SIZE * SOFTWARE_TILE_SIZE, SOFTWARE_NO_TRIANGLE);
+		std::fill(self.blockMax, self.blockMax + BLOCKS * BLOCKS, 1.0f);
+		float tileMax = 1.0f;
+
+		self.tileTriangles.clear();
+		for (const unique_ptr<Worker>& source : workers)
+		{
+			for (uint32_t index : source->bins[tile])
+				self.tileTriangles.push_back(TileTriangle{ &source->triangles[index], source->clipped.data() });
+		}
+
+		for (size_t k = 0; k < self.tileTriangles.size(); k++)
+		{
+			const Triangle& t = *self.tileTriangles[k].triangle;
+			if (t.zMin >= tileMax)
+			{
+				self.blocksOccluded++;
+				continue;
+			}
+			int bx0 = (std::max(t.minX, x0) - x0) / SOFTWARE_BLOCK_SIZE, bx1 = (std::min(t.maxX, x1 - 1) - x0) / SOFTWARE_BLOCK_SIZE;
+			int by0 = (std::max(t.minY, y0) - y0) / SOFTWARE_BLOCK_SIZE, by1 = (std::min(t.maxY, y1 - 1) - y0) / SOFTWARE_BLOCK_SIZE;
+			bool wrote = false;
+			for (int by = by0; by <= by1; by++)
+			{
+				for (int bx = bx0; bx <= bx1; bx++)
+				{
+					float& blockMax = self.blockMax[by * BLOCKS + bx];
+					if (t.zMin >= blockMax)
+					{
+						self.blocksOccluded++;
+						continue;
+					}
+					if (rasterBlock(self, t, static_cast<uint32_t>(k), x0, y0, bx * SOFTWARE_BLOCK_SIZE, by * SOFTWARE_BLOCK_SIZE))
+					{
+						blockMax = farthest(self, bx * SOFTWARE_BLOCK_SIZE, by * SOFTWARE_BLOCK_SIZE);
+						wrote = true;
+					}
+				}
+			}
+			if (wrote)
+				tileMax = *std::max_element(self.blockMax, self.blockMax + BLOCKS * BLOCKS);
+		}
+
+		shadeTile(self, x0, y0, x1, y1);
+	}
+
+	static float farthest(const Worker& self, int bx, int by)
+	{
+		float result = 0.0f;
+		for (int y = 0; y < SOFTWARE_BLOCK_SIZE; y++)
+		{
+			const float* row = self.depth + (by + y) * SOFTWARE_TILE_SIZE + bx;
+			for (int x = 0; x < SOFTWARE_BLOCK_SIZE; x++)
+				result = std::max(result, row[x]);
+		}
+		return result;
+	}
+
+	// depth tests one block against the triangle; true if any pixel was taken
+	bool rasterBlock(Worker& self, const Triangle& t, uint32_t id, int x0, int y0, int bx, int by)
+	{
+		const int one = 1 << SOFTWARE_SUBPIXEL_BITS;
+		int px = x0 + bx, py = y0 + by;
+		int32_t e[3], stepX[3], stepY[3];
+		for (int k = 0; k < 3; k++)
+		{
+			int64_t value = t.a[k] * (int64_t(px) * one + one / 2) + t.b[k] * (int64_t(py) * one + one / 2) + t.c[k];
+			stepX[k] = t.a[k] * one;
+			stepY[k] = t.b[k] * one;
+			int64_t reach = std::max<int64_t>(int64_t(stepX[k]) * (SOFTWARE_BLOCK_SIZE - 1), 0) + std::max<int64_t>(int64_t(stepY[k]) * (SOFTWARE_BLOCK_SIZE - 1), 0);
+			if (value + reach < 0)
+				return false;
+			// the sign cannot change within the block beyond this, and stepping stays in range
+			e[k] = static_cast<int32_t>(std::min<int64_t>(std::max<int64_t>(value, -(int64_t(1) << 30)), int64_t(1) << 30));
+		}
+		float dx = px + 0.5f - t.originX, dy = py + 0.5f - t.originY;
+		float z = t.z[0] + t.z[1] * dx + t.z[2] * dy;
+
+		bool wrote = false;
+		float* depthRow = self.depth + by * SOFTWARE_TILE_SIZE + bx;
+		uint32_t* visibleRow = self.visible + by * SOFTWARE_TILE_SIZE + bx;
+#ifdef SOFTWARE_SSE
+		__m128i edge[3], edgeStep[3];
+		for (int k = 0; k < 3; k++)
+		{
+			edge[k] = _mm_setr_epi32(e[k], e[k] + stepX[k], e[k] + 2 * stepX[k], e[k] + 3 * stepX[k]);
+			edgeStep[k] = _mm_set1_epi32(4 * stepX[k]);
+		}
+		__m128 zRow = _mm_setr_ps(z, z + t.z[1], z + 2.0f * t.z[1], z + 3.0f * t.z[1]);
+		__m128 zStep = _mm_set1_ps(4.0f * t.z[1]);
+		__m128 zStepY = _mm_set1_ps(t.z[2]);
+		__m128i ids = _mm_set1_epi32(static_cast<int>(id));
+		__m128i none = _mm_set1_epi32(-1);
+		for (int y = 0; y < SOFTWARE_BLOCK_SIZE; y++)
+		{
+			__m128i e0 = edge[0], e1 = edge[1], e2 = edge[2];
+			__m128 zs = zRow;
+			for (int x = 0; x < SOFTWARE_BLOCK_SIZE; x += 4)
+			{
+				__m128i covered = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(e0, e1), e2), none);
+				__m128 stored = _mm_loadu_ps(depthRow + x);
+				__m128 pass = _mm_and_ps(_mm_castsi128_ps(covered), _mm_cmplt_ps(zs, stored));
+				if (_mm_movemask_ps(pass))
+				{
+					_mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(pass, zs), _mm_andnot_ps(pass, stored)));
+					__m128i taken = _mm_castps_si128(pass);
+					__m128i previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(visibleRow + x));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(visibleRow + x), _mm_or_si128(_mm_and_si128(taken, ids), _mm_andnot_si128(taken, previous)));
+					wrote = true;
+				}
+				e0 = _mm_add_epi32(e0, edgeStep[0]);
+				e1 = _mm_add_epi32(e1, edgeStep[1]);
+				e2 = _mm_add_epi32(e2, edgeStep[2]);
+				zs = _mm_add_ps(zs, zStep);
+			}
+			for (int k = 0; k < 3; k++)
+				edge[k] = _mm_add_epi32(edge[k], _mm_set1_epi32(stepY[k]));
+			zRow = _mm_add_ps(zRow, zStepY);
+			depthRow += SOFTWARE_TILE_SIZE;
+			visibleRow += SOFTWARE_TILE_SIZE;
+		}
+#else
+		for (int y = 0; y < SOFTWARE_BLOCK_SIZE; y++)
+		{
+			int32_t e0 = e[0], e1 = e[1], e2 = e[2];
+			float zs = z;
+			for (int x = 0; x < SOFTWARE_BLOCK_SIZE; x++)
+			{
+				if ((e0 | e1 | e2) >= 0 && zs < depthRow[x])
+				{
+					depthRow[x] = zs;
+					visibleRow[x] = id;
+					wrote = true;
+				}
+				e0 += stepX[0];
+				e1 += stepX[1];
+				e2 += stepX[2];
+				zs += t.z[1];
+			}
+			for (int k = 0; k < 3; k++)
+				e[k] += stepY[k];
+			z += t.z[2];
+			depthRow += SOFTWARE_TILE_SIZE;
+			visibleRow += SOFTWARE_TILE_SIZE;
+		}
+#endif
+		return wrote;
+	}
+
+	void shadeTile(Worker& self, int x0, int y0, int x1, int y1)
+	{
+		for (int y = y0; y < y1; y++)
+		{
+			const uint32_t* visibleRow = self.visible + (y - y0) * SOFTWARE_TILE_SIZE;
+			unsigned char* out = &color[(size_t(y) * width + x0) * 4];
+			for (int x = x0; x < x1; x++, out += 4)
+			{
+				uint32_t id = visibleRow[x - x0];
+				if (id == SOFTWARE_NO_TRIANGLE)
+				{
+					memcpy(out, clear, 4);
+					continue;
+				}
+				glm::vec3 c = shade(self.tileTriangles[id], x + 0.5f, y + 0.5f);
+				out[0] = ColorByte(c.r);
+				out[1] = ColorByte(c.g);
+				out[2] = ColorByte(c.b);
+				out[3] = 255;
+				self.pixelsShaded++;
+			}
+		}
+	}
+
+	// the fragment stage of shader.fs at a pixel center
+	glm::vec3 shade(const TileTriangle& tileTriangle, float px, float py) const
+	{
+		const Triangle& t = *tileTriangle.triangle;
+		const ShadedVertex* v[3];
+		for (int k = 0; k < 3; k++)
+			v[k] = t.vertex[k] & CLIPPED_VERTEX ? &tileTriangle.clipped[t.vertex[k] & ~CLIPPED_VERTEX] : &vertices[t.vertex[k]];
+
+		// perspective correct weights, and their derivatives for the mip level
+		float dx = px - t.originX, dy = py - t.originY;
+		float q = t.q[0] + t.q[1] * dx + t.q[2] * dy;
+		float b1 = (t.p1[0] + t.p1[1] * dx + t.p1[2] * dy) / q;
+		float b2 = (t.p2[0] + t.p2[1] * dx + t.p2[2] * dy) / q;
+		float b0 = 1.0f - b1 - b2;
+		glm::vec2 uv = b0 * v[0]->uv + b1 * v[1]->uv + b2 * v[2]->uv;
+		glm::vec2 uv1 = v[1]->uv - v[0]->uv, uv2 = v[2]->uv - v[0]->uv;
+		glm::vec2 uvdx = uv1 * ((t.p1[1] - b1 * t.q[1]) / q) + uv2 * ((t.p2[1] - b2 * t.q[1]) / q);
+		glm::vec2 uvdy = uv1 * ((t.p1[2] - b1 * t.q[2]) / q) + uv2 * ((t.p2[2] - b2 * t.q[2]) / q);
+
+		glm::vec3 position = b0 * v[0]->world + b1 * v[1]->world + b2 * v[2]->world;
+		glm::vec3 normal = b0 * v[0]->normal + b1 * v[1]->normal + b2 * v[2]->normal;
+		// without a map the unit samples an incomplete texture, black
+		glm::vec3 diffuse = t.mesh->diffuse ? glm::vec3(t.mesh->diffuse->sample(uv, uvdx, uvdy)) : glm::vec3(0.0f);
+		glm::vec3 specular = t.mesh->specular ? glm::vec3(t.mesh->specular->sample(uv, uvdx, uvdy)) : glm::vec3(0.0f);
+		return ShadePhong(frame, position, normal, diffuse, specular, SOFTWARE_SHININESS);
+	}
+};
+
+#endif
@@ -0,0 +1,364 @@
+#ifndef STATIC_BATCH_H
+#define STATIC_BATCH_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <3DViewer/frustum.h>
+#include <3DViewer/glresources.h>
+#include <3DViewer/mesh.h>
+#include <3DViewer/model.h>
+#include <3DViewer/modelmanager.h>
+#include <3DViewer/renderqueue.h>
+#include <3DViewer/shader.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+// the buffer texture of baked ambient occlusion shader.vs reads, see AmbientOcclusion.h
+#define AMBIENT_OCCLUSION_TEXTURE_UNIT 14
+
+// an object that never moves, with the matrix it is drawn with and, per mesh, the
+// ambient occlusion baked for its vertices (empty when it has none)
+struct StaticObject {
+	string name;
+	ModelHandle model;
+	glm::mat4 transform;
+	vector<vector<unsigned char>> occlusion;
+};
+
+struct StaticBatchStats {
+	unsigned int batches = 0;
+	unsigned int objects = 0;
+	unsigned int meshes = 0;
+	size_t triangles = 0;
+	size_t occludedVertices = 0;
+};
+
+// Merges the meshes of static objects that share a texture set into one world space
+// mesh each, drawn as a single instance. The source models stay resident for their
+// textures and for objects split back out with remove(). Batches keep the full
+// detail level only, and use unquantized positions, since a batch spans the scene.
+// The baked occlusion of every batch goes in one R8 buffer texture, a texel per
+// vertex, and each batch mesh is told where its vertices start.
+class StaticBatcher
+{
+public:
+	StaticBatchStats stats;
+
+	// replaces the current batches; skinned objects, and objects whose geometry
+	// cannot be reloaded, are left out and keep drawing through their models
+	void build(const vector<StaticObject>& objects)
+	{
+		clear();
+		if (!identity)
+		{
+			glm::mat4 matrix(1.0f);
+			identity = GLResources::instance().buffer(GL_ARRAY_BUFFER, sizeof(glm::mat4), &matrix);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+		Sources sources;
+		map<vector<unsigned int>, vector<Part>> groups;
+		for (const StaticObject& object : objects)
+		{
+			Model* model = ModelManager::instance().get(object.model);
+			if (!model || model->skinned() || !load(*model, sources))
+				continue;
+			for (unsigned int m = 0; m < model->meshes.size(); m++)
+				groups[model->meshes[m].textureSet()].push_back(Part{ object, m });
+		}
+
+		// every mesh of a batched object is in some batch, even alone in its group
+		for (auto& group : groups)
+		{
+			unique_ptr<Batch> batch = make_unique<Batch>();
+			batch->parts = group.second;
+			merge(*batch, sources);
+			batches.push_back(std::move(batch));
+		}
+		uploadOcclusion();
+		updateStats();
+	}
+
+	bool contains(string const& name) const
+	{
+		for (const unique_ptr<Batch>& batch : batches)
+		{
+			for (const Part& part : batch->parts)
+			{
+				if (part.object.name == name)
+					return true;
+			}
+		}
+		return false;
+	}
+
+	// takes the object out of its batches, which are merged again without it; if
+	// that fails every batch is dropped and takeOrphans() lists the objects
+	void remove(string const& name)
+	{
+		Sources sources;
+		for (size_t b = 0; b < batches.size();)
+		{
+			Batch& batch = *batches[b];
+			size_t before = batch.parts.size();
+			batch.parts.erase(std::remove_if(batch.parts.begin(), batch.parts.end(), [&name](const Part& part) { return part.object.name == name; }), batch.parts.end());
+			if (batch.parts.size() == before)
+			{
+				b++;
+				continue;
+			}
+			if (batch.parts.empty())
+			{
+				batches.erase(batches.begin() + b);
+				continue;
+			}
+			for (const Part& part : batch.parts)
+			{
+				Model* model = ModelManager::instance().get(part.object.model);
+				if (!model || !load(*model, sources))
+				{
+					orphanAll();
+					return;
+				}
+			}
+			merge(batch, sources);
+			b++;
+		}
+		uploadOcclusion();
+		updateStats();
+	}
+
+	// objects that lost their batches in remove() and must be drawn on their own
+	vector<string> takeOrphans()
+	{
+		vector<string> taken;
+		taken.swap(orphans);
+		return taken;
+	}
+
+	void Submit(RenderQueue& queue, Shader& shader, const Frustum& frustum, CullingStats& cullingStats)
+	{
+		if (occlusionTexture)
+		{
+			glActiveTexture(GL_TEXTURE0 + AMBIENT_OCCLUSION_TEXTURE_UNIT);
+			glBindTexture(GL_TEXTURE_BUFFER, occlusionTexture.id());
+			glActiveTexture(GL_TEXTURE0);
+		}
+		for (unique_ptr<Batch>& batch : batches)
+		{
+			if (!frustum.intersects(batch->mesh->bounds, glm::mat4(1.0f)))
+			{
+				cullingStats.meshesCulled++;
+				continue;
+			}
+			cullingStats.meshesDrawn++;
+			float distance = std::max(queue.distance(batch->mesh->bounds.center) - batch->mesh->bounds.radius, 0.0f);
+			queue.add(shader, *batch->mesh, 1, 0, distance);
+		}
+	}
+
+	void clear()
+	{
+		batches.clear();
+		orphans.clear();
+		occlusionTexture.reset();
+		occlusionBuffer.reset();
+		stats = StaticBatchStats();
+	}
+
+	void report() const
+	{
+		cout << "STATIC_BATCH:: batches: " << stats.batches << " objects: " << stats.objects
+			<< " meshes: " << stats.meshes << " triangles: " << stats.triangles << " occluded vertices: " << stats.occludedVertices << endl;
+	}
+
+private:
+	// one mesh of one object
+	struct Part {
+		StaticObject object;
+		unsigned int mesh;
+	};
+
+	struct Batch {
+		vector<Part> parts;
+		unique_ptr<Mesh> mesh;
+		// a byte per vertex, empty when no part has any
+		vector<unsigned char> occlusion;
+	};
+
+	vector<unique_ptr<Batch>> batches;
+	vector<string> orphans;
+	GLBuffer identity;
+	GLBuffer occlusionBuffer;
+	GLTexture occlusionTexture;
+
+	// reloaded geometry by model path, with the cache mappings it points into
+	struct Sources {
+		map<string, vector<MeshData>> meshes;
+		vector<shared_ptr<MappedFile>> mapped;
+	};
+
+	// the geometry comes from the mesh cache, since uploaded meshes keep none on the CPU
+	static bool load(const Model& model, Sources& sources)
+	{
+		if (sources.meshes.count(model.path))
+			return true;
+		vector<MeshData> meshes;
+		shared_ptr<MappedFile> cached;
+		if (!Model::loadGeometry(model.path, meshes, cached) || meshes.size() != model.meshes.size())
+		{
+			cout << "ERROR::STATIC_BATCH:: could not reload geometry of " << model.path << endl;
+			return false;
+		}
+		sources.mapped.push_back(cached);
+		sources.meshes[model.path] = std::move(meshes);
+		return true;
+	}
+
+	// bakes the transforms of the parts into one mesh; every part's model is loaded
+	void merge(Batch& batch, const Sources& sources)
+	{
+		vector<Vertex> vertices;
+		vector<unsigned int> indices;
+		vector<Texture> textures;
+		batch.occlusion.clear();
+		bool occluded = false;
+
+		for (const Part& part : batch.parts)
+		{
+			Model* model = ModelManager::instance().get(part.object.model);
+			const MeshData& data = sources.meshes.at(model->path)[part.mesh];
+			if (textures.empty())
+				textures = model->meshes[part.mesh].textures;
+
+			glm::mat3 linear(part.object.transform);
+			glm::mat3 normalMatrix = glm::transpose(glm::inverse(linear));
+			unsigned int base = static_cast<unsigned int>(vertices.size());
+			const Vertex* sourceVertices = data.vertexPointer();
+			for (size_t v = 0; v < data.vertexCount(); v++)
+			{
+				Vertex vertex = sourceVertices[v];
+				vertex.Position = glm::vec3(part.object.transform * glm::vec4(vertex.Position, 1.0f));
+				vertex.Normal = safeNormalize(normalMatrix * vertex.Normal);
+				vertex.Tangent = safeNormalize(linear * vertex.Tangent);
+				vertex.Bitangent = safeNormalize(linear * vertex.Bitangent);
+				vertices.push_back(vertex);
+			}
+
+			// open where the bake is missing or was made for other vertices
+			const vector<vector<unsigned char>>& baked = part.object.occlusion;
+			if (part.mesh < baked.size() && baked[part.mesh].size() == data.vertexCount())
+			{
+				batch.occlusion.insert(batch.occlusion.end(), baked[part.mesh].begin(), baked[part.mesh].end());
+				occluded = true;
+			}
+			else
+				batch.occlusion.resize(vertices.size(), 255);
+
+			// the full detail level is the first range of the index buffer
+			size_t indexCount = data.lods.empty() ? data.indexCount() : data.lods[0].indexCount;
+			const unsigned int* sourceIndices = data.indexPointer();
+			for (size_t i = 0; i < indexCount; i++)
+				indices.push_back(base + sourceIndices[i]);
+		}
+
+		VertexLayout layout = VertexLayout::active();
+		layout.quantizePositions = false;
+		batch.mesh = make_unique<Mesh>(std::move(vertices), std::move(indices), textures, false, layout);
+		batch.mesh->setupInstancing(identity.id());
+		if (!occluded)
+			vector<unsigned char>().swap(batch.occlusion);
+	}
+
+	// the occlusion of every batch in one buffer texture, replacing the previous one
+	void uploadOcclusion()
+	{
+		size_t texels = 0;
+		for (const unique_ptr<Batch>& batch : batches)
+		{
+			batch->mesh->setOcclusion(-1);
+			texels += batch->occlusion.size();
+		}
+		occlusionTexture.reset();
+		occlusionBuffer.reset();
+		if (texels == 0)
+			return;
+
+		GLint limit = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &limit);
+		if (texels > size_t(limit))
+		{
+			cout << "ERROR::STATIC_BATCH:: " << texels << " occluded vertices exceed the buffer texture limit of " << limit << ", drawing without occlusion" << endl;
+			return;
+		}
+
+		vector<unsigned char> occlusion;
+		occlusion.reserve(texels);
+		for (const unique_ptr<Batch>& batch : batches)
+		{
+			if (batch->occlusion.empty())
+				continue;
+			batch->mesh->setOcclusion(static_cast<int>(occlusion.size()));
+			occlusion.insert(occlusion.end(), batch->occlusion.begin(), batch->occlusion.end());
+		}
+		occlusionBuffer = GLResources::instance().buffer(GL_TEXTURE_BUFFER, occlusion.size(), occlusion.data());
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+		unsigned int name;
+		glGenTextures(1, &name);
+		occlusionTexture = GLTexture(name, TextureDesc());
+		glActiveTexture(GL_TEXTURE0 + AMBIENT_OCCLUSION_TEXTURE_UNIT);
+		glBindTexture(GL_TEXTURE_BUFFER, occlusionTexture.id());
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R8, occlusionBuffer.id());
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	// gives up on batching, every batched object draws through its model again
+	void orphanAll()
+	{
+		for (const unique_ptr<Batch>& batch : batches)
+		{
+			for (const Part& part : batch->parts)
+			{
+				if (find(orphans.begin(), orphans.end(), part.object.name) == orphans.end())
+					orphans.push_back(part.object.name);
+			}
+		}
+		batches.clear();
+		occlusionTexture.reset();
+		occlusionBuffer.reset();
+		updateStats();
+	}
+
+	void updateStats()
+	{
+		stats = StaticBatchStats();
+		vector<string> names;
+		for (const unique_ptr<Batch>& batch : batches)
+		{
+			stats.batches++;
+			stats.meshes += static_cast<unsigned int>(batch->parts.size());
+			stats.triangles += batch->mesh->triangleCount();
+			stats.occludedVertices += batch->occlusion.size();
+			for (const Part& part : batch->parts)
+				names.push_back(part.object.name);
+		}
+		sort(names.begin(), names.end());
+		stats.objects = static_cast<unsigned int>(unique(names.begin(), names.end()) - names.begin());
+	}
+
+	static glm::vec3 safeNormalize(const glm::vec3& v)
+	{
+		float length = glm::length(v);
+		return length > 0.0f ? v / length : v;
+	}
+};
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#define STB_IMAGE_IMPLEMENTATION
+
+#include <glad/glad.h>
+
+#include <3DViewer/glresources.h>
+
+#include <stb_image/stb_image.h>
+
+#include <filesystem>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// decoded texture pixels, ready for glTexImage2D
+struct ImageData {
+	string path;
+	int width = 0;
+	int height = 0;
+	int components = 0;
+	shared_ptr<unsigned char> pixels;
+};
+
+ImageData DecodeImage(const char* path, const string& directory);
+GLTexture UploadImage(const ImageData& image, bool gamma = false);
+
+struct TextureCacheStats {
+	unsigned int textures = 0;
+	unsigned int references = 0;
+	unsigned int decodes = 0;
+	unsigned int decodesSkipped = 0;
+	size_t bytesResident = 0;
+	size_t bytesSaved = 0;
+};
+
+struct ResidentTexture {
+	string name;
+	unsigned int references = 0;
+	size_t bytes = 0;
+};
+
+// Process wide registry of GL textures, keyed by canonical absolute path and gamma
+// flag. Loader threads call request() so each image is decoded once no matter how
+// many models reference it; the GL thread calls acquire(), which uploads on first
+// use and otherwise only bumps the reference count. release() retires the texture
+// to GLResources once the last model using it lets go, and releaseUnacquired() drops
+// decoded images no upload took.
+class TextureCache
+{
+public:
+	static TextureCache& instance()
+	{
+		static TextureCache cache;
+		return cache;
+	}
+
+	static string key(string const& path, string const& directory, bool gamma)
+	{
+		std::error_code error;
+		filesystem::path file = filesystem::absolute(filesystem::path(directory) / path, error);
+		if (!error)
+		{
+			filesystem::path canonical = filesystem::weakly_canonical(file, error);
+			if (!error)
+				file = canonical;
+		}
+		return file.generic_string() + (gamma ? "|srgb" : "|linear");
+	}
+
+	// any thread: decodes the image unless it is resident or another thread has it
+	void request(string const& path, string const& directory, bool gamma)
+	{
+		string name = key(path, directory, gamma);
+		shared_ptr<promise<ImageData>> decoded;
+		{
+			lock_guard<mutex> lock(entriesMutex);
+			TextureEntry& entry = entries[name];
+			if (entry.resident || entry.image.valid())
+			{
+				stats.decodesSkipped++;
+				return;
+			}
+			decoded = make_shared<promise<ImageData>>();
+			entry.image = decoded->get_future().share();
+			stats.decodes++;
+		}
+		decoded->set_value(DecodeImage(path.c_str(), directory));
+	}
+
+	// GL thread: returns the texture for the image, uploading it the first time
+	unsigned int acquire(string const& path, string const& directory, bool gamma)
+	{
+		string name = key(path, directory, gamma);
+		shared_future<ImageData> image;
+		{
+			lock_guard<mutex> lock(entriesMutex);
+			TextureEntry& entry = entries[name];
+			if (entry.resident)
+			{
+				entry.references++;
+				stats.references++;
+				stats.bytesSaved += entry.bytes;
+				return entry.texture.id();
+			}
+			image = entry.image;
+		}
+
+		// nobody requested it ahead of time, decode here
+		ImageData pixels = image.valid() ? image.get() : DecodeImage(path.c_str(), directory);
+		GLTexture texture = UploadImage(pixels, gamma);
+		unsigned int id = texture.id();
+
+		lock_guard<mutex> lock(entriesMutex);
+		TextureEntry& entry = entries[name];
+		entry.texture = std::move(texture);
+		entry.references = 1;
+		entry.resident = true;
+		entry.image = shared_future<ImageData>();
+		// with the mip chain, a third on top of the base level
+		entry.bytes = size_t(pixels.width) * pixels.height * pixels.components * 4 / 3;
+		names[id] = name;
+		stats.textures++;
+		stats.references++;
+		stats.bytesResident += entry.bytes;
+		return id;
+	}
+
+	void release(unsigned int id)
+	{
+		lock_guard<mutex> lock(entriesMutex);
+		auto name = names.find(id);
+		if (name == names.end())
+			return;
+
+		TextureEntry& entry = entries[name->second];
+		stats.references--;
+		if (--entry.references > 0)
+			return;
+
+		stats.textures--;
+		stats.bytesResident -= entry.bytes;
+		entries.erase(name->second);
+		names.erase(name);
+	}
+
+	// drops the images requested but never acquired, e.g. of models whose load was
+	// abandoned; only once the imports that requested them are done
+	void releaseUnacquired()
+	{
+		lock_guard<mutex> lock(entriesMutex);
+		for (auto entry = entries.begin(); entry != entries.end();)
+		{
+			if (entry->second.resident)
+				entry++;
+			else
+				entry = entries.erase(entry);
+		}
+	}
+
+	TextureCacheStats getStats()
+	{
+		lock_guard<mutex> lock(entriesMutex);
+		return stats;
+	}
+
+	vector<ResidentTexture> resident()
+	{
+		lock_guard<mutex> lock(entriesMutex);
+		vector<ResidentTexture> textures;
+		for (const auto& entry : entries)
+		{
+			if (!entry.second.resident)
+				continue;
+			ResidentTexture texture;
+			texture.name = entry.first;
+			texture.references = entry.second.references;
+			texture.bytes = entry.second.bytes;
+			textures.push_back(texture);
+		}
+		return textures;
+	}
+
+	void report()
+	{
+		TextureCacheStats current = getStats();
+		cout << "TEXTURE_CACHE:: textures: " << current.textures << " references: " << current.references
+			<< " decoded: " << current.decodes << " decodes skipped: " << current.decodesSkipped
+			<< " resident: " << current.bytesResident / 1024 << " KB saved: " << current.bytesSaved / 1024 << " KB" << endl;
+	}
+
+private:
+	struct TextureEntry {
+		GLTexture texture;
+		unsigned int references = 0;
+		size_t bytes = 0;
+		bool resident = false;
+		shared_future<ImageData> image;
+	};
+
+	unordered_map<string, TextureEntry> entries;
+	unordered_map<unsigned int, string> names;
+	TextureCacheStats stats;
+	mutex entriesMutex;
+
+	TextureCache() {}
+};
+
+
+ImageData DecodeImage(const char* path, const string& directory)
+{
+	string filename = string(path);
+	filename = directory + '/' + filename;
+
+	ImageData image;
+	image.path = path;
+	unsigned char* data = stbi_load(filename.c_str(), &image.width, &image.height, &image.components, 0);
+	if (data)
+		image.pixels = shared_ptr<unsigned char>(data, stbi_image_free);
+	return image;
+}
+
+// takes a pooled texture of the same size and format when there is one; with gamma
+// the colors are sRGB and the sampler returns them linear
+GLTexture UploadImage(const ImageData& image, bool gamma)
+{
+	TextureDesc desc;
+	if (image.pixels)
+	{
+		desc.width = image.width;
+		desc.height = image.height;
+		if (image.components == 1)
+			desc.format = GL_RED;
+		else if (image.components == 3)
+			desc.format = GL_RGB;
+		else if (image.components == 4)
+			desc.format = GL_RGBA;
+		desc.internalFormat = desc.format;
+		if (gamma && desc.format == GL_RGB)
+			desc.internalFormat = GL_SRGB8;
+		else if (gamma && desc.format == GL_RGBA)
+			desc.internalFormat = GL_SRGB8_ALPHA8;
+	}
+	GLTexture texture = GLResources::instance().texture(desc, image.pixels.get());
+
+	if (image.pixels)
+	{
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	}
+	else
+	{
+		std::cout << "Texture failed to load at path: " << image.path << std::endl;
+	}
+
+	return texture;
+}
+#endif
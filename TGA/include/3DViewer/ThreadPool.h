@@ -0,0 +1,92 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// fixed set of worker threads consuming a FIFO of jobs
+class ThreadPool
+{
+public:
+	ThreadPool(unsigned int count = 0)
+	{
+		if (count == 0)
+			count = max(1u, thread::hardware_concurrency());
+
+		for (unsigned int i = 0; i < count; i++)
+			workers.emplace_back([this] { work(); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			lock_guard<mutex> lock(jobsMutex);
+			stopping = true;
+		}
+		jobsReady.notify_all();
+		for (thread& worker : workers)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	static ThreadPool& shared()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
+
+	template<class F>
+	auto submit(F&& job) -> future<decltype(job())>
+	{
+		using Result = decltype(job());
+		auto task = make_shared<packaged_task<Result()>>(std::forward<F>(job));
+		future<Result> result = task->get_future();
+		{
+			lock_guard<mutex> lock(jobsMutex);
+			jobs.push([task] { (*task)(); });
+		}
+		jobsReady.notify_one();
+		return result;
+	}
+
+	unsigned int size() const
+	{
+		return static_cast<unsigned int>(workers.size());
+	}
+
+private:
+	vector<thread> workers;
+	queue<function<void()>> jobs;
+	mutex jobsMutex;
+	condition_variable jobsReady;
+	bool stopping = false;
+
+	void work()
+	{
+		while (true)
+		{
+			function<void()> job;
+			{
+				unique_lock<mutex> lock(jobsMutex);
+				jobsReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (stopping && jobs.empty())
+					return;
+				job = std::move(jobs.front());
+				jobs.pop();
+			}
+			job();
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,622 @@
+#ifndef TRIANGLE_BVH_H
+#define TRIANGLE_BVH_H
+
+#include <glm/glm.hpp>
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#include <xmmintrin.h>
+#define BVH_SSE
+#endif
+
+#include <3DViewer/threadpool.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// centroid bins per axis when looking for the cheapest split
+#define BVH_BINS 16
+// ranges this small become leaves unless splitting them is cheaper
+#define BVH_LEAF_SIZE 8
+// deeper ranges become leaves whatever their size, bounding the traversal stack
+#define BVH_MAX_DEPTH 64
+#define BVH_STACK_SIZE 256
+// ranges at least this large are split by whichever worker is free
+#define BVH_TASK_SIZE 4096
+// triangles a worker bounds or copies per job
+#define BVH_CHUNK 4096
+#define BVH_NO_HIT 0xFFFFFFFFu
+
+// a ray and the part of it that counts, tMin < t < tMax
+struct BvhRay {
+	glm::vec3 origin = glm::vec3(0.0f);
+	glm::vec3 direction = glm::vec3(0.0f, 0.0f, -1.0f);
+	float tMin = 0.0f;
+	float tMax = FLT_MAX;
+	glm::vec3 inverse = glm::vec3(0.0f);
+	// which corner of a box the ray enters through, per axis
+	int near[3] = { 0, 0, 0 };
+
+	BvhRay() {}
+
+	BvhRay(const glm::vec3& origin, const glm::vec3& direction, float tMin, float tMax) : origin(origin), direction(direction), tMin(tMin), tMax(tMax)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			// no infinities, so empty slots and flat boxes never give NaN
+			float d = direction[axis];
+			inverse[axis] = 1.0f / (fabsf(d) > 1e-20f ? d : (d < 0.0f ? -1e-20f : 1e-20f));
+			near[axis] = inverse[axis] < 0.0f ? 1 : 0;
+		}
+	}
+};
+
+// u and v weigh the second and third corners; triangle is its index in build()
+struct BvhHit {
+	float t = 0.0f;
+	float u = 0.0f;
+	float v = 0.0f;
+	uint32_t triangle = BVH_NO_HIT;
+};
+
+struct BvhStats {
+	size_t triangles = 0;
+	// the binary tree of SAH splits, and the four wide tree traced
+	size_t binaryNodes = 0;
+	size_t nodes = 0;
+	size_t leaves = 0;
+	unsigned int tasks = 0;
+	float buildMilliseconds = 0.0f;
+};
+
+// Bounding volume hierarchy over triangles given by their corners, for the CPU ray
+// tracer and the ambient occlusion baker. build() splits ranges of triangles where
+// binned SAH finds them cheapest: ranges of BVH_TASK_SIZE triangles or more go on a
+// shared stack any worker takes from, smaller ones are split to the end by the worker
+// that took them. The binary tree is then collapsed into nodes of four children,
+// whose boxes a ray tests at once (SSE), and the triangles are stored in leaf order.
+// Tracing only reads, from any number of threads.
+class TriangleBVH
+{
+public:
+	BvhStats stats;
+
+	// three corners per triangle, on the pool's workers and the calling thread
+	void build(const vector<glm::vec3>& corners, ThreadPool* pool = nullptr)
+	{
+		auto start = chrono::steady_clock::now();
+		this->pool = pool;
+		clear();
+		size_t count = corners.size() / 3;
+		stats.triangles = count;
+		if (count == 0)
+			return;
+
+		boxes.resize(count);
+		centroids.resize(count);
+		parallelChunks(count, [&](size_t first, size_t last) {
+			for (size_t t = first; t < last; t++)
+			{
+				Box box;
+				for (int k = 0; k < 3; k++)
+					box.grow(corners[t * 3 + k]);
+				boxes[t] = box;
+				centroids[t] = 0.5f * (box.lo + box.hi);
+			}
+		});
+
+		// a tree whose leaves hold at least one triangle has fewer than 2n nodes
+		order.resize(count);
+		iota(order.begin(), order.end(), 0u);
+		buildNodes.resize(2 * count);
+		nextNode = 1;
+		tasks.assign(1, BuildTask{ 0, 0, static_cast<uint32_t>(count), 0 });
+		pendingTasks = 1;
+		atomic<unsigned int> taken{ 0 };
+		parallel([&] {
+			while (true)
+			{
+				BuildTask task;
+				bool found = false;
+				{
+					lock_guard<mutex> lock(taskMutex);
+					if (!tasks.empty())
+					{
+						task = tasks.back();
+						tasks.pop_back();
+						found = true;
+					}
+				}
+				if (!found)
+				{
+					// others may still push the halves of what they split
+					if (pendingTasks == 0)
+						return;
+					this_thread::yield();
+					continue;
+				}
+				taken++;
+				build(task);
+				pendingTasks--;
+			}
+		});
+		stats.tasks = taken;
+		stats.binaryNodes = nextNode;
+
+		nodes.reserve(stats.binaryNodes / 2 + 1);
+		collapse(0);
+		stats.nodes = nodes.size();
+
+		triangles.resize(count);
+		parallelChunks(count, [&](size_t first, size_t last) {
+			for (size_t i = first; i < last; i++)
+			{
+				const glm::vec3* corner = &corners[size_t(order[i]) * 3];
+				Triangle& triangle = triangles[i];
+				triangle.v0 = corner[0];
+				triangle.e1 = corner[1] - corner[0];
+				triangle.e2 = corner[2] - corner[0];
+				triangle.index = order[i];
+			}
+		});
+		stats.buildMilliseconds = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+	}
+
+	void clear()
+	{
+		nodes.clear();
+		triangles.clear();
+		stats = BvhStats();
+	}
+
+	bool empty() const
+	{
+		return nodes.empty();
+	}
+
+	// the nearest hit, visiting the nearer children first
+	bool intersect(const BvhRay& ray, BvhHit& hit) const
+	{
+		if (nodes.empty())
+			return false;
+		struct Entry {
+			uint32_t child;
+			uint32_t count;
+			float t;
+		};
+		Entry stack[BVH_STACK_SIZE];
+		int size = 0;
+		stack[size++] = Entry{ 0, 0, ray.tMin };
+		float tMax = ray.tMax;
+		uint32_t nearest = BVH_NO_HIT;
+		while (size > 0)
+		{
+			Entry entry = stack[--size];
+			if (entry.t > tMax)
+				continue;
+			if (entry.count > 0)
+			{
+				for (uint32_t i = entry.child; i < entry.child + entry.count; i++)
+				{
+					float t, u, v;
+					if (intersectTriangle(triangles[i], ray, tMax, t, u, v))
+					{
+						tMax = t;
+						hit.t = t;
+						hit.u = u;
+						hit.v = v;
+						nearest = i;
+					}
+				}
+				continue;
+			}
+
+			const WideNode& node = nodes[entry.child];
+			float tNear[4];
+			int mask = intersectChildren(node, ray, tMax, tNear);
+			// farthest pushed first, so the nearest comes off next
+			Entry entered[4];
+			int count = 0;
+			for (int c = 0; c < 4; c++)
+			{
+				if (!(mask & (1 << c)))
+					continue;
+				int at = count++;
+				while (at > 0 && entered[at - 1].t < tNear[c])
+				{
+					entered[at] = entered[at - 1];
+					at--;
+				}
+				entered[at] = Entry{ node.child[c], node.count[c], tNear[c] };
+			}
+			for (int c = 0; c < count; c++)
+				stack[size++] = entered[c];
+		}
+		if (nearest == BVH_NO_HIT)
+			return false;
+		hit.triangle = triangles[nearest].index;
+		return true;
+	}
+
+	// whether anything is hit at all, for shadow and occlusion rays
+	bool occluded(const BvhRay& ray) const
+	{
+		if (nodes.empty())
+			return false;
+		uint32_t stack[BVH_STACK_SIZE * 2];
+		int size = 0;
+		stack[size++] = 0;
+		stack[size++] = 0;
+		while (size > 0)
+		{
+			uint32_t count = stack[--size];
+			uint32_t child = stack[--size];
+			if (count > 0)
+			{
+				for (uint32_t i = child; i < child + count; i++)
+				{
+					float t, u, v;
+					if (intersectTriangle(triangles[i], ray, ray.tMax, t, u, v))
+						return true;
+				}
+				continue;
+			}
+
+			const WideNode& node = nodes[child];
+			float tNear[4];
+			int mask = intersectChildren(node, ray, ray.tMax, tNear);
+			for (int c = 0; c < 4; c++)
+			{
+				if (mask & (1 << c))
+				{
+					stack[size++] = node.child[c];
+					stack[size++] = node.count[c];
+				}
+			}
+		}
+		return false;
+	}
+
+private:
+	// a triangle as leaves store it, with its index in build()
+	struct Triangle {
+		glm::vec3 v0;
+		glm::vec3 e1;
+		glm::vec3 e2;
+		uint32_t index;
+	};
+
+	struct Box {
+		glm::vec3 lo = glm::vec3(FLT_MAX);
+		glm::vec3 hi = glm::vec3(-FLT_MAX);
+
+		void grow(const glm::vec3& p)
+		{
+			lo = glm::min(lo, p);
+			hi = glm::max(hi, p);
+		}
+
+		void grow(const Box& box)
+		{
+			lo = glm::min(lo, box.lo);
+			hi = glm::max(hi, box.hi);
+		}
+
+		// half the surface, all the SAH compares
+		float area() const
+		{
+			glm::vec3 d = hi - lo;
+			return d.x < 0.0f ? 0.0f : d.x * d.y + d.y * d.z + d.z * d.x;
+		}
+	};
+
+	// a node of the binary tree: a leaf of count triangles of the order from first, or
+	// with no triangles, the parent of left and left + 1
+	struct BuildNode {
+		Box box;
+		uint32_t left;
+		uint32_t first;
+		uint32_t count;
+	};
+
+	struct BuildTask {
+		uint32_t node;
+		uint32_t begin;
+		uint32_t end;
+		uint32_t depth;
+	};
+
+	// four children's boxes, lower corners in bounds[0] and upper ones in bounds[1],
+	// one axis per row. A child with a count is a leaf of the triangles from child on;
+	// empty slots have inverted boxes, which no ray enters.
+	struct alignas(16) WideNode {
+		float bounds[2][3][4];
+		uint32_t child[4];
+		uint32_t count[4];
+	};
+
+	ThreadPool* pool = nullptr;
+	vector<Box> boxes;
+	vector<glm::vec3> centroids;
+	vector<uint32_t> order;
+	vector<BuildNode> buildNodes;
+	atomic<uint32_t> nextNode{ 0 };
+	mutex taskMutex;
+	vector<BuildTask> tasks;
+	atomic<unsigned int> pendingTasks{ 0 };
+	vector<WideNode> nodes;
+	vector<Triangle> triangles;
+
+	// job on every worker of the pool and on the calling thread
+	void parallel(const function<void()>& job)
+	{
+		vector<future<void>> done;
+		for (unsigned int w = 0; pool && w < pool->size(); w++)
+			done.push_back(pool->submit([&job] { job(); }));
+		job();
+		for (future<void>& d : done)
+			d.get();
+	}
+
+	void parallelChunks(size_t count, const function<void(size_t, size_t)>& job)
+	{
+		atomic<size_t> next{ 0 };
+		parallel([&] {
+			for (size_t first = next.fetch_add(BVH_CHUNK); first < count; first = next.fetch_add(BVH_CHUNK))
+				job(first, std::min(first + BVH_CHUNK, count));
+		});
+	}
+
+	// splits the range of a task down to its leaves, sharing the large halves
+	void build(const BuildTask& task)
+	{
+		vector<BuildTask> local(1, task);
+		while (!local.empty())
+		{
+			BuildTask current = local.back();
+			local.pop_back();
+			uint32_t middle;
+			if (!split(current, middle))
+				continue;
+
+			uint32_t left = nextNode.fetch_add(2);
+			buildNodes[current.node].left = left;
+			BuildTask halves[2] = {
+				BuildTask{ left, current.begin, middle, current.depth + 1 },
+				BuildTask{ left + 1, middle, current.end, current.depth + 1 }
+			};
+			for (const BuildTask& half : halves)
+			{
+				if (half.end - half.begin >= BVH_TASK_SIZE)
+				{
+					pendingTasks++;
+					lock_guard<mutex> lock(taskMutex);
+					tasks.push_back(half);
+				}
+				else
+					local.push_back(half);
+			}
+		}
+	}
+
+	// bounds the task's node and finds where its range splits, partitioning the order
+	// there; false leaves the node a leaf
+	bool split(const BuildTask& task, uint32_t& middle)
+	{
+		BuildNode& node = buildNodes[task.node];
+		Box box, centroidBox;
+		for (uint32_t i = task.begin; i < task.end; i++)
+		{
+			box.grow(boxes[order[i]]);
+			centroidBox.grow(centroids[order[i]]);
+		}
+		node.box = box;
+		node.first = task.begin;
+		node.count = task.end - task.begin;
+		uint32_t count = node.count;
+		if (count <= 1 || task.depth >= BVH_MAX_DEPTH)
+			return false;
+
+		// cost in triangle tests: a leaf tests them all, a split visits a node (about
+		// one test) and then each half in proportion to its share of the surface
+		int bestAxis = -1;
+		int bestBin = 0;
+		float bestCost = FLT_MAX;
+		float area = box.area();
+		for (int axis = 0; axis < 3 && area > 0.0f; axis++)
+		{
+			float lo = centroidBox.lo[axis];
+			float extent = centroidBox.hi[axis] - lo;
+			if (!(extent > 0.0f))
+				continue;
+			float scale = BVH_BINS * 0.9999f / extent;
+
+			Box bins[BVH_BINS];
+			uint32_t counts[BVH_BINS] = {};
+			for (uint32_t i = task.begin; i < task.end; i++)
+			{
+				int bin = std::min(static_cast<int>((centroids[order[i]][axis] - lo) * scale), BVH_BINS - 1);
+				bins[bin].grow(boxes[order[i]]);
+				counts[bin]++;
+			}
+
+			// the right side of every plane, then the left while sweeping
+			float rightAreas[BVH_BINS];
+			uint32_t rightCounts[BVH_BINS];
+			Box right;
+			uint32_t rightCount = 0;
+			for (int b = BVH_BINS - 1; b > 0; b--)
+			{
+				right.grow(bins[b]);
+				rightCount += counts[b];
+				rightAreas[b] = right.area();
+				rightCounts[b] = rightCount;
+			}
+			Box left;
+			uint32_t leftCount = 0;
+			for (int b = 1; b < BVH_BINS; b++)
+			{
+				left.grow(bins[b - 1]);
+				leftCount += counts[b - 1];
+				if (leftCount == 0 || rightCounts[b] == 0)
+					continue;
+				float cost = 1.0f + (left.area() * leftCount + rightAreas[b] * rightCounts[b]) / area;
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = b;
+				}
+			}
+		}
+
+		if (count <= BVH_LEAF_SIZE && !(bestCost < float(count)))
+			return false;
+
+		middle = task.begin + count / 2;
+		if (bestAxis >= 0)
+		{
+			float lo = centroidBox.lo[bestAxis];
+			float scale = BVH_BINS * 0.9999f / (centroidBox.hi[bestAxis] - lo);
+			middle = static_cast<uint32_t>(std::partition(order.begin() + task.begin, order.begin() + task.end, [&](uint32_t t) {
+				return std::min(static_cast<int>((centroids[t][bestAxis] - lo) * scale), BVH_BINS - 1) < bestBin;
+			}) - order.begin());
+		}
+		// centroids all in one place: halves of the range, in any order
+		if (middle == task.begin || middle == task.end)
+			middle = task.begin + count / 2;
+		node.count = 0;
+		return true;
+	}
+
+	// the wide node for a binary one: its children, opened largest first until there
+	// are four, as the children of one node
+	uint32_t collapse(uint32_t binary)
+	{
+		uint32_t index = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back();
+
+		uint32_t children[4];
+		int count = 0;
+		const BuildNode& root = buildNodes[binary];
+		if (root.count > 0)
+			children[count++] = binary;
+		else
+		{
+			children[count++] = root.left;
+			children[count++] = root.left + 1;
+		}
+		while (count < 4)
+		{
+			int largest = -1;
+			float largestArea = -1.0f;
+			for (int c = 0; c < count; c++)
+			{
+				const BuildNode& child = buildNodes[children[c]];
+				if (child.count == 0 && child.box.area() > largestArea)
+				{
+					largest = c;
+					largestArea = child.box.area();
+				}
+			}
+			if (largest < 0)
+				break;
+			uint32_t opened = buildNodes[children[largest]].left;
+			children[largest] = opened;
+			children[count++] = opened + 1;
+		}
+
+		WideNode node;
+		for (int c = 0; c < 4; c++)
+		{
+			const Box& box = c < count ? buildNodes[children[c]].box : Box();
+			for (int axis = 0; axis < 3; axis++)
+			{
+				node.bounds[0][axis][c] = box.lo[axis];
+				node.bounds[1][axis][c] = box.hi[axis];
+			}
+			node.child[c] = 0;
+			node.count[c] = 0;
+		}
+		for (int c = 0; c < count; c++)
+		{
+			const BuildNode& child = buildNodes[children[c]];
+			if (child.count > 0)
+			{
+				node.child[c] = child.first;
+				node.count[c] = child.count;
+				stats.leaves++;
+			}
+			else
+				node.child[c] = collapse(children[c]);
+		}
+		nodes[index] = node;
+		return index;
+	}
+
+	// which of the node's children the ray enters before tMax, as a bit mask, and where
+	static int intersectChildren(const WideNode& node, const BvhRay& ray, float tMax, float* tNear)
+	{
+#ifdef BVH_SSE
+		__m128 enter = _mm_set1_ps(ray.tMin);
+		__m128 leave = _mm_set1_ps(tMax);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			__m128 origin = _mm_set1_ps(ray.origin[axis]);
+			__m128 inverse = _mm_set1_ps(ray.inverse[axis]);
+			enter = _mm_max_ps(enter, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.near[axis]][axis]), origin), inverse));
+			leave = _mm_min_ps(leave, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - ray.near[axis]][axis]), origin), inverse));
+		}
+		_mm_storeu_ps(tNear, enter);
+		return _mm_movemask_ps(_mm_cmple_ps(enter, leave));
+#else
+		int mask = 0;
+		for (int c = 0; c < 4; c++)
+		{
+			float enter = ray.tMin;
+			float leave = tMax;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				enter = std::max(enter, (node.bounds[ray.near[axis]][axis][c] - ray.origin[axis]) * ray.inverse[axis]);
+				leave = std::min(leave, (node.bounds[1 - ray.near[axis]][axis][c] - ray.origin[axis]) * ray.inverse[axis]);
+			}
+			tNear[c] = enter;
+			if (enter <= leave)
+				mask |= 1 << c;
+		}
+		return mask;
+#endif
+	}
+
+	// Moller-Trumbore
+	static bool intersectTriangle(const Triangle& triangle, const BvhRay& ray, float tMax, float& t, float& u, float& v)
+	{
+		glm::vec3 p = glm::cross(ray.direction, triangle.e2);
+		float determinant = glm::dot(triangle.e1, p);
+		if (determinant == 0.0f)
+			return false;
+		float inverse = 1.0f / determinant;
+		glm::vec3 s = ray.origin - triangle.v0;
+		u = glm::dot(s, p) * inverse;
+		if (u < 0.0f || u > 1.0f)
+			return false;
+		glm::vec3 q = glm::cross(s, triangle.e1);
+		v = glm::dot(ray.direction, q) * inverse;
+		if (v < 0.0f || u + v > 1.0f)
+			return false;
+		t = glm::dot(triangle.e2, q) * inverse;
+		return t > ray.tMin && t < tMax;
+	}
+};
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef VERTEX_LAYOUT_H
+#define VERTEX_LAYOUT_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include <3DViewer/frustum.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+
+#define MAX_BONE_INFLUENCE 4
+// first of the four attribute slots taking the per-instance model matrix
+#define INSTANCE_MATRIX_ATTRIBUTE 7
+
+// as imported; VertexLayout decides what of it is uploaded
+struct Vertex {
+	glm::vec3 Position;
+	glm::vec3 Normal;
+	glm::vec2 TexCoords;
+	glm::vec3 Tangent;
+	glm::vec3 Bitangent;
+	int m_BoneIDs[MAX_BONE_INFLUENCE];
+	float m_Weights[MAX_BONE_INFLUENCE];
+};
+
+// attribute locations shared with shader.vs, one per Vertex member
+enum VertexAttribute {
+	VERTEX_POSITION = 0,
+	VERTEX_NORMAL = 1,
+	VERTEX_TEXCOORDS = 2,
+	VERTEX_TANGENT = 3,
+	VERTEX_BITANGENT = 4,
+	VERTEX_BONE_IDS = 5,
+	VERTEX_WEIGHTS = 6,
+	VERTEX_ATTRIBUTE_COUNT = 7
+};
+
+struct VertexLayoutStats {
+	size_t bytesUnpacked = 0;
+	size_t bytesPacked = 0;
+};
+
+// Which Vertex members reach the GPU and how they are encoded. Only the attributes
+// the program reads are packed, each in the smallest format that holds it:
+//   position   3 x float, or 4 x snorm16 dequantized by positionOffset/positionScale
+//   normal     snorm 10_10_10_2
+//   texcoords  2 x half
+//   tangent    snorm 10_10_10_2
+//   bitangent  snorm 10_10_10_2
+//   bone ids   4 x int16
+//   weights    4 x unorm8
+struct VertexLayout {
+	unsigned int attributes = (1u << VERTEX_ATTRIBUTE_COUNT) - 1;
+	bool quantizePositions = false;
+
+	static VertexLayoutStats stats;
+
+	// layout used for meshes uploaded from now on, every attribute until a program
+	// has been reflected
+	static VertexLayout& active()
+	{
+		static VertexLayout layout;
+		return layout;
+	}
+
+	// the active vertex inputs of a linked program below the instance matrix
+	static VertexLayout fromProgram(unsigned int program, bool quantizePositions = false)
+	{
+		VertexLayout layout;
+		layout.attributes = 0;
+		layout.quantizePositions = quantizePositions;
+
+		GLint count = 0;
+		GLint length = 0;
+		glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &count);
+		glGetProgramiv(program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &length);
+		vector<GLchar> name(length > 0 ? length : 1);
+		for (GLint i = 0; i < count; i++)
+		{
+			GLint size;
+			GLenum type;
+			glGetActiveAttrib(program, i, static_cast<GLsizei>(name.size()), NULL, &size, &type, name.data());
+			GLint location = glGetAttribLocation(program, name.data());
+			if (location >= 0 && location < VERTEX_ATTRIBUTE_COUNT)
+				layout.attributes |= 1u << location;
+		}
+		return layout;
+	}
+
+	bool operator==(const VertexLayout& other) const
+	{
+		return attributes == other.attributes && quantizePositions == other.quantizePositions;
+	}
+
+	bool has(VertexAttribute attribute) const
+	{
+		return (attributes & (1u << attribute)) != 0;
+	}
+
+	static size_t size(VertexAttribute attribute, bool quantizePositions)
+	{
+		switch (attribute)
+		{
+		case VERTEX_POSITION: return quantizePositions ? 4 * sizeof(int16_t) : 3 * sizeof(float);
+		case VERTEX_BONE_IDS: return 4 * sizeof(int16_t);
+		default: return 4;
+		}
+	}
+
+	size_t offset(VertexAttribute attribute) const
+	{
+		size_t offset = 0;
+		for (int i = 0; i < attribute; i++)
+		{
+			if (has(VertexAttribute(i)))
+				offset += size(VertexAttribute(i), quantizePositions);
+		}
+		return offset;
+	}
+
+	size_t stride() const
+	{
+		return offset(VERTEX_ATTRIBUTE_COUNT);
+	}
+
+	// interleaves the vertices in this layout; quantized positions are stored
+	// relative to the bounds, (position - offset) / scale
+	vector<unsigned char> pack(const Vertex* vertices, size_t count, const Bounds& bounds, glm::vec3& positionOffset, glm::vec3& positionScale) const
+	{
+		positionOffset = glm::vec3(0.0f);
+		positionScale = glm::vec3(1.0f);
+		if (quantizePositions)
+		{
+			positionOffset = (bounds.min + bounds.max) * 0.5f;
+			positionScale = glm::max((bounds.max - bounds.min) * 0.5f, glm::vec3(1e-6f));
+		}
+
+		size_t vertexStride = stride();
+		vector<unsigned char> packed(vertexStride * count);
+		for (size_t v = 0; v < count; v++)
+		{
+			const Vertex& vertex = vertices[v];
+			unsigned char* out = packed.data() + v * vertexStride;
+
+			if (has(VERTEX_POSITION))
+			{
+				if (quantizePositions)
+					out = put(out, glm::packSnorm4x16(glm::vec4((vertex.Position - positionOffset) / positionScale, 0.0f)));
+				else
+					out = put(out, vertex.Position);
+			}
+			if (has(VERTEX_NORMAL))
+				out = put(out, glm::packSnorm3x10_1x2(glm::vec4(vertex.Normal, 0.0f)));
+			if (has(VERTEX_TEXCOORDS))
+				out = put(out, glm::packHalf2x16(vertex.TexCoords));
+			if (has(VERTEX_TANGENT))
+				out = put(out, glm::packSnorm3x10_1x2(glm::vec4(safeNormalize(vertex.Tangent), 0.0f)));
+			if (has(VERTEX_BITANGENT))
+				out = put(out, glm::packSnorm3x10_1x2(glm::vec4(safeNormalize(vertex.Bitangent), 0.0f)));
+			if (has(VERTEX_BONE_IDS))
+			{
+				int16_t ids[4];
+				for (int i = 0; i < 4; i++)
+					ids[i] = static_cast<int16_t>(vertex.m_BoneIDs[i]);
+				out = put(out, ids);
+			}
+			if (has(VERTEX_WEIGHTS))
+				out = put(out, glm::packUnorm4x8(glm::vec4(vertex.m_Weights[0], vertex.m_Weights[1], vertex.m_Weights[2], vertex.m_Weights[3])));
+		}
+
+		stats.bytesUnpacked += count * sizeof(Vertex);
+		stats.bytesPacked += packed.size();
+		return packed;
+	}
+
+	// points the enabled attributes of the bound VAO at the bound array buffer
+	void setupAttributes() const
+	{
+		GLsizei vertexStride = static_cast<GLsizei>(stride());
+		for (int i = 0; i < VERTEX_ATTRIBUTE_COUNT; i++)
+		{
+			VertexAttribute attribute = VertexAttribute(i);
+			if (!has(attribute))
+			{
+				glDisableVertexAttribArray(i);
+				continue;
+			}
+
+			void* pointer = (void*)offset(attribute);
+			glEnableVertexAttribArray(i);
+			switch (attribute)
+			{
+			case VERTEX_POSITION:
+				if (quantizePositions)
+					glVertexAttribPointer(i, 4, GL_SHORT, GL_TRUE, vertexStride, pointer);
+				else
+					glVertexAttribPointer(i, 3, GL_FLOAT, GL_FALSE, vertexStride, pointer);
+				break;
+			case VERTEX_TEXCOORDS:
+				glVertexAttribPointer(i, 2, GL_HALF_FLOAT, GL_FALSE, vertexStride, pointer);
+				break;
+			case VERTEX_BONE_IDS:
+				glVertexAttribIPointer(i, 4, GL_SHORT, vertexStride, pointer);
+				break;
+			case VERTEX_WEIGHTS:
+				glVertexAttribPointer(i, 4, GL_UNSIGNED_BYTE, GL_TRUE, vertexStride, pointer);
+				break;
+			default:
+				glVertexAttribPointer(i, 4, GL_INT_2_10_10_10_REV, GL_TRUE, vertexStride, pointer);
+				break;
+			}
+		}
+	}
+
+private:
+	template <typename T>
+	static unsigned char* put(unsigned char* out, const T& value)
+	{
+		memcpy(out, &value, sizeof(T));
+		return out + sizeof(T);
+	}
+
+	static glm::vec3 safeNormalize(const glm::vec3& v)
+	{
+		float length = glm::length(v);
+		return length > 0.0f ? v / length : v;
+	}
+};
+
+VertexLayoutStats VertexLayout::stats;
+
+#endif